@@ -57,18 +57,185 @@ __kernel  void OCL_SSSP_KERNEL1(__global int *vertexArray, __global int *edgeArr
     }
 }
 
+///
+/// Index one past the last edge of vertex
+///
+int edgeEndOfVertex( __global int *vertexArray, int vertex, int vertexCount, int edgeCount )
+{
+    return (vertex + 1 < vertexCount) ? vertexArray[vertex + 1] : edgeCount;
+}
+
+///
+/// Load balanced version of OCL_SSSP_KERNEL1 for graphs with a skewed degree
+/// distribution.  Vertices with at most heavyDegree edges are expanded by their
+/// own work-item as before.  Vertices with more are queued in local memory and
+/// their edges are then shared out evenly between all of the work-items in the
+/// work-group.  Each work-item finds the vertex owning its edge by a binary
+/// search of the prefix offsets of the queued vertices' edge lists, so a single
+/// hub vertex no longer keeps one work-item busy while the rest sit idle.
+///
+/// heavyVertices must hold one int per work-item and heavyEdgeOffsets one more.
+///
+__kernel  void OCL_SSSP_KERNEL1_BALANCED(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                         __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
+                                         int vertexCount, int edgeCount, int heavyDegree,
+                                         __local int *heavyVertices, __local int *heavyEdgeOffsets )
+{
+    __local int heavyCount;
+
+    // access thread id
+    int tid = get_global_id(0);
+    int lid = get_local_id(0);
+
+    if (lid == 0)
+    {
+        heavyCount = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if ( tid < vertexCount && maskArray[tid] != 0 )
+    {
+        maskArray[tid] = 0;
+
+        int edgeStart = vertexArray[tid];
+        int edgeEnd = edgeEndOfVertex(vertexArray, tid, vertexCount, edgeCount);
+
+        if (edgeEnd - edgeStart > heavyDegree)
+        {
+            heavyVertices[atomic_inc(&heavyCount)] = tid;
+        }
+        else
+        {
+            for(int edge = edgeStart; edge < edgeEnd; edge++)
+            {
+                int nid = edgeArray[edge];
+                if (updatingCostArray[nid] > (costArray[tid] + weightArray[edge]))
+                {
+                    updatingCostArray[nid] = (costArray[tid] + weightArray[edge]);
+                }
+            }
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Offsets of each queued vertex's edges within the work-group's share.  There
+    // are few heavy vertices and each has many edges, so one work-item does this.
+    if (lid == 0)
+    {
+        int offset = 0;
+        for (int i = 0; i < heavyCount; i++)
+        {
+            int vertex = heavyVertices[i];
+            heavyEdgeOffsets[i] = offset;
+            offset += edgeEndOfVertex(vertexArray, vertex, vertexCount, edgeCount) - vertexArray[vertex];
+        }
+        heavyEdgeOffsets[heavyCount] = offset;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int heavyEdges = heavyEdgeOffsets[heavyCount];
+    for (int k = lid; k < heavyEdges; k += get_local_size(0))
+    {
+        // Find the last queued vertex whose edges start at or before k
+        int low = 0;
+        int high = heavyCount - 1;
+        while (low < high)
+        {
+            int mid = (low + high + 1) / 2;
+            if (heavyEdgeOffsets[mid] <= k)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid - 1;
+            }
+        }
+
+        int vertex = heavyVertices[low];
+        int edge = vertexArray[vertex] + (k - heavyEdgeOffsets[low]);
+        int nid = edgeArray[edge];
+        if (updatingCostArray[nid] > (costArray[vertex] + weightArray[edge]))
+        {
+            updatingCostArray[nid] = (costArray[vertex] + weightArray[edge]);
+        }
+    }
+}
+
+///
+/// Version of OCL_SSSP_KERNEL1 reading a compressed graph (see CompressedGraphData).
+/// Each vertex's destinations are delta coded varints, each followed by a 16-bit
+/// weight scaled by weightScale, which cuts the bytes read per relaxed edge from
+/// eight to typically three or four.
+///
+__kernel  void OCL_SSSP_KERNEL1_COMPRESSED(__global int *vertexArray, __global uchar *edgeBytes,
+                                           __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
+                                           int vertexCount, int edgeByteCount, float weightScale )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if ( maskArray[tid] != 0 )
+    {
+        maskArray[tid] = 0;
+
+        int pos = vertexArray[tid];
+        int end = (tid + 1 < vertexCount) ? vertexArray[tid + 1] : edgeByteCount;
+
+        // The first destination is relative to the vertex itself
+        int nid = tid;
+        bool first = true;
+
+        while (pos < end)
+        {
+            uint delta = 0;
+            int shift = 0;
+            uchar byte;
+            do
+            {
+                byte = edgeBytes[pos++];
+                delta |= (uint)(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+
+            if (first)
+            {
+                // Undo the zig-zag encoding of the signed first difference
+                nid += (int)(delta >> 1) ^ -(int)(delta & 1);
+                first = false;
+            }
+            else
+            {
+                nid += (int)delta;
+            }
+
+            float weight = (float)(edgeBytes[pos] | (edgeBytes[pos + 1] << 8)) * weightScale;
+            pos += 2;
+
+            if (updatingCostArray[nid] > (costArray[tid] + weight))
+            {
+                updatingCostArray[nid] = (costArray[tid] + weight);
+            }
+        }
+    }
+}
+
 ///
 /// This is part 2 of the Kernel from Algorithm 5 in the paper.  
 ///
+/// Costs above maxCost are dropped rather than taken, so that a search bounded
+/// to a radius stops once nothing within it is left to improve.  Unbounded
+/// searches pass FLT_MAX.
+///
 __kernel  void OCL_SSSP_KERNEL2(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
                                 __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
-                                int vertexCount)
+                                int vertexCount, float maxCost)
 {
     // access thread id
     int tid = get_global_id(0);
 
 
-    if (costArray[tid] > updatingCostArray[tid])
+    if (costArray[tid] > updatingCostArray[tid] && updatingCostArray[tid] <= maxCost)
     {
         costArray[tid] = updatingCostArray[tid];
         maskArray[tid] = 1;
@@ -103,3 +270,391 @@ __kernel void initializeBuffers( __global int *maskArray, __global float *costAr
 
 }
 
+///
+/// Kernel to find the lowest cost of any vertex in the frontier, the vertices
+/// with their mask set.  Once this is no lower than the cost of a vertex, that
+/// vertex's cost can no longer improve.  The costs are never negative, so
+/// comparing their bit patterns as integers orders them the same as comparing
+/// them as floats.  minimumCost must be set to as_int(FLT_MAX) beforehand.
+///
+__kernel void frontierMinimum( __global int *maskArray, __global float *costArray,
+                               __global int *minimumCost, int vertexCount )
+{
+    __local int localMinimum;
+
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (get_local_id(0) == 0)
+    {
+        localMinimum = as_int(FLT_MAX);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (tid < vertexCount && maskArray[tid] != 0)
+    {
+        atomic_min(&localMinimum, as_int(costArray[tid]));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Only one atomic per work-group on the global result
+    if (get_local_id(0) == 0 && localMinimum != as_int(FLT_MAX))
+    {
+        atomic_min(minimumCost, localMinimum);
+    }
+}
+
+///
+/// Kernel to set every predecessor to -1 before they are derived
+///
+__kernel void initializePredecessors( __global int *predecessorArray )
+{
+    // access thread id
+    int tid = get_global_id(0);
+    predecessorArray[tid] = -1;
+}
+
+///
+/// Kernel to find a predecessor for every vertex once the costs have converged,
+/// for devices without 64-bit atomics.  Any vertex whose cost plus the weight of
+/// an edge equals the cost at the other end lies on a shortest path to it.  If
+/// several do, whichever write lands last wins, which is equally valid.
+///
+__kernel void derivePredecessors( __global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                  __global float *costArray, __global int *predecessorArray,
+                                  int sourceVertex, int vertexCount, int edgeCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < vertexCount && costArray[tid] != FLT_MAX)
+    {
+        int edgeStart = vertexArray[tid];
+        int edgeEnd;
+        if (tid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[tid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            if (nid != sourceVertex && nid != tid && costArray[nid] == (costArray[tid] + weightArray[edge]))
+            {
+                predecessorArray[nid] = tid;
+            }
+        }
+    }
+}
+
+///
+/// Kernel to write a batch of edge weights, one work-item per changed edge
+///
+__kernel void scatterEdgeWeights( __global float *weightArray, __global int *changedEdges,
+                                  __global float *changedWeights, int numChanges )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < numChanges)
+    {
+        weightArray[changedEdges[tid]] = changedWeights[tid];
+    }
+}
+
+///
+/// Kernel to seed the repair of a previous search after a batch of edge weight
+/// changes, one work-item per changed edge.  With increases set, the far end of
+/// every heavier edge that its predecessor array says lay on a shortest path is
+/// marked to be invalidated.  Otherwise the near end of every lighter edge is put
+/// back in the frontier so that it relaxes the edge again.
+///
+__kernel void markChangedEdges( __global int *edgeArray, __global int *changedSources, __global int *changedEdges,
+                                __global float *oldWeights, __global float *newWeights,
+                                __global int *maskArray, __global float *costArray, __global int *predecessorArray,
+                                int sourceVertex, int numChanges, int increases )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < numChanges)
+    {
+        int vertex = changedSources[tid];
+        int nid = edgeArray[changedEdges[tid]];
+
+        if (costArray[vertex] == FLT_MAX)
+        {
+            return;
+        }
+
+        if (increases)
+        {
+            if (newWeights[tid] > oldWeights[tid] && nid != sourceVertex && predecessorArray[nid] == vertex)
+            {
+                maskArray[nid] = 1;
+            }
+        }
+        else if (newWeights[tid] < oldWeights[tid])
+        {
+            maskArray[vertex] = 1;
+        }
+    }
+}
+
+///
+/// Kernel to invalidate the part of the shortest path tree hanging off of the
+/// vertices in the mask.  Each one has its cost and predecessor reset and marks
+/// every vertex whose predecessor it was.  Run until the mask is empty.
+///
+__kernel void invalidateSubtree( __global int *vertexArray, __global int *edgeArray, __global int *predecessorArray,
+                                 __global int *maskArray, __global float *costArray, __global float *updatingCostArray,
+                                 int sourceVertex, int vertexCount, int edgeCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < vertexCount && maskArray[tid] != 0)
+    {
+        maskArray[tid] = 0;
+
+        float cost = costArray[tid];
+        if (cost == FLT_MAX)
+        {
+            return;
+        }
+        costArray[tid] = FLT_MAX;
+        updatingCostArray[tid] = FLT_MAX;
+        predecessorArray[tid] = -1;
+
+        int edgeEnd = edgeEndOfVertex(vertexArray, tid, vertexCount, edgeCount);
+        for(int edge = vertexArray[tid]; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            if (nid != sourceVertex && predecessorArray[nid] == tid)
+            {
+                maskArray[nid] = 1;
+            }
+        }
+    }
+}
+
+///
+/// Kernel to put back in the frontier every vertex that still has a cost and an
+/// edge to an invalidated vertex, so that the invalidated vertices are reached
+/// again.  Any vertex with such an edge is reachable, so the only vertices
+/// without a cost at this point are the invalidated ones.
+///
+__kernel void seedInvalidatedVertices( __global int *vertexArray, __global int *edgeArray,
+                                       __global int *maskArray, __global float *costArray,
+                                       int vertexCount, int edgeCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < vertexCount && costArray[tid] != FLT_MAX)
+    {
+        int edgeEnd = edgeEndOfVertex(vertexArray, tid, vertexCount, edgeCount);
+        for(int edge = vertexArray[tid]; edge < edgeEnd; edge++)
+        {
+            if (costArray[edgeArray[edge]] == FLT_MAX)
+            {
+                maskArray[tid] = 1;
+                break;
+            }
+        }
+    }
+}
+
+///
+/// Kernel to find the predecessors of the vertices a repair gave a new cost,
+/// which are the invalidated ones and those whose cost went down.  The rest
+/// keep the predecessor they had.  The costs compared here were all computed
+/// on this device, either before the repair or during it.
+///
+__kernel void repairPredecessors( __global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                  __global float *costArray, __global float *previousCostArray,
+                                  __global int *predecessorArray, int sourceVertex, int vertexCount, int edgeCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < vertexCount && costArray[tid] != FLT_MAX)
+    {
+        int edgeEnd = edgeEndOfVertex(vertexArray, tid, vertexCount, edgeCount);
+        for(int edge = vertexArray[tid]; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            if (nid != sourceVertex && nid != tid &&
+                (predecessorArray[nid] == -1 || costArray[nid] < previousCostArray[nid]) &&
+                costArray[nid] == (costArray[tid] + weightArray[edge]))
+            {
+                predecessorArray[nid] = tid;
+            }
+        }
+    }
+}
+
+///
+/// Kernel to count the vertices in the frontier and the edges leaving them,
+/// which are the edges the next OCL_SSSP_KERNEL1 will relax.  The counts are
+/// added to counts[2 * slot] and counts[2 * slot + 1].
+///
+__kernel void countFrontier( __global int *vertexArray, __global int *maskArray, __global uint *counts,
+                             int slot, int vertexCount, int edgeCount )
+{
+    __local uint localVertices;
+    __local uint localEdges;
+
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (get_local_id(0) == 0)
+    {
+        localVertices = 0;
+        localEdges = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (tid < vertexCount && maskArray[tid] != 0)
+    {
+        atomic_inc(&localVertices);
+        atomic_add(&localEdges, (uint)(edgeEndOfVertex(vertexArray, tid, vertexCount, edgeCount) - vertexArray[tid]));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Only one atomic per work-group on the global counts
+    if (get_local_id(0) == 0 && localVertices != 0)
+    {
+        atomic_add(&counts[2 * slot], localVertices);
+        atomic_add(&counts[2 * slot + 1], localEdges);
+    }
+}
+
+///
+/// Kernel to count the target vertices whose cost is final, that is no higher
+/// than the lowest cost in the frontier as found by frontierMinimum
+///
+__kernel void countSettledTargets( __global int *targetArray, __global float *costArray,
+                                   __global int *minimumCost, __global int *settledCount, int vertexCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < vertexCount && targetArray[tid] != 0 &&
+        costArray[tid] != FLT_MAX && costArray[tid] <= as_float(*minimumCost))
+    {
+        atomic_inc(settledCount);
+    }
+}
+
+///
+/// Kernel to gather the reached vertices with a cost of at most maxCost into a
+/// compact list of (vertex, cost) pairs.  If targetArray is not NULL only the
+/// vertices flagged in it are gathered.  The order of the list is arbitrary.
+///
+__kernel void compactCosts( __global float *costArray, __global int *targetArray,
+                            __global int *outVertices, __global float *outCosts, __global int *outCount,
+                            float maxCost, int vertexCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if (tid < vertexCount && costArray[tid] != FLT_MAX && costArray[tid] <= maxCost &&
+        (targetArray == 0 || targetArray[tid] != 0))
+    {
+        int index = atomic_inc(outCount);
+        outVertices[index] = tid;
+        outCosts[index] = costArray[tid];
+    }
+}
+
+#ifdef cl_khr_int64_extended_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+
+///
+/// Pack a cost and the vertex it was reached from into a single 64-bit word with
+/// the cost in the high half.  Costs are never negative, so the lowest word is
+/// the lowest cost, and both halves can be updated together with one atom_min.
+///
+ulong packCostAndParent( float cost, int parent )
+{
+    return ((ulong)as_uint(cost) << 32) | (uint)parent;
+}
+
+///
+/// Kernel to initialize the packed costs and predecessors
+///
+__kernel void initializeCostParent( __global ulong *updatingCostParentArray, __global int *predecessorArray,
+                                    int sourceVertex )
+{
+    // access thread id
+    int tid = get_global_id(0);
+    updatingCostParentArray[tid] = packCostAndParent((sourceVertex == tid) ? 0.0f : FLT_MAX, -1);
+    predecessorArray[tid] = -1;
+}
+
+///
+/// Part 1 of the algorithm as in OCL_SSSP_KERNEL1, but recording the vertex each
+/// cost came from along with the cost
+///
+__kernel  void OCL_SSSP_KERNEL1_PREDECESSOR(__global int *vertexArray, __global int *edgeArray, __global float *weightArray,
+                                            __global int *maskArray, __global float *costArray,
+                                            __global ulong *updatingCostParentArray,
+                                            int vertexCount, int edgeCount )
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    if ( maskArray[tid] != 0 )
+    {
+        maskArray[tid] = 0;
+
+        int edgeStart = vertexArray[tid];
+        int edgeEnd;
+        if (tid + 1 < (vertexCount))
+        {
+            edgeEnd = vertexArray[tid + 1];
+        }
+        else
+        {
+            edgeEnd = edgeCount;
+        }
+
+        for(int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = edgeArray[edge];
+            atom_min(&updatingCostParentArray[nid], packCostAndParent(costArray[tid] + weightArray[edge], tid));
+        }
+    }
+}
+
+///
+/// Part 2 of the algorithm as in OCL_SSSP_KERNEL2, taking the predecessor along
+/// with any lower cost
+///
+__kernel  void OCL_SSSP_KERNEL2_PREDECESSOR(__global int *maskArray, __global float *costArray,
+                                            __global ulong *updatingCostParentArray, __global int *predecessorArray,
+                                            int vertexCount)
+{
+    // access thread id
+    int tid = get_global_id(0);
+
+    ulong updatingCostParent = updatingCostParentArray[tid];
+    float updatingCost = as_float((uint)(updatingCostParent >> 32));
+
+    if (costArray[tid] > updatingCost)
+    {
+        costArray[tid] = updatingCost;
+        predecessorArray[tid] = (int)(uint)updatingCostParent;
+        maskArray[tid] = 1;
+    }
+
+    updatingCostParentArray[tid] = packCostAndParent(costArray[tid], predecessorArray[tid]);
+}
+
+#endif // cl_khr_int64_extended_atomics
+
@@ -0,0 +1,118 @@
+//
+//
+//  Description:
+//      Blocked Floyd-Warshall all-pairs shortest path.  The distance matrix is
+//      split into BLOCK_SIZE x BLOCK_SIZE tiles and for each diagonal tile k the
+//      three phases below are run in turn:
+//
+//          1. the diagonal tile (k, k) is solved on its own
+//          2. the tiles in row k and column k are updated from the diagonal tile
+//          3. every other tile (i, j) is updated from tiles (i, k) and (k, j)
+//
+//      Each work-group handles one tile, holding the tiles it needs in local
+//      memory.  The matrix is n x n with n a multiple of BLOCK_SIZE, and
+//      unreachable entries hold FLT_MAX.
+//
+//
+
+// Must match FW_BLOCK_SIZE in oclFloydWarshall.cpp
+#define BLOCK_SIZE 16
+
+///
+/// Phase 1: solve the diagonal tile (k, k)
+///
+__kernel void floydWarshallPhase1( __global float *distance, int n, int k )
+{
+    __local float tile[BLOCK_SIZE][BLOCK_SIZE];
+
+    int tx = get_local_id(0);
+    int ty = get_local_id(1);
+    int base = k * BLOCK_SIZE;
+
+    tile[ty][tx] = distance[(base + ty) * n + base + tx];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int m = 0; m < BLOCK_SIZE; m++)
+    {
+        float viaM = tile[ty][m] + tile[m][tx];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tile[ty][tx] = fmin(tile[ty][tx], viaM);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    distance[(base + ty) * n + base + tx] = tile[ty][tx];
+}
+
+///
+/// Phase 2: update the tiles in row k (get_group_id(1) == 0) and column k
+/// (get_group_id(1) == 1) from the diagonal tile.  get_group_id(0) selects
+/// which tile along the row or column, skipping the diagonal.
+///
+__kernel void floydWarshallPhase2( __global float *distance, int n, int k )
+{
+    __local float diagonal[BLOCK_SIZE][BLOCK_SIZE];
+    __local float tile[BLOCK_SIZE][BLOCK_SIZE];
+
+    int block = get_group_id(0);
+    if (block == k)
+    {
+        return;
+    }
+
+    bool isRow = (get_group_id(1) == 0);
+    int tx = get_local_id(0);
+    int ty = get_local_id(1);
+    int base = k * BLOCK_SIZE;
+    int row = isRow ? base + ty : block * BLOCK_SIZE + ty;
+    int col = isRow ? block * BLOCK_SIZE + tx : base + tx;
+
+    diagonal[ty][tx] = distance[(base + ty) * n + base + tx];
+    tile[ty][tx] = distance[row * n + col];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int m = 0; m < BLOCK_SIZE; m++)
+    {
+        float viaM = isRow ? diagonal[ty][m] + tile[m][tx] : tile[ty][m] + diagonal[m][tx];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        tile[ty][tx] = fmin(tile[ty][tx], viaM);
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    distance[row * n + col] = tile[ty][tx];
+}
+
+///
+/// Phase 3: update every tile outside row and column k.  Tiles (i, k) and (k, j)
+/// are final by now and the tile itself is not read while it is updated, so
+/// there is no need to synchronize inside the loop.
+///
+__kernel void floydWarshallPhase3( __global float *distance, int n, int k )
+{
+    __local float columnTile[BLOCK_SIZE][BLOCK_SIZE];
+    __local float rowTile[BLOCK_SIZE][BLOCK_SIZE];
+
+    int blockX = get_group_id(0);
+    int blockY = get_group_id(1);
+    if (blockX == k || blockY == k)
+    {
+        return;
+    }
+
+    int tx = get_local_id(0);
+    int ty = get_local_id(1);
+    int base = k * BLOCK_SIZE;
+    int row = blockY * BLOCK_SIZE + ty;
+    int col = blockX * BLOCK_SIZE + tx;
+
+    columnTile[ty][tx] = distance[row * n + base + tx];
+    rowTile[ty][tx] = distance[(base + ty) * n + col];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    float best = distance[row * n + col];
+    for (int m = 0; m < BLOCK_SIZE; m++)
+    {
+        best = fmin(best, columnTile[ty][m] + rowTile[m][tx]);
+    }
+
+    distance[row * n + col] = best;
+}
@@ -28,10 +28,16 @@
 //
 #include <sstream>
 #include <iostream>
+#include <algorithm>
 #include <boost/program_options.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
 #include "oclDijkstraKernel.h"
+#include "oclDijkstraGraph.h"
+#include "oclDijkstraNative.h"
 
 
 ///
@@ -68,13 +74,169 @@ void generateRandomGraph(GraphData *graph, int numVertices, int neighborsPerVert
     }
 }
 
+///
+//  Millions of traversed edges per second, or 0 if no time was measured
+//
+double computeMTEPS(long long edges, double seconds)
+{
+    return (seconds > 0.0) ? (double)edges / seconds / 1.0e6 : 0.0;
+}
+
+///
+//  Whether two costs agree to within rounding, unreachable vertices having to
+//  agree exactly
+//
+bool costsMatch(float a, float b)
+{
+    if (a == FLT_MAX || b == FLT_MAX)
+    {
+        return (a == b);
+    }
+    return fabsf(a - b) <= 1.0e-4f * fmaxf(1.0f, fmaxf(fabsf(a), fabsf(b)));
+}
+
+///
+//  Count the vertices whose predecessor does not have an edge to them that
+//  accounts for their cost
+//
+int countPredecessorMismatches(const GraphData *graph, const float *costs, const int *predecessors)
+{
+    int mismatches = 0;
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int p = predecessors[v];
+        if (p < 0)
+        {
+            continue;
+        }
+
+        int edgeEnd = (p + 1 < graph->vertexCount) ? graph->vertexArray[p + 1] : graph->edgeCount;
+        bool found = false;
+        for (int edge = graph->vertexArray[p]; !found && edge < edgeEnd; edge++)
+        {
+            found = (graph->edgeArray[edge] == v) && costsMatch(costs[p] + graph->weightArray[edge], costs[v]);
+        }
+        if (!found)
+        {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+///
+//  Print the totals of the per-search stats of one mode
+//
+void printStatsSummary(const char *modeName, const DijkstraStats *stats, int numResults)
+{
+    DijkstraStats total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < numResults; i++)
+    {
+        total.iterations += stats[i].iterations;
+        total.kernelLaunches += stats[i].kernelLaunches;
+        total.maskReadbacks += stats[i].maskReadbacks;
+        total.frontierVertices += stats[i].frontierVertices;
+        total.edgesRelaxed += stats[i].edgesRelaxed;
+        total.kernelTime += stats[i].kernelTime;
+        total.readbackTime += stats[i].readbackTime;
+        total.countTime += stats[i].countTime;
+        total.elapsedTime += stats[i].elapsedTime;
+    }
+
+    printf("\n%s stats: %d iterations, %d kernel launches, %d mask readbacks\n",
+           modeName, total.iterations, total.kernelLaunches, total.maskReadbacks);
+    printf("    %lld frontier vertices, %lld edges relaxed, %f MTEPS (%f MTEPS in kernels)\n",
+           total.frontierVertices, total.edgesRelaxed,
+           computeMTEPS(total.edgesRelaxed, total.elapsedTime), computeMTEPS(total.edgesRelaxed, total.kernelTime));
+    printf("    kernels %f s, readback %f s, elapsed %f s (not counting %f s spent counting the frontier)\n",
+           total.kernelTime, total.readbackTime, total.elapsedTime, total.countTime);
+}
+
+///
+//  Write the per-search stats of each mode that collected them, as JSON if the
+//  file name ends in .json and as CSV otherwise
+//
+bool writeStats(const std::string &fileName, const GraphData *graph, const char **modeNames,
+                DijkstraStats **modeStats, int numModes, int numResults)
+{
+    FILE *file = fopen(fileName.c_str(), "w");
+    if (file == NULL)
+    {
+        printf("Failed to open %s for writing.\n", fileName.c_str());
+        return false;
+    }
+
+    bool json = (fileName.size() >= 5 && fileName.compare(fileName.size() - 5, 5, ".json") == 0);
+    if (json)
+    {
+        fprintf(file, "{\n  \"vertexCount\": %d,\n  \"edgeCount\": %d,\n  \"searches\": [",
+                graph->vertexCount, graph->edgeCount);
+    }
+    else
+    {
+        fprintf(file, "mode,source,iterations,kernel_launches,mask_readbacks,frontier_vertices,edges_relaxed,"
+                      "kernel_s,readback_s,count_s,elapsed_s,mteps,kernel_mteps\n");
+    }
+
+    bool first = true;
+    for (int mode = 0; mode < numModes; mode++)
+    {
+        if (modeStats[mode] == NULL)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < numResults; i++)
+        {
+            const DijkstraStats &stats = modeStats[mode][i];
+            double mteps = computeMTEPS(stats.edgesRelaxed, stats.elapsedTime);
+            double kernelMTEPS = computeMTEPS(stats.edgesRelaxed, stats.kernelTime);
+
+            if (json)
+            {
+                fprintf(file, "%s\n    { \"mode\": \"%s\", \"source\": %d, \"iterations\": %d, "
+                              "\"kernelLaunches\": %d, \"maskReadbacks\": %d, \"frontierVertices\": %lld, "
+                              "\"edgesRelaxed\": %lld, \"kernelTime\": %g, \"readbackTime\": %g, "
+                              "\"countTime\": %g, \"elapsedTime\": %g, \"mteps\": %g, \"kernelMteps\": %g }",
+                        first ? "" : ",", modeNames[mode], stats.sourceVertex, stats.iterations,
+                        stats.kernelLaunches, stats.maskReadbacks, stats.frontierVertices,
+                        stats.edgesRelaxed, stats.kernelTime, stats.readbackTime,
+                        stats.countTime, stats.elapsedTime, mteps, kernelMTEPS);
+            }
+            else
+            {
+                fprintf(file, "%s,%d,%d,%d,%d,%lld,%lld,%g,%g,%g,%g,%g,%g\n",
+                        modeNames[mode], stats.sourceVertex, stats.iterations,
+                        stats.kernelLaunches, stats.maskReadbacks, stats.frontierVertices,
+                        stats.edgesRelaxed, stats.kernelTime, stats.readbackTime,
+                        stats.countTime, stats.elapsedTime, mteps, kernelMTEPS);
+            }
+            first = false;
+        }
+    }
+
+    if (json)
+    {
+        fprintf(file, "\n  ]\n}\n");
+    }
+
+    fclose(file);
+    return true;
+}
+
 ///
 //  Parse command line arguments
 //
 void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
-                          bool &doMultiGPU, bool &doCPUGPU, bool &doRef,
-                          int *sourceVerts,
-                          int *generateVerts, int *generateEdgesPerVert)
+                          bool &doMultiGPU, bool &doCPUGPU, bool &doAuto, bool &doRef, bool &doNative,
+                          bool &doPointToPoint, bool &doBidirectional, bool &doPaths,
+                          bool &doCompress,
+                          int *sourceVerts, int *subDevicePartitions,
+                          float *radius, int *nearest, int *numUpdates,
+                          int *generateVerts, int *generateEdgesPerVert,
+                          std::string &graphFile, std::string &snapshotFile,
+                          std::string &reorder, std::string &statsFile)
 {
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -83,10 +245,24 @@ void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
         ("gpu",     "Run single GPU version of algorithm")
         ("multigpu","Run multi GPU version of algorithm")
         ("cpugpu",  "Run multi GPU+CPU version of algorithm")
+        ("auto",    "Run the version picked by the available devices (multi GPU+CPU when both are present)")
         ("ref",     "Run reference version of algorithm")
+        ("native",  "Run native multi-threaded CPU version of algorithm")
+        ("p2p",     "Search from each source to a single end vertex only (cpu, gpu and native)")
+        ("bidirectional", "Search from both ends of each point-to-point query (native)")
+        ("paths",   "Return the path of each point-to-point query as well as its cost (cpu, gpu)")
+        ("compress","Search a compressed copy of the graph with rounded weights (cpu, gpu)")
         ("sources", po::value<int>(), "Number of source vertices to search from (default: 100)")
+        ("subdevices", po::value<int>(), "Run CPU version on sub-devices: 0 for one per NUMA node, otherwise the number of parts (also lets --auto split a lone CPU)")
+        ("radius",  po::value<float>(), "Find the vertices within this cost of each source (gpu, otherwise cpu)")
+        ("nearest", po::value<int>(), "Find this many of the nearest targets, every 100th vertex, to each source (gpu, otherwise cpu)")
+        ("update",  po::value<int>(), "Change the weights of this many edges, repair the searches and check them against searching again (gpu, otherwise cpu)")
         ("verts",   po::value<int>(), "Number of vertices in randomly generated graph (default: 100000)")
-        ("edges",   po::value<int>(), "Number of edges per vertex in randomly generated graph (default: 10)");
+        ("edges",   po::value<int>(), "Number of edges per vertex in randomly generated graph (default: 10)")
+        ("graph",   po::value<std::string>(), "Load the graph from a file instead of generating one (.gr DIMACS, .mtx Matrix Market, .csr snapshot, otherwise an edge list)")
+        ("snapshot",po::value<std::string>(), "Save the graph to a binary snapshot (.csr) for fast loading with --graph")
+        ("reorder", po::value<std::string>(), "Relabel the vertices for locality before searching: bfs or degree")
+        ("stats",   po::value<std::string>(), "Write per-search counters and timings (cpu, gpu) to a .csv or .json file");
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -119,16 +295,68 @@ void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
         doCPUGPU = true;
     }
 
+    if (vm.count("auto"))
+    {
+        doAuto = true;
+    }
+
     if (vm.count("ref"))
     {
         doRef = true;
     }
 
+    if (vm.count("native"))
+    {
+        doNative = true;
+    }
+
+    if (vm.count("p2p"))
+    {
+        doPointToPoint = true;
+    }
+
+    if (vm.count("bidirectional"))
+    {
+        doPointToPoint = true;
+        doBidirectional = true;
+    }
+
+    if (vm.count("paths"))
+    {
+        doPointToPoint = true;
+        doPaths = true;
+    }
+
+    if (vm.count("compress"))
+    {
+        doCompress = true;
+    }
+
     if (vm.count("sources"))
     {
         *sourceVerts = vm["sources"].as<int>();
     }
 
+    if (vm.count("subdevices"))
+    {
+        *subDevicePartitions = vm["subdevices"].as<int>();
+    }
+
+    if (vm.count("radius"))
+    {
+        *radius = vm["radius"].as<float>();
+    }
+
+    if (vm.count("nearest"))
+    {
+        *nearest = vm["nearest"].as<int>();
+    }
+
+    if (vm.count("update"))
+    {
+        *numUpdates = vm["update"].as<int>();
+    }
+
     if (vm.count("verts"))
     {
         *generateVerts = vm["verts"].as<int>();
@@ -138,6 +366,31 @@ void parseCommandLineArgs(int argc, char **argv, bool &doCPU, bool &doGPU,
     {
         *generateEdgesPerVert = vm["edges"].as<int>();
     }
+
+    if (vm.count("graph"))
+    {
+        graphFile = vm["graph"].as<std::string>();
+    }
+
+    if (vm.count("snapshot"))
+    {
+        snapshotFile = vm["snapshot"].as<std::string>();
+    }
+
+    if (vm.count("stats"))
+    {
+        statsFile = vm["stats"].as<std::string>();
+    }
+
+    if (vm.count("reorder"))
+    {
+        reorder = vm["reorder"].as<std::string>();
+        if (reorder != "bfs" && reorder != "degree")
+        {
+            std::cout << desc << "\n";
+            exit(1);
+        }
+    }
 }
 
 ///
@@ -211,14 +464,31 @@ int main(int argc, char **argv)
     bool doGPU = false;
     bool doMultiGPU = false;
     bool doCPUGPU = false;
+    bool doAuto = false;
     bool doRef = false;
+    bool doNative = false;
+    bool doPointToPoint = false;
+    bool doBidirectional = false;
+    bool doPaths = false;
+    bool doCompress = false;
     int numSources = 100;
+    int subDevicePartitions = -1;
+    float radius = -1.0f;
+    int nearest = 0;
+    int numUpdates = 0;
     int generateVerts = 100000;
     int generateEdgesPerVert = 10;
+    std::string graphFile;
+    std::string snapshotFile;
+    std::string reorder;
+    std::string statsFile;
 
     parseCommandLineArgs(argc, argv, doCPU, doGPU,
-                         doMultiGPU, doCPUGPU, doRef,
-                         &numSources, &generateVerts, &generateEdgesPerVert);
+                         doMultiGPU, doCPUGPU, doAuto, doRef, doNative,
+                         doPointToPoint, doBidirectional, doPaths,
+                         doCompress,
+                         &numSources, &subDevicePartitions, &radius, &nearest, &numUpdates, &generateVerts, &generateEdgesPerVert,
+                         graphFile, snapshotFile, reorder, statsFile);
 
     cl_platform_id platform;
     cl_context gpuContext;
@@ -253,11 +523,50 @@ int main(int argc, char **argv)
 
     // Allocate memory for arrays
     GraphData graph;
-    generateRandomGraph(&graph, generateVerts, generateEdgesPerVert);
+    if (!graphFile.empty())
+    {
+        pt::ptime startTimeLoad = pt::microsec_clock::local_time();
+        if (!loadGraph(graphFile.c_str(), &graph))
+        {
+            return 1;
+        }
+        pt::time_duration timeLoad = pt::microsec_clock::local_time() - startTimeLoad;
+        printf("Loaded %s in %f s\n", graphFile.c_str(), (float)timeLoad.total_milliseconds() / 1000.0f);
+    }
+    else
+    {
+        generateRandomGraph(&graph, generateVerts, generateEdgesPerVert);
+    }
+
+    if (!snapshotFile.empty() && !saveGraphSnapshot(snapshotFile.c_str(), &graph))
+    {
+        return 1;
+    }
 
     printf("Vertex Count: %d\n", graph.vertexCount);
     printf("Edge Count: %d\n", graph.edgeCount);
 
+    // Relabel the vertices for locality.  Queries and results still use the
+    // original labels and are mapped through newIds.
+    int *newIds = NULL;
+    if (!reorder.empty())
+    {
+        GraphOrder order = (reorder == "bfs") ? GRAPH_ORDER_BFS : GRAPH_ORDER_DEGREE;
+        newIds = (int*) malloc(sizeof(int) * graph.vertexCount);
+
+        pt::ptime startTimeReorder = pt::microsec_clock::local_time();
+        GraphData reorderedGraph;
+        reorderGraph(&graph, order, &reorderedGraph, newIds);
+        pt::time_duration timeReorder = pt::microsec_clock::local_time() - startTimeReorder;
+
+        printf("Reordered (%s) in %f s, average edge span: %f -> %f\n", reorder.c_str(),
+               (float)timeReorder.total_milliseconds() / 1000.0f,
+               averageEdgeSpan(&graph), averageEdgeSpan(&reorderedGraph));
+
+        freeGraph(&graph);
+        graph = reorderedGraph;
+    }
+
     std::vector<int> sourceVertices;
 
 
@@ -271,21 +580,112 @@ int main(int argc, char **argv)
 
     float *results = (float*) malloc(sizeof(float) * sourceVertices.size() * graph.vertexCount);
 
+    // Point-to-point queries search from each source to the vertex half way
+    // round the graph from it
+    int *endVertArray = (int*) malloc(sizeof(int) * sourceVertices.size());
+    for (size_t i = 0; i < sourceVertices.size(); i++)
+    {
+        endVertArray[i] = (sourceVertices[i] + graph.vertexCount / 2) % graph.vertexCount;
+    }
+
+    if (newIds != NULL)
+    {
+        for (size_t i = 0; i < sourceVertices.size(); i++)
+        {
+            sourceVertArray[i] = newIds[sourceVertArray[i]];
+            endVertArray[i] = newIds[endVertArray[i]];
+        }
+    }
+
+    int *predecessors = NULL;
+    if (doPaths)
+    {
+        predecessors = (int*) malloc(sizeof(int) * sourceVertices.size() * graph.vertexCount);
+    }
+
+    CompressedGraphData compressedGraph;
+    if (doCompress)
+    {
+        if (!compressGraph(&graph, &compressedGraph))
+        {
+            return 1;
+        }
+        printf("Compressed edges: %f bytes per edge (uncompressed: %d)\n",
+               (float)compressedGraph.edgeByteCount / graph.edgeCount, (int)(sizeof(int) + sizeof(float)));
+    }
+
+    GraphData reverseGraph;
+    if (doBidirectional)
+    {
+        buildReverseGraph(&graph, &reverseGraph);
+    }
+
+    // With a search from every vertex it is cheaper to relax the whole
+    // distance matrix than to run that many single source searches
+    bool doAllPairs = (numSources == graph.vertexCount) && !doPointToPoint && !doCompress && statsFile.empty();
+    if (doAllPairs && (doCPU || doGPU))
+    {
+        printf("Sources cover every vertex, using blocked Floyd-Warshall for the CPU/GPU runs.\n");
+    }
+
+
+    // Per-search counters and timings for the single device modes
+    DijkstraStats *cpuStats = NULL;
+    DijkstraStats *gpuStats = NULL;
+    if (!statsFile.empty() && doPointToPoint)
+    {
+        printf("Stats are only collected for single source searches.\n");
+    }
+    else if (!statsFile.empty())
+    {
+        cpuStats = doCPU ? (DijkstraStats*) calloc(sourceVertices.size(), sizeof(DijkstraStats)) : NULL;
+        gpuStats = doGPU ? (DijkstraStats*) calloc(sourceVertices.size(), sizeof(DijkstraStats)) : NULL;
+    }
 
     // Run Dijkstra's algorithm
     pt::ptime startTimeCPU = pt::microsec_clock::local_time();
-    if (doCPU)
+    if (doCPU && doPointToPoint)
+    {
+        runDijkstraPointToPoint(cpuContext, getMaxFlopsDev(cpuContext), &graph, sourceVertArray,
+                                endVertArray, results, sourceVertices.size(), predecessors );
+    }
+    else if (doCPU && doCompress)
+    {
+        runDijkstraCompressed(cpuContext, getMaxFlopsDev(cpuContext), &compressedGraph, sourceVertArray,
+                              results, sourceVertices.size(), cpuStats );
+    }
+    else if (doCPU && doAllPairs)
+    {
+        runFloydWarshall(cpuContext, getMaxFlopsDev(cpuContext), &graph, sourceVertArray,
+                         results, sourceVertices.size() );
+    }
+    else if (doCPU)
     {
         runDijkstra(cpuContext, getMaxFlopsDev(cpuContext), &graph, sourceVertArray,
-                    results, sourceVertices.size() );
+                    results, sourceVertices.size(), cpuStats );
     }
     pt::time_duration timeCPU = pt::microsec_clock::local_time() - startTimeCPU;
 
     pt::ptime startTimeGPU = pt::microsec_clock::local_time();
-    if (doGPU)
+    if (doGPU && doPointToPoint)
+    {
+        runDijkstraPointToPoint(gpuContext, getMaxFlopsDev(gpuContext), &graph, sourceVertArray,
+                                endVertArray, results, sourceVertices.size(), predecessors );
+    }
+    else if (doGPU && doCompress)
+    {
+        runDijkstraCompressed(gpuContext, getMaxFlopsDev(gpuContext), &compressedGraph, sourceVertArray,
+                              results, sourceVertices.size(), gpuStats );
+    }
+    else if (doGPU && doAllPairs)
+    {
+        runFloydWarshall(gpuContext, getMaxFlopsDev(gpuContext), &graph, sourceVertArray,
+                         results, sourceVertices.size() );
+    }
+    else if (doGPU)
     {
         runDijkstra(gpuContext, getMaxFlopsDev(gpuContext), &graph, sourceVertArray,
-                    results, sourceVertices.size() );
+                    results, sourceVertices.size(), gpuStats );
     }
     pt::time_duration timeGPU = pt::microsec_clock::local_time() - startTimeGPU;
 
@@ -298,6 +698,107 @@ int main(int argc, char **argv)
     pt::time_duration timeMultiGPU = pt::microsec_clock::local_time() - startTimeMultiGPU;
 
 
+    pt::ptime startTimeSubDevices = pt::microsec_clock::local_time();
+    if (subDevicePartitions >= 0)
+    {
+        runDijkstraSubDevices(cpuContext, &graph, sourceVertArray,
+                              results, sourceVertices.size(), subDevicePartitions );
+    }
+    pt::time_duration timeSubDevices = pt::microsec_clock::local_time() - startTimeSubDevices;
+
+    // Bounded searches return only the vertices they find rather than a cost
+    // for every vertex.  Each is checked against a full search from the same
+    // source, which is left out of the time, and the vertices found from the
+    // first source are kept to print with their original labels.
+    pt::time_duration timeBounded;
+    long long boundedFound = 0;
+    int boundedMismatches = 0;
+    std::vector<int> firstBoundedVertices;
+    std::vector<float> firstBoundedCosts;
+    if (radius >= 0.0f || nearest > 0)
+    {
+        cl_context boundedContext = doGPU ? gpuContext : cpuContext;
+        DijkstraSession session(boundedContext, getMaxFlopsDev(boundedContext), &graph);
+
+        std::vector<int> targets;
+        for (int v = 0; v < graph.vertexCount; v += 100)
+        {
+            targets.push_back((newIds != NULL) ? newIds[v] : v);
+        }
+
+        std::vector<int> foundVertices(graph.vertexCount);
+        std::vector<float> foundCosts(graph.vertexCount);
+        std::vector<float> fullCosts(graph.vertexCount);
+        std::vector<float> targetCosts;
+        for (size_t i = 0; session.isValid() && i < sourceVertices.size(); i++)
+        {
+            pt::ptime startTimeBounded = pt::microsec_clock::local_time();
+            int found;
+            if (radius >= 0.0f)
+            {
+                found = session.solveWithinRadius(sourceVertArray[i], radius, &foundVertices[0], &foundCosts[0]);
+            }
+            else
+            {
+                found = session.solveNearestTargets(sourceVertArray[i], &targets[0], targets.size(), nearest,
+                                                    &foundVertices[0], &foundCosts[0]);
+            }
+            timeBounded += pt::microsec_clock::local_time() - startTimeBounded;
+            boundedFound += found;
+
+            session.solve(&sourceVertArray[i], 1, &fullCosts[0]);
+            int expected = 0;
+            if (radius >= 0.0f)
+            {
+                // Every vertex within the radius, each with its full cost
+                for (int v = 0; v < graph.vertexCount; v++)
+                {
+                    if (fullCosts[v] <= radius)
+                    {
+                        expected++;
+                    }
+                }
+                for (int j = 0; j < found; j++)
+                {
+                    float fullCost = fullCosts[foundVertices[j]];
+                    if (fullCost > radius || !costsMatch(foundCosts[j], fullCost))
+                    {
+                        boundedMismatches++;
+                    }
+                }
+            }
+            else
+            {
+                // The cheapest reachable targets, compared by cost since targets
+                // at the same cost may come in either order
+                targetCosts.clear();
+                for (size_t t = 0; t < targets.size(); t++)
+                {
+                    if (fullCosts[targets[t]] != FLT_MAX)
+                    {
+                        targetCosts.push_back(fullCosts[targets[t]]);
+                    }
+                }
+                expected = std::min((int)targetCosts.size(), nearest);
+                std::partial_sort(targetCosts.begin(), targetCosts.begin() + expected, targetCosts.end());
+                for (int j = 0; j < std::min(found, expected); j++)
+                {
+                    if (!costsMatch(foundCosts[j], targetCosts[j]))
+                    {
+                        boundedMismatches++;
+                    }
+                }
+            }
+            boundedMismatches += abs(expected - found);
+
+            if (i == 0)
+            {
+                firstBoundedVertices.assign(foundVertices.begin(), foundVertices.begin() + found);
+                firstBoundedCosts.assign(foundCosts.begin(), foundCosts.begin() + found);
+            }
+        }
+    }
+
     pt::ptime startTimeGPUCPU = pt::microsec_clock::local_time();
     if (doCPUGPU)
     {
@@ -306,6 +807,13 @@ int main(int argc, char **argv)
     }
     pt::time_duration timeGPUCPU = pt::microsec_clock::local_time() - startTimeGPUCPU;
 
+    pt::ptime startTimeAuto = pt::microsec_clock::local_time();
+    if (doAuto)
+    {
+        runDijkstraOpenCL( &graph, sourceVertArray, results, sourceVertices.size(), subDevicePartitions );
+    }
+    pt::time_duration timeAuto = pt::microsec_clock::local_time() - startTimeAuto;
+
     pt::ptime startTimeRef = pt::microsec_clock::local_time();
     if (doRef)
     {
@@ -314,6 +822,81 @@ int main(int argc, char **argv)
     }
     pt::time_duration timeRef = pt::microsec_clock::local_time() - startTimeRef;
 
+    pt::ptime startTimeNative = pt::microsec_clock::local_time();
+    if (doNative && doPointToPoint)
+    {
+        runDijkstraNativePointToPoint( &graph, doBidirectional ? &reverseGraph : NULL,
+                                       sourceVertArray, endVertArray,
+                                       results, sourceVertices.size() );
+    }
+    else if (doNative)
+    {
+        runDijkstraNative( &graph, sourceVertArray,
+                           results, sourceVertices.size() );
+    }
+    pt::time_duration timeNative = pt::microsec_clock::local_time() - startTimeNative;
+
+    // Change the weights of a spread of edges, repair the searches in place and
+    // check them against searching again with the new weights.  This goes last
+    // as the new weights stay in the graph.
+    numUpdates = std::min(numUpdates, graph.edgeCount);
+    pt::time_duration timeUpdate;
+    pt::time_duration timeResearch;
+    int updateCostMismatches = 0;
+    int updatePredecessorMismatches = 0;
+    if (numUpdates > 0)
+    {
+        cl_context updateContext = doGPU ? gpuContext : cpuContext;
+        DijkstraSession session(updateContext, getMaxFlopsDev(updateContext), &graph);
+
+        size_t costCount = sourceVertices.size() * graph.vertexCount;
+        float *updatedCosts = (float*) malloc(sizeof(float) * costCount);
+        int *updatedPredecessors = (int*) malloc(sizeof(int) * costCount);
+        float *researchedCosts = (float*) malloc(sizeof(float) * costCount);
+
+        int *changedEdges = (int*) malloc(sizeof(int) * numUpdates);
+        float *newWeights = (float*) malloc(sizeof(float) * numUpdates);
+        int stride = graph.edgeCount / numUpdates;
+        for (int c = 0; c < numUpdates; c++)
+        {
+            changedEdges[c] = c * stride + rand() % stride;
+            newWeights[c] = graph.weightArray[changedEdges[c]] * (0.5f + 1.5f * (float)rand() / RAND_MAX);
+        }
+
+        if (session.isValid())
+        {
+            session.solve(sourceVertArray, sourceVertices.size(), updatedCosts, updatedPredecessors);
+
+            pt::ptime startTimeUpdate = pt::microsec_clock::local_time();
+            session.updateEdgeWeights(changedEdges, newWeights, numUpdates, sourceVertArray, sourceVertices.size(),
+                                      updatedCosts, updatedPredecessors);
+            timeUpdate = pt::microsec_clock::local_time() - startTimeUpdate;
+
+            pt::ptime startTimeResearch = pt::microsec_clock::local_time();
+            session.solve(sourceVertArray, sourceVertices.size(), researchedCosts);
+            timeResearch = pt::microsec_clock::local_time() - startTimeResearch;
+
+            for (size_t i = 0; i < costCount; i++)
+            {
+                if (!costsMatch(updatedCosts[i], researchedCosts[i]))
+                {
+                    updateCostMismatches++;
+                }
+            }
+            for (size_t i = 0; i < sourceVertices.size(); i++)
+            {
+                updatePredecessorMismatches += countPredecessorMismatches(&graph, &updatedCosts[i * graph.vertexCount],
+                                                                          &updatedPredecessors[i * graph.vertexCount]);
+            }
+        }
+
+        free(changedEdges);
+        free(newWeights);
+        free(updatedCosts);
+        free(updatedPredecessors);
+        free(researchedCosts);
+    }
+
 
     if (doCPU)
     {
@@ -330,18 +913,121 @@ int main(int argc, char **argv)
         printf("\nrunDijkstra - Multi GPU Time:         %f s\n", (float)timeMultiGPU.total_milliseconds() / 1000.0f);
     }
 
+    if (subDevicePartitions >= 0)
+    {
+        printf("\nrunDijkstra - CPU Sub-devices Time:   %f s\n", (float)timeSubDevices.total_milliseconds() / 1000.0f);
+    }
+
+    if (radius >= 0.0f || nearest > 0)
+    {
+        printf("\nrunDijkstra - %s Time: %f s, %f vertices found per search\n",
+               (radius >= 0.0f) ? "Radius Bounded" : "Nearest Targets",
+               (float)timeBounded.total_milliseconds() / 1000.0f,
+               sourceVertices.empty() ? 0.0f : (float)boundedFound / sourceVertices.size());
+        printf("    %d differences from a full search\n", boundedMismatches);
+
+        // Print what the first search found with the original labels
+        if (!sourceVertices.empty())
+        {
+            std::vector<int> oldIds(graph.vertexCount);
+            for (int v = 0; v < graph.vertexCount; v++)
+            {
+                oldIds[(newIds != NULL) ? newIds[v] : v] = v;
+            }
+
+            printf("    From %d:", oldIds[sourceVertArray[0]]);
+            for (size_t j = 0; j < firstBoundedVertices.size() && j < 10; j++)
+            {
+                printf(" %d (%f)", oldIds[firstBoundedVertices[j]], firstBoundedCosts[j]);
+            }
+            printf("%s\n", (firstBoundedVertices.size() > 10) ? " ..." : "");
+        }
+    }
+
     if (doCPUGPU)
     {
         printf("\nrunDijkstra - Multi GPU and CPU Time: %f s\n", (float)timeGPUCPU.total_milliseconds() / 1000.0f);
     }
 
+    if (doAuto)
+    {
+        printf("\nrunDijkstra - Available Devices Time: %f s\n", (float)timeAuto.total_milliseconds() / 1000.0f);
+    }
+
     if (doRef)
     {
         printf("\nrunDijkstra - Reference (CPU):        %f s\n", (float)timeRef.total_milliseconds() / 1000.0f);
     }
 
+    if (doNative)
+    {
+        printf("\nrunDijkstra - Native (CPU):           %f s\n", (float)timeNative.total_milliseconds() / 1000.0f);
+    }
+
+    if (numUpdates > 0)
+    {
+        printf("\nrunDijkstra - Edge Update Time:       %f s (searching again: %f s)\n",
+               (float)timeUpdate.total_milliseconds() / 1000.0f, (float)timeResearch.total_milliseconds() / 1000.0f);
+        printf("    %d costs differ from searching again, %d predecessors do not match their cost\n",
+               updateCostMismatches, updatePredecessorMismatches);
+    }
+
+    if (cpuStats != NULL || gpuStats != NULL)
+    {
+        const char *modeNames[2] = { "cpu", "gpu" };
+        DijkstraStats *modeStats[2] = { cpuStats, gpuStats };
+        for (int mode = 0; mode < 2; mode++)
+        {
+            if (modeStats[mode] != NULL)
+            {
+                printStatsSummary(modeNames[mode], modeStats[mode], sourceVertices.size());
+            }
+        }
+        writeStats(statsFile, &graph, modeNames, modeStats, 2, sourceVertices.size());
+    }
+
+    if (newIds != NULL && !doPointToPoint)
+    {
+        restoreResultOrder(newIds, graph.vertexCount, results, sourceVertices.size());
+    }
+
+    if (doPaths && (doCPU || doGPU) && !sourceVertices.empty())
+    {
+        int *path = (int*) malloc(sizeof(int) * graph.vertexCount);
+        int pathLength = extractPath(predecessors, graph.vertexCount, sourceVertArray[0], endVertArray[0], path);
+
+        // Print the path with the original labels
+        std::vector<int> oldIds(graph.vertexCount);
+        for (int v = 0; v < graph.vertexCount; v++)
+        {
+            oldIds[(newIds != NULL) ? newIds[v] : v] = v;
+        }
+
+        printf("\nPath from %d to %d: cost %f,", oldIds[sourceVertArray[0]], oldIds[endVertArray[0]], results[0]);
+        for (int i = 0; i < pathLength; i++)
+        {
+            printf(" %d", oldIds[path[i]]);
+        }
+        printf("\n");
+        free(path);
+    }
+
     free(sourceVertArray);
+    free(endVertArray);
+    free(predecessors);
+    free(cpuStats);
+    free(gpuStats);
+    free(newIds);
     free(results);
+    freeGraph(&graph);
+    if (doBidirectional)
+    {
+        freeGraph(&reverseGraph);
+    }
+    if (doCompress)
+    {
+        freeCompressedGraph(&compressedGraph);
+    }
 
     clReleaseContext(gpuContext);
 
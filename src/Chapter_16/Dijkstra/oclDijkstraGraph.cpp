@@ -0,0 +1,1222 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//
+//  Description:
+//      Loading and saving of the GraphData used by the Dijkstra sample.  The text
+//      loaders read the whole file into memory, split it into one chunk of lines
+//      per thread and parse the chunks in parallel.  The parsed edges are then
+//      scattered directly into the vertex/edge/weight arrays, again in parallel.
+//
+//      Graphs can also be saved to and mapped back from a binary snapshot, which
+//      avoids the parsing altogether.
+//
+//
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <vector>
+#include "oclDijkstraGraph.h"
+
+///
+//  Namespaces
+//
+using namespace std;
+
+///
+//  Macro Options
+//
+#define GRAPH_SNAPSHOT_VERSION 1            // Bumped whenever the snapshot layout changes
+#define GRAPH_SNAPSHOT_ALIGNMENT 4096       // Alignment of each array in a snapshot file
+#define GRAPH_SNAPSHOT_BYTE_ORDER 0x01020304 // Written in native order to detect foreign files
+
+///
+//  Types
+//
+
+// Text formats understood by the parser
+typedef enum
+{
+    FORMAT_DIMACS,
+    FORMAT_EDGE_LIST,
+    FORMAT_MATRIX_MARKET
+} GraphFileFormat;
+
+// A single parsed edge
+typedef struct
+{
+    int from;
+    int to;
+    float weight;
+} Edge;
+
+// The lines of the file parsed by one thread and the edges it found
+struct ParseChunk
+{
+    // Range of text to parse, begins at the start of a line
+    const char *begin;
+    const char *end;
+
+    GraphFileFormat format;
+
+    // Subtracted from each vertex index in the file
+    int indexBase;
+
+    // Add the reverse of each edge (Matrix Market symmetric matrices)
+    bool symmetric;
+
+    // Entries have no value (Matrix Market pattern matrices)
+    bool pattern;
+
+    // Output: parsed edges, largest vertex index seen and problem counts
+    vector<Edge> edges;
+    int maxVertex;
+    int badLines;
+
+    // Output: the first line with a negative, infinite or NaN weight, or NULL
+    const char *badWeightLine;
+};
+
+// The range of edges or vertices one thread works on while building the arrays
+typedef struct
+{
+    GraphData *graph;
+    ParseChunk *chunk;
+    int *edgeCursor;
+    int firstVertex;
+    int lastVertex;
+} BuildTask;
+
+// Header at the start of a snapshot file.  The offsets are from the start of
+// the file and are all multiples of GRAPH_SNAPSHOT_ALIGNMENT.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int64_t vertexCount;
+    int64_t edgeCount;
+    uint64_t vertexArrayOffset;
+    uint64_t edgeArrayOffset;
+    uint64_t weightArrayOffset;
+    uint64_t fileSize;
+} GraphSnapshotHeader;
+
+// A snapshot file mapped into memory
+typedef struct
+{
+    void *base;
+    size_t size;
+} GraphMapping;
+
+///
+//  Globals
+//
+static const char graphSnapshotMagic[8] = { 'O', 'C', 'L', 'C', 'S', 'R', '\0', '\0' };
+
+// Graphs loaded from snapshots, keyed by their vertex array, so freeGraph()
+// knows to unmap them rather than free them
+static map<int*, GraphMapping> graphMappings;
+static pthread_mutex_t graphMappingsLock = PTHREAD_MUTEX_INITIALIZER;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Private Functions
+//
+//
+
+///
+/// Number of threads to use for parsing
+///
+static int getNumParseThreads()
+{
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    return (numCPUs > 0) ? (int)numCPUs : 1;
+}
+
+///
+/// Read an entire file into memory.  The buffer is terminated with a '\0'
+/// so the number parsers can never run off the end of it.
+///
+static bool readFile( const char *fileName, vector<char> &buffer )
+{
+    FILE *fp = fopen(fileName, "rb");
+    if (fp == NULL)
+    {
+        cerr << "Failed to open file for reading: " << fileName << endl;
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    buffer.resize(size + 1);
+    size_t bytesRead = fread(&buffer[0], 1, size, fp);
+    fclose(fp);
+
+    if (bytesRead != (size_t)size)
+    {
+        cerr << "Failed to read file: " << fileName << endl;
+        return false;
+    }
+
+    buffer[size] = '\0';
+    return true;
+}
+
+///
+/// Return a pointer to the start of the line following p
+///
+static const char *nextLine( const char *p, const char *end )
+{
+    while (p < end && *p != '\n')
+    {
+        p++;
+    }
+    return (p < end) ? p + 1 : end;
+}
+
+///
+/// Skip spaces and tabs, but not the end of the line
+///
+static const char *skipBlanks( const char *p, const char *end )
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    {
+        p++;
+    }
+    return p;
+}
+
+///
+/// Parse a non-negative integer, advancing p past it.  Returns false if
+/// there is no integer at p.
+///
+static bool parseInt( const char **p, const char *end, int *value )
+{
+    const char *c = skipBlanks(*p, end);
+    if (c >= end || *c < '0' || *c > '9')
+    {
+        return false;
+    }
+
+    int v = 0;
+    while (c < end && *c >= '0' && *c <= '9')
+    {
+        v = v * 10 + (*c - '0');
+        c++;
+    }
+
+    *value = v;
+    *p = c;
+    return true;
+}
+
+///
+/// Parse a floating point number, advancing p past it.  Returns false if
+/// there is no number at p.
+///
+static bool parseFloat( const char **p, const char *end, float *value )
+{
+    const char *c = skipBlanks(*p, end);
+    if (c >= end || *c == '\n')
+    {
+        return false;
+    }
+
+    char *numberEnd;
+    float v = strtof(c, &numberEnd);
+    if (numberEnd == c)
+    {
+        return false;
+    }
+
+    *value = v;
+    *p = numberEnd;
+    return true;
+}
+
+///
+/// Add an edge parsed from the file to the chunk
+///
+static void addEdge( ParseChunk *chunk, int from, int to, float weight )
+{
+    Edge edge = { from, to, weight };
+    chunk->edges.push_back(edge);
+
+    if (chunk->symmetric && from != to)
+    {
+        Edge reverse = { to, from, weight };
+        chunk->edges.push_back(reverse);
+    }
+
+    chunk->maxVertex = max(chunk->maxVertex, max(from, to));
+}
+
+///
+/// Thread function that parses the lines in one chunk of the file
+///
+static void *parseChunkThread( void *arg )
+{
+    ParseChunk *chunk = (ParseChunk*) arg;
+    const char *end = chunk->end;
+
+    for (const char *line = chunk->begin; line < end; line = nextLine(line, end))
+    {
+        const char *p = skipBlanks(line, end);
+        if (p >= end || *p == '\n')
+        {
+            continue;
+        }
+
+        int from;
+        int to;
+        float weight = 1.0f;
+
+        switch (chunk->format)
+        {
+        case FORMAT_DIMACS:
+            // Only arc lines hold edges, "c" comment and "p" problem lines are skipped
+            if (*p != 'a')
+            {
+                continue;
+            }
+            p++;
+            if (!parseInt(&p, end, &from) || !parseInt(&p, end, &to) ||
+                !parseFloat(&p, end, &weight))
+            {
+                chunk->badLines++;
+                continue;
+            }
+            break;
+
+        case FORMAT_EDGE_LIST:
+            if (*p == '#' || *p == '%')
+            {
+                continue;
+            }
+            if (!parseInt(&p, end, &from) || !parseInt(&p, end, &to))
+            {
+                chunk->badLines++;
+                continue;
+            }
+            parseFloat(&p, end, &weight);
+            break;
+
+        case FORMAT_MATRIX_MARKET:
+            if (*p == '%')
+            {
+                continue;
+            }
+            if (!parseInt(&p, end, &from) || !parseInt(&p, end, &to) ||
+                (!chunk->pattern && !parseFloat(&p, end, &weight)))
+            {
+                chunk->badLines++;
+                continue;
+            }
+            break;
+        }
+
+        from -= chunk->indexBase;
+        to -= chunk->indexBase;
+        if (from < 0 || to < 0)
+        {
+            chunk->badLines++;
+            continue;
+        }
+
+        // The searches need finite, non-negative weights.  This also catches
+        // the "inf" and "nan" strtof() accepts.
+        if (!(weight >= 0.0f && weight <= FLT_MAX))
+        {
+            chunk->badWeightLine = line;
+            break;
+        }
+
+        addEdge(chunk, from, to, weight);
+    }
+
+    return NULL;
+}
+
+///
+/// Thread function that counts the out degree of each vertex in one chunk.
+/// The counts are accumulated into graph->vertexArray.
+///
+static void *countDegreesThread( void *arg )
+{
+    BuildTask *task = (BuildTask*) arg;
+    int *degrees = task->graph->vertexArray;
+    const vector<Edge> &edges = task->chunk->edges;
+
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        __sync_fetch_and_add(&degrees[edges[i].from], 1);
+    }
+    return NULL;
+}
+
+///
+/// Thread function that scatters the edges of one chunk into the edge and
+/// weight arrays
+///
+static void *scatterEdgesThread( void *arg )
+{
+    BuildTask *task = (BuildTask*) arg;
+    const vector<Edge> &edges = task->chunk->edges;
+
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        int slot = __sync_fetch_and_add(&task->edgeCursor[edges[i].from], 1);
+        task->graph->edgeArray[slot] = edges[i].to;
+        task->graph->weightArray[slot] = edges[i].weight;
+    }
+    return NULL;
+}
+
+///
+/// Thread function that sorts the edges of a range of vertices by destination.
+/// The scatter above places edges in a non-deterministic order, sorting makes
+/// the arrays the same from run to run and improves locality.
+///
+static void *sortEdgesThread( void *arg )
+{
+    BuildTask *task = (BuildTask*) arg;
+    GraphData *graph = task->graph;
+    vector< pair<int, float> > adjacency;
+
+    for (int v = task->firstVertex; v < task->lastVertex; v++)
+    {
+        int edgeStart = graph->vertexArray[v];
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+
+        adjacency.clear();
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            adjacency.push_back(make_pair(graph->edgeArray[edge], graph->weightArray[edge]));
+        }
+
+        sort(adjacency.begin(), adjacency.end());
+
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            graph->edgeArray[edge] = adjacency[edge - edgeStart].first;
+            graph->weightArray[edge] = adjacency[edge - edgeStart].second;
+        }
+    }
+    return NULL;
+}
+
+///
+/// Run func on each of the tasks in its own thread and wait for all of them
+///
+template <typename T>
+static void runThreads( void *(*func)(void *), vector<T> &tasks )
+{
+    vector<pthread_t> threadIDs(tasks.size());
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        pthread_create(&threadIDs[i], NULL, func, (void*)&tasks[i]);
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        pthread_join(threadIDs[i], NULL);
+    }
+}
+
+///
+/// Parse the text between begin and end in parallel and build the graph arrays
+/// from the result.  text is the start of the file, for the line numbers in
+/// errors.  If vertexCount is zero, it is taken from the largest vertex index
+/// found.
+///
+static bool parseGraph( const char *fileName, const char *text, const char *begin, const char *end,
+                        GraphFileFormat format, int indexBase, bool symmetric, bool pattern,
+                        int vertexCount, GraphData *graph )
+{
+    // No more threads than bytes, so that every chunk boundary is in the text
+    int numThreads = (int)min((long long)getNumParseThreads(), max((long long)(end - begin), 1LL));
+
+    // Split the text into one chunk per thread, each beginning at the start of a line
+    vector<ParseChunk> chunks(numThreads);
+    const char *chunkBegin = begin;
+    for (int i = 0; i < numThreads; i++)
+    {
+        const char *chunkEnd = (i == numThreads - 1) ? end :
+                               nextLine(max(begin, begin + (end - begin) * (i + 1) / numThreads - 1), end);
+        chunkEnd = max(chunkEnd, chunkBegin);
+
+        chunks[i].begin = chunkBegin;
+        chunks[i].end = chunkEnd;
+        chunks[i].format = format;
+        chunks[i].indexBase = indexBase;
+        chunks[i].symmetric = symmetric;
+        chunks[i].pattern = pattern;
+        chunks[i].maxVertex = -1;
+        chunks[i].badLines = 0;
+        chunks[i].badWeightLine = NULL;
+
+        chunkBegin = chunkEnd;
+    }
+
+    runThreads(parseChunkThread, chunks);
+
+    size_t edgeCount = 0;
+    int maxVertex = -1;
+    int badLines = 0;
+    for (int i = 0; i < numThreads; i++)
+    {
+        // The chunks are in file order, so the first bad weight found is the first in the file
+        if (chunks[i].badWeightLine != NULL)
+        {
+            long long lineNumber = 1 + count(text, chunks[i].badWeightLine, '\n');
+            cerr << "ERROR: negative, infinite or NaN weight on line " << lineNumber
+                 << " of " << fileName << endl;
+            return false;
+        }
+
+        edgeCount += chunks[i].edges.size();
+        maxVertex = max(maxVertex, chunks[i].maxVertex);
+        badLines += chunks[i].badLines;
+    }
+
+    if (badLines > 0)
+    {
+        cerr << "WARNING: skipped " << badLines << " malformed lines in " << fileName << endl;
+    }
+
+    if (vertexCount == 0)
+    {
+        vertexCount = maxVertex + 1;
+    }
+    else if (maxVertex >= vertexCount)
+    {
+        cerr << "ERROR: vertex " << maxVertex + indexBase << " out of range in " << fileName << endl;
+        return false;
+    }
+
+    if (vertexCount <= 0 || edgeCount > (size_t)INT_MAX)
+    {
+        cerr << "ERROR: unsupported graph size in " << fileName << endl;
+        return false;
+    }
+
+    graph->vertexCount = vertexCount;
+    graph->edgeCount = (int)edgeCount;
+    graph->vertexArray = (int*) calloc(graph->vertexCount, sizeof(int));
+    graph->edgeArray = (int*) malloc(graph->edgeCount * sizeof(int));
+    graph->weightArray = (float*) malloc(graph->edgeCount * sizeof(float));
+
+    // Count the edges leaving each vertex, then turn the counts into offsets
+    vector<BuildTask> edgeTasks(numThreads);
+    for (int i = 0; i < numThreads; i++)
+    {
+        edgeTasks[i].graph = graph;
+        edgeTasks[i].chunk = &chunks[i];
+    }
+    runThreads(countDegreesThread, edgeTasks);
+
+    int offset = 0;
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int degree = graph->vertexArray[v];
+        graph->vertexArray[v] = offset;
+        offset += degree;
+    }
+
+    // Scatter the edges to their vertex, each thread working on its own chunk
+    int *edgeCursor = (int*) malloc(graph->vertexCount * sizeof(int));
+    memcpy(edgeCursor, graph->vertexArray, graph->vertexCount * sizeof(int));
+    for (int i = 0; i < numThreads; i++)
+    {
+        edgeTasks[i].edgeCursor = edgeCursor;
+    }
+    runThreads(scatterEdgesThread, edgeTasks);
+    free(edgeCursor);
+
+    // The chunks are no longer needed, free them before sorting
+    chunks.clear();
+
+    vector<BuildTask> vertexTasks(numThreads);
+    for (int i = 0; i < numThreads; i++)
+    {
+        vertexTasks[i].graph = graph;
+        vertexTasks[i].firstVertex = (int)((long long)graph->vertexCount * i / numThreads);
+        vertexTasks[i].lastVertex = (int)((long long)graph->vertexCount * (i + 1) / numThreads);
+    }
+    runThreads(sortEdgesThread, vertexTasks);
+
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Public Functions
+//
+//
+
+///
+/// Load a graph from a DIMACS shortest path (.gr) file
+///
+bool loadGraphDIMACS( const char *fileName, GraphData *graph )
+{
+    vector<char> buffer;
+    if (!readFile(fileName, buffer))
+    {
+        return false;
+    }
+
+    const char *begin = &buffer[0];
+    const char *end = begin + buffer.size() - 1;
+
+    // Find the problem line, which gives the number of vertices
+    int vertexCount = 0;
+    int arcCount = 0;
+    for (const char *line = begin; line < end; line = nextLine(line, end))
+    {
+        const char *p = skipBlanks(line, end);
+        if (p < end && *p == 'p')
+        {
+            p = skipBlanks(p + 1, end);
+            if (strncmp(p, "sp", 2) != 0)
+            {
+                cerr << "ERROR: not a shortest path problem in " << fileName << endl;
+                return false;
+            }
+            p += 2;
+            if (!parseInt(&p, end, &vertexCount) || !parseInt(&p, end, &arcCount))
+            {
+                cerr << "ERROR: malformed problem line in " << fileName << endl;
+                return false;
+            }
+            begin = nextLine(line, end);
+            break;
+        }
+    }
+
+    if (vertexCount == 0)
+    {
+        cerr << "ERROR: no problem line found in " << fileName << endl;
+        return false;
+    }
+
+    return parseGraph(fileName, &buffer[0], begin, end, FORMAT_DIMACS, 1, false, false, vertexCount, graph);
+}
+
+///
+/// Load a graph from a plain edge list
+///
+bool loadGraphEdgeList( const char *fileName, GraphData *graph )
+{
+    vector<char> buffer;
+    if (!readFile(fileName, buffer))
+    {
+        return false;
+    }
+
+    const char *begin = &buffer[0];
+    const char *end = begin + buffer.size() - 1;
+
+    return parseGraph(fileName, &buffer[0], begin, end, FORMAT_EDGE_LIST, 0, false, false, 0, graph);
+}
+
+///
+/// Load a graph from a Matrix Market coordinate (.mtx) file
+///
+bool loadGraphMatrixMarket( const char *fileName, GraphData *graph )
+{
+    vector<char> buffer;
+    if (!readFile(fileName, buffer))
+    {
+        return false;
+    }
+
+    const char *begin = &buffer[0];
+    const char *end = begin + buffer.size() - 1;
+
+    // The banner gives the layout, value type and symmetry of the matrix
+    char object[64] = "";
+    char layout[64] = "";
+    char field[64] = "";
+    char symmetry[64] = "";
+    if (sscanf(begin, "%%%%MatrixMarket %63s %63s %63s %63s", object, layout, field, symmetry) != 4 ||
+        strcmp(layout, "coordinate") != 0 || strcmp(field, "complex") == 0)
+    {
+        cerr << "ERROR: only real, integer or pattern coordinate Matrix Market files are supported: "
+             << fileName << endl;
+        return false;
+    }
+
+    bool pattern = (strcmp(field, "pattern") == 0);
+    bool symmetric = (strcmp(symmetry, "general") != 0);
+
+    // Skip the comments to the size line
+    const char *line = nextLine(begin, end);
+    while (line < end && *skipBlanks(line, end) == '%')
+    {
+        line = nextLine(line, end);
+    }
+
+    const char *p = line;
+    int rows;
+    int cols;
+    int entries;
+    if (!parseInt(&p, end, &rows) || !parseInt(&p, end, &cols) || !parseInt(&p, end, &entries))
+    {
+        cerr << "ERROR: malformed size line in " << fileName << endl;
+        return false;
+    }
+
+    return parseGraph(fileName, begin, nextLine(line, end), end, FORMAT_MATRIX_MARKET, 1,
+                      symmetric, pattern, max(rows, cols), graph);
+}
+
+///
+/// Whether an array of count elements at offset lies within a file of
+/// fileSize bytes, without overflowing on a corrupt header
+///
+static bool snapshotArrayFits( uint64_t offset, int64_t count, size_t elementSize, size_t fileSize )
+{
+    return offset <= fileSize && (uint64_t)count <= (fileSize - offset) / elementSize;
+}
+
+///
+/// Round offset up to the snapshot array alignment
+///
+static uint64_t alignSnapshotOffset( uint64_t offset )
+{
+    return (offset + GRAPH_SNAPSHOT_ALIGNMENT - 1) & ~(uint64_t)(GRAPH_SNAPSHOT_ALIGNMENT - 1);
+}
+
+///
+/// Write an array to a snapshot file at the given offset, padding with zeros
+/// from the current position
+///
+static bool writeSnapshotArray( FILE *fp, uint64_t *position, uint64_t offset,
+                                const void *data, size_t size )
+{
+    static const char padding[GRAPH_SNAPSHOT_ALIGNMENT] = { 0 };
+
+    if (fwrite(padding, 1, offset - *position, fp) != offset - *position ||
+        (size > 0 && fwrite(data, 1, size, fp) != size))
+    {
+        return false;
+    }
+
+    *position = offset + size;
+    return true;
+}
+
+///
+/// Write a graph to a binary snapshot file
+///
+bool saveGraphSnapshot( const char *fileName, const GraphData *graph )
+{
+    GraphSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, graphSnapshotMagic, sizeof(header.magic));
+    header.version = GRAPH_SNAPSHOT_VERSION;
+    header.byteOrder = GRAPH_SNAPSHOT_BYTE_ORDER;
+    header.vertexCount = graph->vertexCount;
+    header.edgeCount = graph->edgeCount;
+    header.vertexArrayOffset = alignSnapshotOffset(sizeof(header));
+    header.edgeArrayOffset = alignSnapshotOffset(header.vertexArrayOffset + sizeof(int) * graph->vertexCount);
+    header.weightArrayOffset = alignSnapshotOffset(header.edgeArrayOffset + sizeof(int) * graph->edgeCount);
+    header.fileSize = header.weightArrayOffset + sizeof(float) * graph->edgeCount;
+
+    FILE *fp = fopen(fileName, "wb");
+    if (fp == NULL)
+    {
+        cerr << "Failed to open file for writing: " << fileName << endl;
+        return false;
+    }
+
+    uint64_t position = 0;
+    bool success =
+        writeSnapshotArray(fp, &position, 0, &header, sizeof(header)) &&
+        writeSnapshotArray(fp, &position, header.vertexArrayOffset,
+                           graph->vertexArray, sizeof(int) * graph->vertexCount) &&
+        writeSnapshotArray(fp, &position, header.edgeArrayOffset,
+                           graph->edgeArray, sizeof(int) * graph->edgeCount) &&
+        writeSnapshotArray(fp, &position, header.weightArrayOffset,
+                           graph->weightArray, sizeof(float) * graph->edgeCount);
+
+    if (fclose(fp) != 0 || !success)
+    {
+        cerr << "Failed to write file: " << fileName << endl;
+        return false;
+    }
+
+    return true;
+}
+
+///
+/// Load a graph from a binary snapshot file
+///
+bool loadGraphSnapshot( const char *fileName, GraphData *graph )
+{
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+    {
+        cerr << "Failed to open file for reading: " << fileName << endl;
+        return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(GraphSnapshotHeader))
+    {
+        cerr << "ERROR: not a graph snapshot: " << fileName << endl;
+        close(fd);
+        return false;
+    }
+
+    // The mapping is private and writable so that a runtime using the arrays in
+    // place can never modify the file
+    size_t size = fileStat.st_size;
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        cerr << "Failed to map file: " << fileName << endl;
+        return false;
+    }
+
+    const GraphSnapshotHeader *header = (const GraphSnapshotHeader*) base;
+    bool valid =
+        memcmp(header->magic, graphSnapshotMagic, sizeof(header->magic)) == 0 &&
+        header->version == GRAPH_SNAPSHOT_VERSION &&
+        header->byteOrder == GRAPH_SNAPSHOT_BYTE_ORDER &&
+        header->vertexCount > 0 && header->vertexCount <= INT_MAX &&
+        header->edgeCount >= 0 && header->edgeCount <= INT_MAX &&
+        header->fileSize <= size &&
+        header->vertexArrayOffset % GRAPH_SNAPSHOT_ALIGNMENT == 0 &&
+        header->edgeArrayOffset % GRAPH_SNAPSHOT_ALIGNMENT == 0 &&
+        header->weightArrayOffset % GRAPH_SNAPSHOT_ALIGNMENT == 0 &&
+        snapshotArrayFits(header->vertexArrayOffset, header->vertexCount, sizeof(int), size) &&
+        snapshotArrayFits(header->edgeArrayOffset, header->edgeCount, sizeof(int), size) &&
+        snapshotArrayFits(header->weightArrayOffset, header->edgeCount, sizeof(float), size);
+
+    // The kernels index the arrays with the vertex offsets and edge ends, so
+    // they must all be in range too
+    if (valid)
+    {
+        const int *vertexArray = (const int*) ((const char*)base + header->vertexArrayOffset);
+        const int *edgeArray = (const int*) ((const char*)base + header->edgeArrayOffset);
+        int previousOffset = 0;
+        for (int64_t v = 0; valid && v < header->vertexCount; v++)
+        {
+            valid = vertexArray[v] >= previousOffset && vertexArray[v] <= header->edgeCount;
+            previousOffset = vertexArray[v];
+        }
+        for (int64_t edge = 0; valid && edge < header->edgeCount; edge++)
+        {
+            valid = edgeArray[edge] >= 0 && edgeArray[edge] < header->vertexCount;
+        }
+    }
+
+    if (!valid)
+    {
+        cerr << "ERROR: not a compatible graph snapshot: " << fileName << endl;
+        munmap(base, size);
+        return false;
+    }
+
+    graph->vertexCount = (int)header->vertexCount;
+    graph->edgeCount = (int)header->edgeCount;
+    graph->vertexArray = (int*) ((char*)base + header->vertexArrayOffset);
+    graph->edgeArray = (int*) ((char*)base + header->edgeArrayOffset);
+    graph->weightArray = (float*) ((char*)base + header->weightArrayOffset);
+
+    GraphMapping mapping = { base, size };
+    pthread_mutex_lock(&graphMappingsLock);
+    graphMappings[graph->vertexArray] = mapping;
+    pthread_mutex_unlock(&graphMappingsLock);
+
+    return true;
+}
+
+///
+/// Load a graph, choosing the format from the file extension
+///
+bool loadGraph( const char *fileName, GraphData *graph )
+{
+    const char *extension = strrchr(fileName, '.');
+
+    if (extension != NULL && strcmp(extension, ".gr") == 0)
+    {
+        return loadGraphDIMACS(fileName, graph);
+    }
+    else if (extension != NULL && strcmp(extension, ".mtx") == 0)
+    {
+        return loadGraphMatrixMarket(fileName, graph);
+    }
+    else if (extension != NULL && strcmp(extension, ".csr") == 0)
+    {
+        return loadGraphSnapshot(fileName, graph);
+    }
+    else
+    {
+        return loadGraphEdgeList(fileName, graph);
+    }
+}
+
+///
+/// Build the graph with the direction of every edge reversed
+///
+void buildReverseGraph( const GraphData *graph, GraphData *outReverseGraph )
+{
+    outReverseGraph->vertexCount = graph->vertexCount;
+    outReverseGraph->edgeCount = graph->edgeCount;
+    outReverseGraph->vertexArray = (int*) calloc(graph->vertexCount, sizeof(int));
+    outReverseGraph->edgeArray = (int*) malloc(graph->edgeCount * sizeof(int));
+    outReverseGraph->weightArray = (float*) malloc(graph->edgeCount * sizeof(float));
+
+    // Count the edges arriving at each vertex and turn the counts into offsets
+    for (int edge = 0; edge < graph->edgeCount; edge++)
+    {
+        outReverseGraph->vertexArray[graph->edgeArray[edge]]++;
+    }
+
+    int offset = 0;
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int degree = outReverseGraph->vertexArray[v];
+        outReverseGraph->vertexArray[v] = offset;
+        offset += degree;
+    }
+
+    // Visiting the sources in order leaves each reversed edge list sorted
+    int *edgeCursor = (int*) malloc(graph->vertexCount * sizeof(int));
+    memcpy(edgeCursor, outReverseGraph->vertexArray, graph->vertexCount * sizeof(int));
+
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int edgeStart = graph->vertexArray[v];
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int slot = edgeCursor[graph->edgeArray[edge]]++;
+            outReverseGraph->edgeArray[slot] = v;
+            outReverseGraph->weightArray[slot] = graph->weightArray[edge];
+        }
+    }
+
+    free(edgeCursor);
+}
+
+///
+/// Compute the breadth first order of the vertices.  Each vertex not yet reached
+/// starts a new search, so disconnected parts of the graph are included.
+///
+static void computeBFSOrder( const GraphData *graph, int *outNewIds )
+{
+    vector<int> queue;
+    queue.reserve(graph->vertexCount);
+
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        outNewIds[v] = -1;
+    }
+
+    int nextId = 0;
+    for (int root = 0; root < graph->vertexCount; root++)
+    {
+        if (outNewIds[root] >= 0)
+        {
+            continue;
+        }
+
+        size_t head = queue.size();
+        queue.push_back(root);
+        outNewIds[root] = nextId++;
+
+        while (head < queue.size())
+        {
+            int vertex = queue[head++];
+            int edgeStart = graph->vertexArray[vertex];
+            int edgeEnd = (vertex + 1 < graph->vertexCount) ? graph->vertexArray[vertex + 1] : graph->edgeCount;
+
+            for (int edge = edgeStart; edge < edgeEnd; edge++)
+            {
+                int nid = graph->edgeArray[edge];
+                if (outNewIds[nid] < 0)
+                {
+                    outNewIds[nid] = nextId++;
+                    queue.push_back(nid);
+                }
+            }
+        }
+    }
+}
+
+///
+/// Order the vertices by decreasing number of edges, keeping the original order
+/// between vertices with the same number
+///
+static void computeDegreeOrder( const GraphData *graph, int *outNewIds )
+{
+    vector< pair<int, int> > degrees(graph->vertexCount);
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+        degrees[v] = make_pair(-(edgeEnd - graph->vertexArray[v]), v);
+    }
+
+    sort(degrees.begin(), degrees.end());
+
+    for (int i = 0; i < graph->vertexCount; i++)
+    {
+        outNewIds[degrees[i].second] = i;
+    }
+}
+
+///
+/// Relabel the vertices of a graph to improve locality
+///
+void reorderGraph( const GraphData *graph, GraphOrder order, GraphData *outGraph, int *outNewIds )
+{
+    switch (order)
+    {
+    case GRAPH_ORDER_BFS:
+        computeBFSOrder(graph, outNewIds);
+        break;
+
+    case GRAPH_ORDER_DEGREE:
+        computeDegreeOrder(graph, outNewIds);
+        break;
+    }
+
+    vector<int> oldIds(graph->vertexCount);
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        oldIds[outNewIds[v]] = v;
+    }
+
+    outGraph->vertexCount = graph->vertexCount;
+    outGraph->edgeCount = graph->edgeCount;
+    outGraph->vertexArray = (int*) malloc(graph->vertexCount * sizeof(int));
+    outGraph->edgeArray = (int*) malloc(graph->edgeCount * sizeof(int));
+    outGraph->weightArray = (float*) malloc(graph->edgeCount * sizeof(float));
+
+    // Copy each vertex's edges across in the new order, relabelling their
+    // destinations as they go
+    vector< pair<int, float> > adjacency;
+    int offset = 0;
+    for (int newId = 0; newId < graph->vertexCount; newId++)
+    {
+        int vertex = oldIds[newId];
+        int edgeStart = graph->vertexArray[vertex];
+        int edgeEnd = (vertex + 1 < graph->vertexCount) ? graph->vertexArray[vertex + 1] : graph->edgeCount;
+
+        adjacency.clear();
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            adjacency.push_back(make_pair(outNewIds[graph->edgeArray[edge]], graph->weightArray[edge]));
+        }
+        sort(adjacency.begin(), adjacency.end());
+
+        outGraph->vertexArray[newId] = offset;
+        for (size_t i = 0; i < adjacency.size(); i++)
+        {
+            outGraph->edgeArray[offset] = adjacency[i].first;
+            outGraph->weightArray[offset] = adjacency[i].second;
+            offset++;
+        }
+    }
+}
+
+///
+/// Map per-vertex results on a reordered graph back to the original labels
+///
+void restoreResultOrder( const int *newIds, int vertexCount, float *resultCosts, int numResults )
+{
+    vector<float> reordered(vertexCount);
+
+    for (int i = 0; i < numResults; i++)
+    {
+        float *costs = &resultCosts[(size_t)i * vertexCount];
+        for (int v = 0; v < vertexCount; v++)
+        {
+            reordered[v] = costs[newIds[v]];
+        }
+        copy(reordered.begin(), reordered.end(), costs);
+    }
+}
+
+///
+/// Average distance between the labels at the two ends of each edge
+///
+double averageEdgeSpan( const GraphData *graph )
+{
+    double totalSpan = 0.0;
+
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+        for (int edge = graph->vertexArray[v]; edge < edgeEnd; edge++)
+        {
+            totalSpan += abs(graph->edgeArray[edge] - v);
+        }
+    }
+
+    return (graph->edgeCount > 0) ? totalSpan / graph->edgeCount : 0.0;
+}
+
+///
+/// Append value to bytes as a varint
+///
+static void appendVarint( vector<unsigned char> &bytes, unsigned int value )
+{
+    while (value >= 0x80)
+    {
+        bytes.push_back((unsigned char)(value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    bytes.push_back((unsigned char)value);
+}
+
+///
+/// Build the compressed form of a graph
+///
+bool compressGraph( const GraphData *graph, CompressedGraphData *outCompressedGraph )
+{
+    float maxWeight = 0.0f;
+    for (int edge = 0; edge < graph->edgeCount; edge++)
+    {
+        maxWeight = max(maxWeight, graph->weightArray[edge]);
+    }
+    float weightScale = (maxWeight > 0.0f) ? maxWeight / 65535.0f : 1.0f;
+
+    vector<unsigned char> bytes;
+    bytes.reserve((size_t)graph->edgeCount * 4);
+
+    int *vertexArray = (int*) malloc(graph->vertexCount * sizeof(int));
+    vector< pair<int, float> > adjacency;
+
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        if (bytes.size() > (size_t)INT_MAX)
+        {
+            free(vertexArray);
+            cerr << "ERROR: compressed graph too large" << endl;
+            return false;
+        }
+        vertexArray[v] = (int)bytes.size();
+
+        int edgeStart = graph->vertexArray[v];
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+
+        adjacency.clear();
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            adjacency.push_back(make_pair(graph->edgeArray[edge], graph->weightArray[edge]));
+        }
+        sort(adjacency.begin(), adjacency.end());
+
+        int previous = v;
+        for (size_t i = 0; i < adjacency.size(); i++)
+        {
+            int delta = adjacency[i].first - previous;
+            if (i == 0)
+            {
+                // Zig-zag encode, as the first destination may be below the vertex
+                appendVarint(bytes, ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31));
+            }
+            else
+            {
+                appendVarint(bytes, (unsigned int)delta);
+            }
+            previous = adjacency[i].first;
+
+            unsigned int weight = (unsigned int)min(65535.0f, floorf(adjacency[i].second / weightScale + 0.5f));
+            bytes.push_back((unsigned char)(weight & 0xff));
+            bytes.push_back((unsigned char)(weight >> 8));
+        }
+    }
+
+    if (bytes.size() > (size_t)INT_MAX)
+    {
+        free(vertexArray);
+        cerr << "ERROR: compressed graph too large" << endl;
+        return false;
+    }
+
+    outCompressedGraph->vertexArray = vertexArray;
+    outCompressedGraph->vertexCount = graph->vertexCount;
+    outCompressedGraph->edgeByteCount = (int)bytes.size();
+    outCompressedGraph->edgeBytes = (unsigned char*) malloc(bytes.size() > 0 ? bytes.size() : 1);
+    if (!bytes.empty())
+    {
+        memcpy(outCompressedGraph->edgeBytes, &bytes[0], bytes.size());
+    }
+    outCompressedGraph->edgeCount = graph->edgeCount;
+    outCompressedGraph->weightScale = weightScale;
+
+    return true;
+}
+
+///
+/// Release the arrays of a graph built by compressGraph()
+///
+void freeCompressedGraph( CompressedGraphData *compressedGraph )
+{
+    free(compressedGraph->vertexArray);
+    free(compressedGraph->edgeBytes);
+
+    compressedGraph->vertexArray = NULL;
+    compressedGraph->edgeBytes = NULL;
+    compressedGraph->vertexCount = 0;
+    compressedGraph->edgeCount = 0;
+    compressedGraph->edgeByteCount = 0;
+}
+
+///
+/// Release the arrays of a graph allocated or mapped by one of the loaders
+///
+void freeGraph( GraphData *graph )
+{
+    pthread_mutex_lock(&graphMappingsLock);
+    map<int*, GraphMapping>::iterator mapping = graphMappings.find(graph->vertexArray);
+    if (mapping != graphMappings.end())
+    {
+        munmap(mapping->second.base, mapping->second.size);
+        graphMappings.erase(mapping);
+    }
+    else
+    {
+        free(graph->vertexArray);
+        free(graph->edgeArray);
+        free(graph->weightArray);
+    }
+    pthread_mutex_unlock(&graphMappingsLock);
+
+    graph->vertexArray = NULL;
+    graph->edgeArray = NULL;
+    graph->weightArray = NULL;
+    graph->vertexCount = 0;
+    graph->edgeCount = 0;
+}
@@ -0,0 +1,181 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//
+//  Description:
+//      Loading and saving of the GraphData used by the Dijkstra sample.  Graphs
+//      can be read from a number of common text formats and are converted
+//      directly into the vertex/edge/weight arrays used by the kernels.
+//
+//
+#ifndef DIJKSTRA_GRAPH_H
+#define DIJKSTRA_GRAPH_H
+
+#include "oclDijkstraKernel.h"
+
+///
+/// Load a graph from a DIMACS shortest path (.gr) file.  Arcs are given as
+/// "a <from> <to> <weight>" with 1-based vertex indices and the vertex count
+/// is taken from the "p sp <vertices> <arcs>" line.
+///
+/// The text formats are parsed in parallel.  The searches require finite,
+/// non-negative weights, so a file with a negative, infinite or NaN weight
+/// fails to load with the line number of the first one.
+///
+/// \param fileName Name of the file to load
+/// \param graph Structure that will be filled in with the graph.  The arrays
+///              are allocated with malloc() and released with freeGraph().
+/// \return true on success
+///
+bool loadGraphDIMACS( const char *fileName, GraphData *graph );
+
+///
+/// Load a graph from a plain edge list.  Each line holds "<from> <to> [weight]"
+/// with 0-based vertex indices.  Edges without a weight get a weight of 1.
+/// Lines starting with '#' or '%' are comments.
+///
+/// \param fileName Name of the file to load
+/// \param graph Structure that will be filled in with the graph.  The arrays
+///              are allocated with malloc() and released with freeGraph().
+/// \return true on success
+///
+bool loadGraphEdgeList( const char *fileName, GraphData *graph );
+
+///
+/// Load a graph from a Matrix Market coordinate (.mtx) file.  Entry (i, j)
+/// becomes an edge from vertex i-1 to vertex j-1.  Symmetric matrices produce
+/// an edge in each direction and pattern matrices get a weight of 1.
+///
+/// \param fileName Name of the file to load
+/// \param graph Structure that will be filled in with the graph.  The arrays
+///              are allocated with malloc() and released with freeGraph().
+/// \return true on success
+///
+bool loadGraphMatrixMarket( const char *fileName, GraphData *graph );
+
+///
+/// Write a graph to a binary snapshot file.  The file holds a small header
+/// followed by the vertex, edge and weight arrays in the native byte order,
+/// each starting on a page boundary so they can be used straight from a
+/// mapping of the file.
+///
+/// \param fileName Name of the file to write
+/// \param graph The graph to write
+/// \return true on success
+///
+bool saveGraphSnapshot( const char *fileName, const GraphData *graph );
+
+///
+/// Load a graph from a binary snapshot written by saveGraphSnapshot().  The
+/// file is mapped into memory rather than read, and the graph arrays point
+/// directly into the mapping, so this takes about as long as mapping the file
+/// however large the graph is.  The arrays are page aligned, which lets devices
+/// sharing memory with the host use them in place.
+///
+/// \param fileName Name of the file to load
+/// \param graph Structure that will be filled in with the graph.  The mapping
+///              is released with freeGraph().
+/// \return true on success
+///
+bool loadGraphSnapshot( const char *fileName, GraphData *graph );
+
+///
+/// Load a graph, choosing the format from the file extension: ".gr" files are
+/// read as DIMACS, ".mtx" files as Matrix Market, ".csr" files as a binary
+/// snapshot and anything else as an edge list.
+///
+/// \param fileName Name of the file to load
+/// \param graph Structure that will be filled in with the graph
+/// \return true on success
+///
+bool loadGraph( const char *fileName, GraphData *graph );
+
+///
+/// Build the graph with the direction of every edge reversed, as needed to
+/// search backward from the end vertex of a point-to-point query.  The edges
+/// of each vertex come out sorted by destination.
+///
+/// \param graph The graph to reverse
+/// \param outReverseGraph Structure that will be filled in with the reversed
+///                        graph.  The arrays are allocated with malloc() and
+///                        released with freeGraph().
+///
+void buildReverseGraph( const GraphData *graph, GraphData *outReverseGraph );
+
+///
+/// Vertex orderings that reorderGraph() can relabel a graph into
+///
+typedef enum
+{
+    // Breadth first order, so that neighbours get nearby labels
+    GRAPH_ORDER_BFS,
+
+    // Decreasing number of edges, so that the hub vertices are packed together
+    GRAPH_ORDER_DEGREE
+} GraphOrder;
+
+///
+/// Relabel the vertices of a graph to improve the locality of the costArray
+/// accesses made while relaxing its edges.  The edges of each vertex come out
+/// sorted by their new destination.
+///
+/// \param graph The graph to relabel
+/// \param order The vertex ordering to use
+/// \param outGraph Structure that will be filled in with the relabelled graph.
+///                 The arrays are allocated with malloc() and released with
+///                 freeGraph().
+/// \param outNewIds A pre-allocated array of graph->vertexCount entries which
+///                  receives the new label of each original vertex
+///
+void reorderGraph( const GraphData *graph, GraphOrder order, GraphData *outGraph, int *outNewIds );
+
+///
+/// Map per-vertex results computed on a reordered graph back to the original
+/// vertex labels.
+///
+/// \param newIds The labels returned by reorderGraph()
+/// \param vertexCount Number of vertices in the graph
+/// \param resultCosts numResults arrays of vertexCount costs indexed by the new
+///                    labels, which are rewritten in place indexed by the
+///                    original labels
+/// \param numResults Number of result arrays
+///
+void restoreResultOrder( const int *newIds, int vertexCount, float *resultCosts, int numResults );
+
+///
+/// Average distance between the labels of the two ends of each edge, a simple
+/// measure of how local the memory accesses made by the kernels will be
+///
+double averageEdgeSpan( const GraphData *graph );
+
+///
+/// Build the compressed form of a graph (see CompressedGraphData).  Edge weights
+/// are rounded to a multiple of the largest weight / 65535.
+///
+/// \param graph The graph to compress
+/// \param outCompressedGraph Structure that will be filled in with the
+///                           compressed graph.  The arrays are allocated with
+///                           malloc() and released with freeCompressedGraph().
+/// \return false if the compressed edges would not fit in 2GB
+///
+bool compressGraph( const GraphData *graph, CompressedGraphData *outCompressedGraph );
+
+///
+/// Release the arrays of a graph built by compressGraph()
+///
+void freeCompressedGraph( CompressedGraphData *compressedGraph );
+
+///
+/// Release the arrays of a graph allocated or mapped by one of the loaders
+///
+void freeGraph( GraphData *graph );
+
+#endif // DIJKSTRA_GRAPH_H
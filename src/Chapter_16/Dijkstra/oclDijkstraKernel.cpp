@@ -29,9 +29,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include "oclDijkstraKernel.h"
 
 ///
@@ -43,6 +45,8 @@
 //  Macro Options
 //
 #define NUM_ASYNCHRONOUS_ITERATIONS 10  // Number of async loop iterations before attempting to read results back
+#define NUM_BATCHES_PER_DEVICE 16       // Number of batches per device the multi-device work queue is split into
+#define HEAVY_DEGREE_THRESHOLD 64       // Vertices with more edges are expanded by a whole work-group
 
 ///
 //  Function prototypes
@@ -68,9 +72,39 @@ using namespace std;
 //  Types
 //
 
-// This structure is used in the multi-GPU implementation of the algorithm.
-// This structure defines the workload for each GPU.  The code chunks up
-// the work on a per-GPU basis.
+// This structure is the queue of work shared by all of the devices in the
+// multi-device implementations of the algorithm.  Rather than splitting the
+// sources up front, each device thread pulls the next batch of source vertices
+// off of the queue until it is empty.  This way faster devices end up
+// computing more of the results and the devices balance themselves.
+typedef struct
+{
+    // Lock protecting nextResult
+    pthread_mutex_t lock;
+
+    // Source vertex indices to process
+    int *sourceVertices;
+
+    // Results of processing
+    float *outResultCosts;
+
+    // Number of floats in each result
+    int vertexCount;
+
+    // Number of results
+    int numResults;
+
+    // Index of the next result that has not been handed out
+    int nextResult;
+
+    // Number of results handed out at a time
+    int batchSize;
+
+} WorkQueue;
+
+// This structure is used in the multi-device implementation of the algorithm.
+// This structure defines the device each worker thread runs on along with
+// statistics about the work it ended up doing.
 typedef struct
 {
     // Context
@@ -82,17 +116,21 @@ typedef struct
     // Pointer to graph data
     GraphData *graph;
 
-    // Source vertex indices to process
-    int *sourceVertices;
+    // Queue of work shared with the other devices
+    WorkQueue *workQueue;
 
-    // End vertex indices to process
-    int *endVertices;
+    // Number of results computed by this device
+    int numResults;
 
-    // Results of processing
-    float *outResultCosts;
+    // Number of batches taken from the queue by this device
+    int numBatches;
 
-    // Number of results
-    int numResults;
+    // Time in seconds this device was busy
+    double elapsedTime;
+
+    // Whether the worker thread searches its own copy of the graph rather
+    // than sharing the caller's, so that each NUMA node reads local memory
+    bool copyGraph;
 
 } DevicePlan;
 
@@ -110,10 +148,11 @@ pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 ///
 /// Load and build an OpenCL program from source file
 /// \param gpuContext GPU context on which to load and build the program
+/// \param deviceId Device in the context to build the program for
 /// \param fileName File name of source file that holds the kernels
 /// \return Handle to the program
 ///
-cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
+cl_program loadAndBuildProgram( cl_context gpuContext, cl_device_id deviceId, const char *fileName )
 {
     pthread_mutex_lock(&mutex);
 
@@ -125,6 +164,7 @@ cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
     if (!kernelFile.is_open())
     {
         std::cerr << "Failed to open file for reading: " << fileName << std::endl;
+        pthread_mutex_unlock(&mutex);
         return NULL;
     }
 
@@ -139,12 +179,12 @@ cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
     // Create the program for all GPUs in the context
     program = clCreateProgramWithSource(gpuContext, 1, (const char **)&source, NULL, &errNum);
     checkError(errNum, CL_SUCCESS);
-    // build the program for all devices on the context
-    errNum = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+    // build the program for the device that will run it
+    errNum = clBuildProgram(program, 1, &deviceId, NULL, NULL, NULL);
     if (errNum != CL_SUCCESS)
     {
         char cBuildLog[10240];
-        clGetProgramBuildInfo(program, getFirstDev(gpuContext), CL_PROGRAM_BUILD_LOG,
+        clGetProgramBuildInfo(program, deviceId, CL_PROGRAM_BUILD_LOG,
                               sizeof(cBuildLog), cBuildLog, NULL );
 
         cerr << cBuildLog << endl;
@@ -155,6 +195,49 @@ cl_program loadAndBuildProgram( cl_context gpuContext, const char *fileName )
     return program;
 }
 
+///
+/// Allocate the buffers holding the state of a search
+///
+void allocateWorkingOCLBuffers(cl_context gpuContext, cl_mem *maskArrayDevice, cl_mem *costArrayDevice,
+                               cl_mem *updatingCostArrayDevice, size_t globalWorkSize)
+{
+    cl_int errNum;
+
+    *maskArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE, sizeof(int) * globalWorkSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    *costArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE, sizeof(float) * globalWorkSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    *updatingCostArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE, sizeof(float) * globalWorkSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Whether the graph arrays can back device buffers directly with CL_MEM_USE_HOST_PTR.
+/// This requires the device to share memory with the host and every array to
+/// meet the device's base address alignment, which is the case for graphs
+/// mapped from a snapshot file.
+///
+bool canUseGraphHostPtr(cl_command_queue commandQueue, GraphData *graph)
+{
+    cl_device_id deviceId;
+    cl_bool hostUnifiedMemory = CL_FALSE;
+    cl_uint baseAddrAlignBits = 0;
+
+    clGetCommandQueueInfo(commandQueue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &deviceId, NULL);
+    clGetDeviceInfo(deviceId, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &hostUnifiedMemory, NULL);
+    clGetDeviceInfo(deviceId, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &baseAddrAlignBits, NULL);
+
+    if (hostUnifiedMemory != CL_TRUE || baseAddrAlignBits == 0)
+    {
+        return false;
+    }
+
+    size_t alignment = baseAddrAlignBits / 8;
+    return ((size_t)graph->vertexArray % alignment) == 0 &&
+           ((size_t)graph->edgeArray % alignment) == 0 &&
+           ((size_t)graph->weightArray % alignment) == 0;
+}
+
 ///
 ///  Allocate memory for input CUDA buffers and copy the data into device memory
 ///
@@ -164,69 +247,191 @@ void allocateOCLBuffers(cl_context gpuContext, cl_command_queue commandQueue, Gr
                         size_t globalWorkSize)
 {
     cl_int errNum;
-    cl_mem hostVertexArrayBuffer;
-    cl_mem hostEdgeArrayBuffer;
-    cl_mem hostWeightArrayBuffer;
 
-    // First, need to create OpenCL Host buffers that can be copied to device buffers
-    hostVertexArrayBuffer = clCreateBuffer(gpuContext, CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR,
-                                           sizeof(int) * graph->vertexCount, graph->vertexArray, &errNum);
-    checkError(errNum, CL_SUCCESS);
-
-    hostEdgeArrayBuffer = clCreateBuffer(gpuContext, CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR,
-                                           sizeof(int) * graph->edgeCount, graph->edgeArray, &errNum);
-    checkError(errNum, CL_SUCCESS);
+    // On devices that share memory with the host the graph arrays are used in
+    // place.  Otherwise they are copied straight into the device buffers when
+    // they are created.  The vertex array only needs to cover the real vertices
+    // since the kernels never expand the padding work-items.  The weights are
+    // written by updateEdgeWeights(), the rest of the graph is read only.
+    cl_mem_flags hostPtrFlag = CL_MEM_COPY_HOST_PTR;
+    if (canUseGraphHostPtr(commandQueue, graph))
+    {
+        hostPtrFlag = CL_MEM_USE_HOST_PTR;
+    }
 
-    hostWeightArrayBuffer = clCreateBuffer(gpuContext, CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR,
-                                           sizeof(float) * graph->edgeCount, graph->weightArray, &errNum);
+    *vertexArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | hostPtrFlag, sizeof(int) * graph->vertexCount,
+                                        graph->vertexArray, &errNum);
     checkError(errNum, CL_SUCCESS);
 
-    // Now create all of the GPU buffers
-    *vertexArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY, sizeof(int) * globalWorkSize, NULL, &errNum);
-    checkError(errNum, CL_SUCCESS);
-    *edgeArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY, sizeof(int) * graph->edgeCount, NULL, &errNum);
-    checkError(errNum, CL_SUCCESS);
-    *weightArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY, sizeof(float) * graph->edgeCount, NULL, &errNum);
-    checkError(errNum, CL_SUCCESS);
-    *maskArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE, sizeof(int) * globalWorkSize, NULL, &errNum);
-    checkError(errNum, CL_SUCCESS);
-    *costArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE, sizeof(float) * globalWorkSize, NULL, &errNum);
+    // A graph without edges still needs buffers to pass to the kernels, which
+    // never read them, but a buffer can not be empty
+    cl_mem_flags edgeHostPtrFlag = (graph->edgeCount > 0) ? hostPtrFlag : 0;
+    size_t edgeSlots = max(graph->edgeCount, 1);
+    *edgeArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | edgeHostPtrFlag, sizeof(int) * edgeSlots,
+                                      edgeHostPtrFlag ? graph->edgeArray : NULL, &errNum);
     checkError(errNum, CL_SUCCESS);
-    *updatingCostArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE, sizeof(float) * globalWorkSize, NULL, &errNum);
+    *weightArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_WRITE | edgeHostPtrFlag, sizeof(float) * edgeSlots,
+                                        edgeHostPtrFlag ? graph->weightArray : NULL, &errNum);
     checkError(errNum, CL_SUCCESS);
 
-    // Now queue up the data to be copied to the device
-    errNum = clEnqueueCopyBuffer(commandQueue, hostVertexArrayBuffer, *vertexArrayDevice, 0, 0,
-                                 sizeof(int) * graph->vertexCount, 0, NULL, NULL);
-    checkError(errNum, CL_SUCCESS);
+    allocateWorkingOCLBuffers( gpuContext, maskArrayDevice, costArrayDevice, updatingCostArrayDevice, globalWorkSize );
+}
 
-    errNum = clEnqueueCopyBuffer(commandQueue, hostEdgeArrayBuffer, *edgeArrayDevice, 0, 0,
-                                 sizeof(int) * graph->edgeCount, 0, NULL, NULL);
-    checkError(errNum, CL_SUCCESS);
+///
+/// Allocate device buffers for a compressed graph and copy it into device memory
+///
+void allocateCompressedOCLBuffers(cl_context gpuContext, CompressedGraphData *graph,
+                                  cl_mem *vertexArrayDevice, cl_mem *edgeBytesDevice,
+                                  cl_mem *maskArrayDevice, cl_mem *costArrayDevice, cl_mem *updatingCostArrayDevice,
+                                  size_t globalWorkSize)
+{
+    cl_int errNum;
 
-    errNum = clEnqueueCopyBuffer(commandQueue, hostWeightArrayBuffer, *weightArrayDevice, 0, 0,
-                                 sizeof(float) * graph->edgeCount, 0, NULL, NULL);
+    *vertexArrayDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                        sizeof(int) * graph->vertexCount, graph->vertexArray, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    // A buffer can not be empty, even for a graph without edges
+    *edgeBytesDevice = clCreateBuffer(gpuContext, CL_MEM_READ_ONLY | (graph->edgeByteCount > 0 ? CL_MEM_COPY_HOST_PTR : 0),
+                                      sizeof(char) * max(graph->edgeByteCount, 1),
+                                      graph->edgeByteCount > 0 ? graph->edgeBytes : NULL, &errNum);
     checkError(errNum, CL_SUCCESS);
 
-    clReleaseMemObject(hostVertexArrayBuffer);
-    clReleaseMemObject(hostEdgeArrayBuffer);
-    clReleaseMemObject(hostWeightArrayBuffer);
+    allocateWorkingOCLBuffers( gpuContext, maskArrayDevice, costArrayDevice, updatingCostArrayDevice, globalWorkSize );
+}
+
+///
+/// Largest number of edges leaving any vertex of the graph
+///
+int getMaxDegree(GraphData *graph)
+{
+    int maxDegree = 0;
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+        maxDegree = max(maxDegree, edgeEnd - graph->vertexArray[v]);
+    }
+    return maxDegree;
+}
+
+///
+/// Get the current wall clock time in seconds
+///
+double getCurrentTimeInSeconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec * 1.0e-6;
 }
 
 ///
-/// Initialize OpenCL buffers for single run of Dijkstra
+/// Get the time in seconds a command took to run on the device, from the
+/// profiling information of its event
 ///
-void initializeOCLBuffers(cl_command_queue commandQueue, cl_kernel initializeKernel, GraphData *graph,
-                          size_t maxWorkGroupSize)
+double getEventTimeInSeconds(cl_event event)
 {
+    cl_ulong startTime;
+    cl_ulong endTime;
     cl_int errNum;
-    // Set # of work items in work group and total in 1 dimensional range
-    size_t localWorkSize = maxWorkGroupSize;
-    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
 
-    errNum = clEnqueueNDRangeKernel(commandQueue, initializeKernel, 1, NULL, &globalWorkSize, &localWorkSize,
-                                    0, NULL, NULL);
+    errNum = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &startTime, NULL);
+    errNum |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &endTime, NULL);
     checkError(errNum, CL_SUCCESS);
+
+    return (double)(endTime - startTime) * 1.0e-9;
+}
+
+///
+/// Initialize a work queue holding numResults searches, handed out batchSize
+/// searches at a time
+///
+void initWorkQueue(WorkQueue *workQueue, int *sourceVertices, float *outResultCosts,
+                   int vertexCount, int numResults, int batchSize)
+{
+    pthread_mutex_init(&workQueue->lock, NULL);
+    workQueue->sourceVertices = sourceVertices;
+    workQueue->outResultCosts = outResultCosts;
+    workQueue->vertexCount = vertexCount;
+    workQueue->numResults = numResults;
+    workQueue->nextResult = 0;
+    workQueue->batchSize = (batchSize > 0) ? batchSize : 1;
+}
+
+///
+/// Release the resources held by a work queue
+///
+void releaseWorkQueue(WorkQueue *workQueue)
+{
+    pthread_mutex_destroy(&workQueue->lock);
+}
+
+///
+/// Take the next batch of searches off of the work queue.  Returns false
+/// once the queue is empty.
+///
+bool dequeueWork(WorkQueue *workQueue, int *outOffset, int *outCount)
+{
+    pthread_mutex_lock(&workQueue->lock);
+
+    int offset = workQueue->nextResult;
+    int count = workQueue->numResults - offset;
+    if (count > workQueue->batchSize)
+    {
+        count = workQueue->batchSize;
+    }
+    workQueue->nextResult += count;
+
+    pthread_mutex_unlock(&workQueue->lock);
+
+    *outOffset = offset;
+    *outCount = count;
+    return (count > 0);
+}
+
+///
+/// Run the algorithm on a single device, taking searches off of the work queue
+/// until it is empty.  A single DijkstraSession is shared by all of the batches
+/// so the program, kernels and graph buffers are only set up once.  Returns the
+/// number of results computed.
+///
+int runDijkstraWorker( cl_context context, cl_device_id deviceId, GraphData* graph,
+                       WorkQueue *workQueue, int *outNumBatches )
+{
+    int numResults = 0;
+    *outNumBatches = 0;
+
+    DijkstraSession session( context, deviceId, graph );
+    if (!session.isValid())
+    {
+        return 0;
+    }
+
+    int batchOffset;
+    int batchCount;
+    while (dequeueWork(workQueue, &batchOffset, &batchCount))
+    {
+        session.solve( &workQueue->sourceVertices[batchOffset], batchCount,
+                       &workQueue->outResultCosts[batchOffset * graph->vertexCount] );
+
+        numResults += batchCount;
+        (*outNumBatches)++;
+    }
+
+    cout << "Computed '" << numResults << "' results" << endl;
+    return numResults;
+}
+///
+/// Allocate count bytes aligned to a page, which satisfies the base address
+/// alignment CL_MEM_USE_HOST_PTR asks for on any device
+///
+void *allocPageAligned(size_t count)
+{
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, 4096, max(count, (size_t)1)) != 0)
+    {
+        cerr << "ERROR: could not allocate " << count << " bytes" << endl;
+        exit(1);
+    }
+    return ptr;
 }
 
 ///
@@ -234,8 +439,76 @@ void initializeOCLBuffers(cl_command_queue commandQueue, cl_kernel initializeKer
 ///
 void dijkstraThread(DevicePlan *plan)
 {
-    runDijkstra( plan->context, plan->deviceId, plan->graph, plan->sourceVertices,
-                 plan->outResultCosts, plan->numResults );
+    double startTime = getCurrentTimeInSeconds();
+
+    GraphData *graph = plan->graph;
+    GraphData graphCopy;
+    if (plan->copyGraph)
+    {
+        // The copy is first touched from this thread, so the operating system
+        // places it close to where the thread is running.  It is page aligned
+        // so that the device's buffers use it in place on a CPU rather than
+        // copying it again.
+        graphCopy.vertexCount = graph->vertexCount;
+        graphCopy.edgeCount = graph->edgeCount;
+        graphCopy.vertexArray = (int*) allocPageAligned(sizeof(int) * graph->vertexCount);
+        graphCopy.edgeArray = (int*) allocPageAligned(sizeof(int) * graph->edgeCount);
+        graphCopy.weightArray = (float*) allocPageAligned(sizeof(float) * graph->edgeCount);
+        memcpy(graphCopy.vertexArray, graph->vertexArray, sizeof(int) * graph->vertexCount);
+        memcpy(graphCopy.edgeArray, graph->edgeArray, sizeof(int) * graph->edgeCount);
+        memcpy(graphCopy.weightArray, graph->weightArray, sizeof(float) * graph->edgeCount);
+        graph = &graphCopy;
+    }
+
+    plan->numResults = runDijkstraWorker( plan->context, plan->deviceId, graph,
+                                          plan->workQueue, &plan->numBatches );
+
+    if (plan->copyGraph)
+    {
+        free(graphCopy.vertexArray);
+        free(graphCopy.edgeArray);
+        free(graphCopy.weightArray);
+    }
+
+    plan->elapsedTime = getCurrentTimeInSeconds() - startTime;
+}
+
+///
+/// Run one worker thread per device plan, all sharing the same work queue, and
+/// print how the work ended up being divided between the devices
+///
+void runDevicePlans(DevicePlan *devicePlans, unsigned int deviceCount)
+{
+    pthread_t *threadIDs = (pthread_t*) malloc(sizeof(pthread_t) * deviceCount);
+
+    // Launch all the threads
+    for (unsigned int i = 0; i < deviceCount; i++)
+    {
+        pthread_create(&threadIDs[i], NULL, (void* (*)(void*))dijkstraThread, (void*)(devicePlans + i));
+    }
+
+    // Wait for the results from all threads
+    for (unsigned int i = 0; i < deviceCount; i++)
+    {
+        pthread_join(threadIDs[i], NULL);
+    }
+
+    for (unsigned int i = 0; i < deviceCount; i++)
+    {
+        char deviceName[256];
+        clGetDeviceInfo(devicePlans[i].deviceId, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+
+        cout << "Device " << i << " (" << deviceName << "): " << devicePlans[i].numResults
+             << " results in " << devicePlans[i].numBatches << " batches, "
+             << devicePlans[i].elapsedTime << " s";
+        if (devicePlans[i].elapsedTime > 0.0)
+        {
+            cout << " (" << devicePlans[i].numResults / devicePlans[i].elapsedTime << " results/s)";
+        }
+        cout << endl;
+    }
+
+    free (threadIDs);
 }
 
 ///
@@ -395,7 +668,7 @@ int roundWorkSizeUp(int groupSize, int globalSize)
 /// \param numResults Should be the size of all three passed inarrays
 ///
 void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
-                        float *outResultCosts, int numResults )
+                        float *outResultCosts, int numResults, int numPartitions )
 {
     // See what kind of devices are available
     cl_int errNum;
@@ -430,19 +703,31 @@ void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
                         outResultCosts, numResults);
         }
     }
-    // For multiple results, prefer multi-GPU and fallback to CPU
+    // For multiple results, use every device available.  The devices pull
+    // their searches from a shared queue, so the CPU only takes on as many as
+    // it gets through while the GPUs are busy with the rest.
     else
     {
-        // Prefer Multi-GPU if multiple GPUs are available
-        if (gpuContext != 0)
+        if (gpuContext != 0 && cpuContext != 0)
+        {
+            cout << "Dijkstra OpenCL: Running multi GPU+CPU version." << endl;
+            runDijkstraMultiGPUandCPU( gpuContext, cpuContext, graph, sourceVertices,
+                                       outResultCosts, numResults );
+        }
+        else if (gpuContext != 0)
         {
             cout << "Dijkstra OpenCL: Running multi-GPU version." << endl;
             runDijkstraMultiGPU( gpuContext, graph, sourceVertices,
                                  outResultCosts, numResults );
         }
-        // For now, fallback to CPU in this case.  I have a multi GPU+CPU path
-        // but it does not seem to perform well because of the CPU overhead of
-        // running the GPU version slows down the CPU version.
+        // The CPU is only split into sub-devices, each running its own
+        // searches, when the caller asks for it
+        else if (numPartitions >= 0)
+        {
+            cout << "Dijkstra OpenCL: Running CPU sub-devices version." << endl;
+            runDijkstraSubDevices(cpuContext, graph, sourceVertices,
+                                  outResultCosts, numResults, numPartitions);
+        }
         else
         {
             cout << "Dijkstra OpenCL: Running multithreaded CPU version." << endl;
@@ -456,67 +741,114 @@ void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
 }
 
 ///
-/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
-/// function will compute the shortest path distance from sourceVertices[n] ->
-/// endVertices[n] and store the cost in outResultCosts[n].  The number of results
-/// it will compute is given by numResults.
+/// Create a session for running searches against graph on deviceId.  This
+/// builds the program, creates the kernels and uploads the graph to the
+/// device once, so that each call to solve() only has to run the searches.
 ///
-/// This function will run the algorithm on a single GPU.
+DijkstraSession::DijkstraSession( cl_context context, cl_device_id deviceId, GraphData *graph )
+{
+    init( context, deviceId, graph, NULL );
+}
+
 ///
-/// \param gpuContext Current context, must be created by caller
-/// \param deviceId The device ID on which to run the kernel.  This can
-///                 be determined externally by the caller or the multi
-///                 GPU version will automatically split the work across
-///                 devices
-/// \param graph Structure containing the vertex, edge, and weight arra
-///              for the input graph
-/// \param startVertices Indices into the vertex array from which to
-///                      start the search
-/// \param outResultsCosts A pre-allocated array where the results for
-///                        each shortest path search will be written
-/// \param numResults Should be the size of all three passed inarrays
+/// Create a session for running searches against a compressed graph
 ///
-void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
-                  int *sourceVertices, float *outResultCosts, int numResults)
+DijkstraSession::DijkstraSession( cl_context context, cl_device_id deviceId, CompressedGraphData *compressedGraph )
+{
+    compressedGraphSize.vertexArray = NULL;
+    compressedGraphSize.vertexCount = compressedGraph->vertexCount;
+    compressedGraphSize.edgeArray = NULL;
+    compressedGraphSize.edgeCount = compressedGraph->edgeCount;
+    compressedGraphSize.weightArray = NULL;
+
+    init( context, deviceId, &compressedGraphSize, compressedGraph );
+}
+
+///
+/// Set up the session, shared by both constructors
+///
+void DijkstraSession::init( cl_context context, cl_device_id deviceId, GraphData *graph,
+                            CompressedGraphData *compressedGraph )
 {
+    this->context = context;
+    this->deviceId = deviceId;
+    this->graph = graph;
+    this->compressedGraph = compressedGraph;
+    commandQueue = NULL;
+    program = NULL;
+    initializeBuffersKernel = NULL;
+    ssspKernel1 = NULL;
+    ssspKernel2 = NULL;
+    frontierMinimumKernel = NULL;
+    hasInt64Atomics = false;
+    initializeCostParentKernel = NULL;
+    ssspKernel1Predecessor = NULL;
+    ssspKernel2Predecessor = NULL;
+    initializePredecessorsKernel = NULL;
+    derivePredecessorsKernel = NULL;
+    scatterEdgeWeightsKernel = NULL;
+    markChangedEdgesKernel = NULL;
+    invalidateSubtreeKernel = NULL;
+    seedInvalidatedVerticesKernel = NULL;
+    repairPredecessorsKernel = NULL;
+    previousCostArrayDevice = NULL;
+    countFrontierKernel = NULL;
+    frontierCountsDevice = NULL;
+    currentStats = NULL;
+    countSettledTargetsKernel = NULL;
+    compactCostsKernel = NULL;
+    targetArrayDevice = NULL;
+    compactVerticesDevice = NULL;
+    compactCostsDevice = NULL;
+    resultCountDevice = NULL;
+    vertexArrayDevice = NULL;
+    edgeArrayDevice = NULL;
+    weightArrayDevice = NULL;
+    maskArrayDevice = NULL;
+    costArrayDevice = NULL;
+    updatingCostArrayDevice = NULL;
+    frontierMinimumDevice = NULL;
+    predecessorArrayDevice = NULL;
+    updatingCostParentArrayDevice = NULL;
+    maxWorkGroupSize = 0;
+    maskArrayHost = NULL;
+
+    clRetainContext(context);
+
     // Create command queue
     cl_int errNum;
-    cl_command_queue commandQueue;
     commandQueue = clCreateCommandQueue( context, deviceId, 0, &errNum );
     checkError(errNum, CL_SUCCESS);
 
     // Program handle
-    cl_program program = loadAndBuildProgram( context, "dijkstra.cl" );
-    if (program <= 0 )
+    program = loadAndBuildProgram( context, deviceId, "dijkstra.cl" );
+    if (program == NULL)
     {
         return;
     }
 
     // Get the max workgroup size
-    size_t maxWorkGroupSize;
-    clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    errNum = clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
     checkError(errNum, CL_SUCCESS);
     cout << "MAX_WORKGROUP_SIZE: " << maxWorkGroupSize << endl;
-    cout << "Computing '" << numResults << "' results." << endl;
 
     // Set # of work items in work group and total in 1 dimensional range
     size_t localWorkSize = maxWorkGroupSize;
     size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
 
-    cl_mem vertexArrayDevice;
-    cl_mem edgeArrayDevice;
-    cl_mem weightArrayDevice;
-    cl_mem maskArrayDevice;
-    cl_mem costArrayDevice;
-    cl_mem updatingCostArrayDevice;
-
     // Allocate buffers in Device memory
-    allocateOCLBuffers( context, commandQueue, graph, &vertexArrayDevice, &edgeArrayDevice, &weightArrayDevice,
-                        &maskArrayDevice, &costArrayDevice, &updatingCostArrayDevice, globalWorkSize);
-
+    if (compressedGraph != NULL)
+    {
+        allocateCompressedOCLBuffers( context, compressedGraph, &vertexArrayDevice, &edgeArrayDevice,
+                                      &maskArrayDevice, &costArrayDevice, &updatingCostArrayDevice, globalWorkSize);
+    }
+    else
+    {
+        allocateOCLBuffers( context, commandQueue, graph, &vertexArrayDevice, &edgeArrayDevice, &weightArrayDevice,
+                            &maskArrayDevice, &costArrayDevice, &updatingCostArrayDevice, globalWorkSize);
+    }
 
     // Create the Kernels
-    cl_kernel initializeBuffersKernel;
     initializeBuffersKernel = clCreateKernel(program, "initializeBuffers", &errNum);
     checkError(errNum, CL_SUCCESS);
 
@@ -525,26 +857,56 @@ void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
     errNum |= clSetKernelArg(initializeBuffersKernel, 1, sizeof(cl_mem), &costArrayDevice);
     errNum |= clSetKernelArg(initializeBuffersKernel, 2, sizeof(cl_mem), &updatingCostArrayDevice);
 
-    // 3 set below in loop
+    // 3 set in solve() for each search
     errNum |= clSetKernelArg(initializeBuffersKernel, 4, sizeof(int), &graph->vertexCount);
     checkError(errNum, CL_SUCCESS);
 
-    // Kernel 1
-    cl_kernel ssspKernel1;
-    ssspKernel1 = clCreateKernel(program, "OCL_SSSP_KERNEL1", &errNum);
-    checkError(errNum, CL_SUCCESS);
-    errNum |= clSetKernelArg(ssspKernel1, 0, sizeof(cl_mem), &vertexArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 1, sizeof(cl_mem), &edgeArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 2, sizeof(cl_mem), &weightArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 3, sizeof(cl_mem), &maskArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 4, sizeof(cl_mem), &costArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 5, sizeof(cl_mem), &updatingCostArrayDevice);
-    errNum |= clSetKernelArg(ssspKernel1, 6, sizeof(int), &graph->vertexCount);
-    errNum |= clSetKernelArg(ssspKernel1, 7, sizeof(int), &graph->edgeCount);
-    checkError(errNum, CL_SUCCESS);
+    // Kernel 1.  If some vertices have many more edges than a work-item should
+    // walk alone, use the version which spreads them over the work-group.
+    int maxDegree = (compressedGraph != NULL) ? 0 : getMaxDegree(graph);
+    bool balanced = (maxDegree > HEAVY_DEGREE_THRESHOLD);
+    if (balanced)
+    {
+        cout << "Using edge balanced relaxation, max degree: " << maxDegree << endl;
+    }
+
+    if (compressedGraph != NULL)
+    {
+        ssspKernel1 = clCreateKernel(program, "OCL_SSSP_KERNEL1_COMPRESSED", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(ssspKernel1, 0, sizeof(cl_mem), &vertexArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 1, sizeof(cl_mem), &edgeArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 2, sizeof(cl_mem), &maskArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 3, sizeof(cl_mem), &costArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 4, sizeof(cl_mem), &updatingCostArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 5, sizeof(int), &compressedGraph->vertexCount);
+        errNum |= clSetKernelArg(ssspKernel1, 6, sizeof(int), &compressedGraph->edgeByteCount);
+        errNum |= clSetKernelArg(ssspKernel1, 7, sizeof(float), &compressedGraph->weightScale);
+        checkError(errNum, CL_SUCCESS);
+    }
+    else
+    {
+        ssspKernel1 = clCreateKernel(program, balanced ? "OCL_SSSP_KERNEL1_BALANCED" : "OCL_SSSP_KERNEL1", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(ssspKernel1, 0, sizeof(cl_mem), &vertexArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 1, sizeof(cl_mem), &edgeArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 2, sizeof(cl_mem), &weightArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 3, sizeof(cl_mem), &maskArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 4, sizeof(cl_mem), &costArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 5, sizeof(cl_mem), &updatingCostArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1, 6, sizeof(int), &graph->vertexCount);
+        errNum |= clSetKernelArg(ssspKernel1, 7, sizeof(int), &graph->edgeCount);
+        if (balanced)
+        {
+            int heavyDegree = HEAVY_DEGREE_THRESHOLD;
+            errNum |= clSetKernelArg(ssspKernel1, 8, sizeof(int), &heavyDegree);
+            errNum |= clSetKernelArg(ssspKernel1, 9, sizeof(int) * localWorkSize, NULL);
+            errNum |= clSetKernelArg(ssspKernel1, 10, sizeof(int) * (localWorkSize + 1), NULL);
+        }
+        checkError(errNum, CL_SUCCESS);
+    }
 
     // Kernel 2
-    cl_kernel ssspKernel2;
     ssspKernel2 = clCreateKernel(program, "OCL_SSSP_KERNEL2", &errNum);
     checkError(errNum, CL_SUCCESS);
     errNum |= clSetKernelArg(ssspKernel2, 0, sizeof(cl_mem), &vertexArrayDevice);
@@ -555,80 +917,1066 @@ void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
     errNum |= clSetKernelArg(ssspKernel2, 5, sizeof(cl_mem), &updatingCostArrayDevice);
     errNum |= clSetKernelArg(ssspKernel2, 6, sizeof(int), &graph->vertexCount);
 
+    // 7 is only lowered for the length of a radius bounded search
+    float noMaxCost = FLT_MAX;
+    errNum |= clSetKernelArg(ssspKernel2, 7, sizeof(float), &noMaxCost);
     checkError(errNum, CL_SUCCESS);
 
-    int *maskArrayHost = (int*) malloc(sizeof(int) * graph->vertexCount);
-
-    for ( int i = 0 ; i < numResults; i++ )
-    {
-
-        errNum |= clSetKernelArg(initializeBuffersKernel, 3, sizeof(int), &sourceVertices[i]);
-        checkError(errNum, CL_SUCCESS);
+    // Frontier minimum, used to stop point-to-point searches early
+    frontierMinimumDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
 
-        // Initialize mask array to false, C and U to infiniti
-        initializeOCLBuffers( commandQueue, initializeBuffersKernel, graph, maxWorkGroupSize );
+    frontierMinimumKernel = clCreateKernel(program, "frontierMinimum", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(frontierMinimumKernel, 0, sizeof(cl_mem), &maskArrayDevice);
+    errNum |= clSetKernelArg(frontierMinimumKernel, 1, sizeof(cl_mem), &costArrayDevice);
+    errNum |= clSetKernelArg(frontierMinimumKernel, 2, sizeof(cl_mem), &frontierMinimumDevice);
+    errNum |= clSetKernelArg(frontierMinimumKernel, 3, sizeof(int), &graph->vertexCount);
+    checkError(errNum, CL_SUCCESS);
 
-        // Read mask array from device -> host
-        cl_event readDone;
-        errNum = clEnqueueReadBuffer( commandQueue, maskArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
-                                      maskArrayHost, 0, NULL, &readDone);
-        checkError(errNum, CL_SUCCESS);
-        clWaitForEvents(1, &readDone);
+    maskArrayHost = (int*) malloc(sizeof(int) * graph->vertexCount);
+}
 
-        while(!maskArrayEmpty(maskArrayHost, graph->vertexCount))
-        {
+///
+/// Release all of the OpenCL objects held by the session
+///
+DijkstraSession::~DijkstraSession()
+{
+    free (maskArrayHost);
 
-            // In order to improve performance, we run some number of iterations
-            // without reading the results.  This might result in running more iterations
-            // than necessary at times, but it will in most cases be faster because
-            // we are doing less stalling of the GPU waiting for results.
-            for(int asyncIter = 0; asyncIter < NUM_ASYNCHRONOUS_ITERATIONS; asyncIter++)
-            {
-                size_t localWorkSize = maxWorkGroupSize;
-                size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+    if (vertexArrayDevice != NULL) clReleaseMemObject(vertexArrayDevice);
+    if (edgeArrayDevice != NULL) clReleaseMemObject(edgeArrayDevice);
+    if (weightArrayDevice != NULL) clReleaseMemObject(weightArrayDevice);
+    if (maskArrayDevice != NULL) clReleaseMemObject(maskArrayDevice);
+    if (costArrayDevice != NULL) clReleaseMemObject(costArrayDevice);
+    if (updatingCostArrayDevice != NULL) clReleaseMemObject(updatingCostArrayDevice);
+    if (frontierMinimumDevice != NULL) clReleaseMemObject(frontierMinimumDevice);
+    if (predecessorArrayDevice != NULL) clReleaseMemObject(predecessorArrayDevice);
+    if (updatingCostParentArrayDevice != NULL) clReleaseMemObject(updatingCostParentArrayDevice);
+    if (previousCostArrayDevice != NULL) clReleaseMemObject(previousCostArrayDevice);
+    if (frontierCountsDevice != NULL) clReleaseMemObject(frontierCountsDevice);
+    if (targetArrayDevice != NULL) clReleaseMemObject(targetArrayDevice);
+    if (compactVerticesDevice != NULL) clReleaseMemObject(compactVerticesDevice);
+    if (compactCostsDevice != NULL) clReleaseMemObject(compactCostsDevice);
+    if (resultCountDevice != NULL) clReleaseMemObject(resultCountDevice);
+
+    if (initializeBuffersKernel != NULL) clReleaseKernel(initializeBuffersKernel);
+    if (ssspKernel1 != NULL) clReleaseKernel(ssspKernel1);
+    if (ssspKernel2 != NULL) clReleaseKernel(ssspKernel2);
+    if (frontierMinimumKernel != NULL) clReleaseKernel(frontierMinimumKernel);
+    if (initializeCostParentKernel != NULL) clReleaseKernel(initializeCostParentKernel);
+    if (ssspKernel1Predecessor != NULL) clReleaseKernel(ssspKernel1Predecessor);
+    if (ssspKernel2Predecessor != NULL) clReleaseKernel(ssspKernel2Predecessor);
+    if (initializePredecessorsKernel != NULL) clReleaseKernel(initializePredecessorsKernel);
+    if (derivePredecessorsKernel != NULL) clReleaseKernel(derivePredecessorsKernel);
+    if (scatterEdgeWeightsKernel != NULL) clReleaseKernel(scatterEdgeWeightsKernel);
+    if (markChangedEdgesKernel != NULL) clReleaseKernel(markChangedEdgesKernel);
+    if (invalidateSubtreeKernel != NULL) clReleaseKernel(invalidateSubtreeKernel);
+    if (seedInvalidatedVerticesKernel != NULL) clReleaseKernel(seedInvalidatedVerticesKernel);
+    if (repairPredecessorsKernel != NULL) clReleaseKernel(repairPredecessorsKernel);
+    if (countFrontierKernel != NULL) clReleaseKernel(countFrontierKernel);
+    if (countSettledTargetsKernel != NULL) clReleaseKernel(countSettledTargetsKernel);
+    if (compactCostsKernel != NULL) clReleaseKernel(compactCostsKernel);
+
+    if (program != NULL) clReleaseProgram(program);
+    if (commandQueue != NULL) clReleaseCommandQueue(commandQueue);
+    clReleaseContext(context);
+}
 
-                // execute the kernel
-                errNum = clEnqueueNDRangeKernel(commandQueue, ssspKernel1, 1, 0, &globalWorkSize, &localWorkSize,
-                                               0, NULL, NULL);
-                checkError(errNum, CL_SUCCESS);
+///
+/// Whether the program was built and the graph uploaded successfully
+///
+bool DijkstraSession::isValid() const
+{
+    return (program != NULL);
+}
 
-                errNum = clEnqueueNDRangeKernel(commandQueue, ssspKernel2, 1, 0, &globalWorkSize, &localWorkSize,
-                                               0, NULL, NULL);
-                checkError(errNum, CL_SUCCESS);
-            }
-            errNum = clEnqueueReadBuffer(commandQueue, maskArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
-                                         maskArrayHost, 0, NULL, &readDone);
-            checkError(errNum, CL_SUCCESS);
-            clWaitForEvents(1, &readDone);
-        }
+///
+/// Create the kernels and buffers needed to compute predecessors.  This is left
+/// until they are first asked for so that sessions which never need them do not
+/// pay for the extra device memory.  Returns false if predecessors are not
+/// available for this session's graph.
+///
+bool DijkstraSession::initPredecessors()
+{
+    if (compressedGraph != NULL)
+    {
+        cerr << "Predecessors are not available for compressed graphs" << endl;
+        return false;
+    }
 
-        // Copy the result back
-        errNum = clEnqueueReadBuffer(commandQueue, costArrayDevice, CL_FALSE, 0, sizeof(float) * graph->vertexCount,
-                                     &outResultCosts[i * graph->vertexCount], 0, NULL, &readDone);
-        checkError(errNum, CL_SUCCESS);
-        clWaitForEvents(1, &readDone);
+    if (predecessorArrayDevice != NULL)
+    {
+        return true;
     }
 
-    free (maskArrayHost);
+    cl_int errNum;
+    size_t localWorkSize = maxWorkGroupSize;
+    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+
+    predecessorArrayDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * globalWorkSize, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    // The packed kernels are only compiled in when the device supports 64-bit atomics
+    size_t extensionsSize;
+    errNum = clGetDeviceInfo(deviceId, CL_DEVICE_EXTENSIONS, 0, NULL, &extensionsSize);
+    checkError(errNum, CL_SUCCESS);
+    std::string extensions(extensionsSize, '\0');
+    errNum = clGetDeviceInfo(deviceId, CL_DEVICE_EXTENSIONS, extensionsSize, &extensions[0], NULL);
+    checkError(errNum, CL_SUCCESS);
+    hasInt64Atomics = (extensions.find("cl_khr_int64_extended_atomics") != std::string::npos);
+
+    if (hasInt64Atomics)
+    {
+        updatingCostParentArrayDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_ulong) * globalWorkSize,
+                                                       NULL, &errNum);
+        checkError(errNum, CL_SUCCESS);
+
+        initializeCostParentKernel = clCreateKernel(program, "initializeCostParent", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(initializeCostParentKernel, 0, sizeof(cl_mem), &updatingCostParentArrayDevice);
+        errNum |= clSetKernelArg(initializeCostParentKernel, 1, sizeof(cl_mem), &predecessorArrayDevice);
+        // 2 set in initializeSearch() for each search
+        checkError(errNum, CL_SUCCESS);
+
+        ssspKernel1Predecessor = clCreateKernel(program, "OCL_SSSP_KERNEL1_PREDECESSOR", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 0, sizeof(cl_mem), &vertexArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 1, sizeof(cl_mem), &edgeArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 2, sizeof(cl_mem), &weightArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 3, sizeof(cl_mem), &maskArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 4, sizeof(cl_mem), &costArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 5, sizeof(cl_mem), &updatingCostParentArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 6, sizeof(int), &graph->vertexCount);
+        errNum |= clSetKernelArg(ssspKernel1Predecessor, 7, sizeof(int), &graph->edgeCount);
+        checkError(errNum, CL_SUCCESS);
+
+        ssspKernel2Predecessor = clCreateKernel(program, "OCL_SSSP_KERNEL2_PREDECESSOR", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(ssspKernel2Predecessor, 0, sizeof(cl_mem), &maskArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel2Predecessor, 1, sizeof(cl_mem), &costArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel2Predecessor, 2, sizeof(cl_mem), &updatingCostParentArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel2Predecessor, 3, sizeof(cl_mem), &predecessorArrayDevice);
+        errNum |= clSetKernelArg(ssspKernel2Predecessor, 4, sizeof(int), &graph->vertexCount);
+        checkError(errNum, CL_SUCCESS);
+    }
+    else
+    {
+        initializePredecessorsKernel = clCreateKernel(program, "initializePredecessors", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(initializePredecessorsKernel, 0, sizeof(cl_mem), &predecessorArrayDevice);
+        checkError(errNum, CL_SUCCESS);
+
+        derivePredecessorsKernel = clCreateKernel(program, "derivePredecessors", &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 0, sizeof(cl_mem), &vertexArrayDevice);
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 1, sizeof(cl_mem), &edgeArrayDevice);
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 2, sizeof(cl_mem), &weightArrayDevice);
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 3, sizeof(cl_mem), &costArrayDevice);
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 4, sizeof(cl_mem), &predecessorArrayDevice);
+        // 5 set in readPredecessors() for each search
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 6, sizeof(int), &graph->vertexCount);
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 7, sizeof(int), &graph->edgeCount);
+        checkError(errNum, CL_SUCCESS);
+    }
+
+    return true;
+}
+
+///
+/// Enqueue a kernel with one work-item per vertex
+///
+void DijkstraSession::enqueueVertexKernel( cl_kernel kernel )
+{
+    size_t localWorkSize = maxWorkGroupSize;
+    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+
+    cl_event kernelDone;
+    cl_int errNum = clEnqueueNDRangeKernel(commandQueue, kernel, 1, 0, &globalWorkSize, &localWorkSize,
+                                           0, NULL, (currentStats != NULL) ? &kernelDone : NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    if (currentStats != NULL)
+    {
+        kernelEvents.push_back(kernelDone);
+        currentStats->kernelLaunches++;
+    }
+}
+
+///
+/// Reset the device buffers for a search from sourceVertex
+///
+void DijkstraSession::initializeSearch( int sourceVertex, bool trackPredecessors )
+{
+    cl_int errNum = CL_SUCCESS;
+
+    errNum |= clSetKernelArg(initializeBuffersKernel, 3, sizeof(int), &sourceVertex);
+    checkError(errNum, CL_SUCCESS);
+
+    // Initialize mask array to false, C and U to infiniti
+    enqueueVertexKernel(initializeBuffersKernel);
+
+    if (trackPredecessors)
+    {
+        errNum |= clSetKernelArg(initializeCostParentKernel, 2, sizeof(int), &sourceVertex);
+        checkError(errNum, CL_SUCCESS);
+        enqueueVertexKernel(initializeCostParentKernel);
+    }
+}
+
+///
+/// Run a number of iterations of the algorithm without reading anything back
+///
+void DijkstraSession::runIterations( bool trackPredecessors )
+{
+    // In order to improve performance, we run some number of iterations
+    // without reading the results.  This might result in running more iterations
+    // than necessary at times, but it will in most cases be faster because
+    // we are doing less stalling of the GPU waiting for results.
+    for(int asyncIter = 0; asyncIter < NUM_ASYNCHRONOUS_ITERATIONS; asyncIter++)
+    {
+        if (currentStats != NULL)
+        {
+            size_t localWorkSize = maxWorkGroupSize;
+            size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+
+            cl_event countDone;
+            cl_int errNum = clSetKernelArg(countFrontierKernel, 3, sizeof(int), &asyncIter);
+            errNum |= clEnqueueNDRangeKernel(commandQueue, countFrontierKernel, 1, 0, &globalWorkSize, &localWorkSize,
+                                             0, NULL, &countDone);
+            checkError(errNum, CL_SUCCESS);
+            countEvents.push_back(countDone);
+            currentStats->iterations++;
+        }
+
+        if (trackPredecessors)
+        {
+            enqueueVertexKernel(ssspKernel1Predecessor);
+            enqueueVertexKernel(ssspKernel2Predecessor);
+        }
+        else
+        {
+            enqueueVertexKernel(ssspKernel1);
+            enqueueVertexKernel(ssspKernel2);
+        }
+    }
+}
+
+///
+/// Read the predecessors of a finished search back from the device, first
+/// deriving them from the costs if they were not tracked during the search
+///
+void DijkstraSession::readPredecessors( int sourceVertex, bool trackPredecessors, int *outPredecessors )
+{
+    cl_int errNum = CL_SUCCESS;
+    cl_event readDone;
+
+    if (!trackPredecessors)
+    {
+        errNum |= clSetKernelArg(derivePredecessorsKernel, 5, sizeof(int), &sourceVertex);
+        checkError(errNum, CL_SUCCESS);
+
+        enqueueVertexKernel(initializePredecessorsKernel);
+        enqueueVertexKernel(derivePredecessorsKernel);
+    }
+
+    errNum = clEnqueueReadBuffer(commandQueue, predecessorArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
+                                 outPredecessors, 0, NULL, &readDone);
+    checkError(errNum, CL_SUCCESS);
+    clWaitForEvents(1, &readDone);
+    clReleaseEvent(readDone);
+}
+
+///
+/// Create the kernel and buffer used to count the frontier, and switch to a
+/// command queue with profiling enabled so that the kernels can be timed
+///
+void DijkstraSession::initStats()
+{
+    if (countFrontierKernel != NULL)
+    {
+        return;
+    }
+
+    cl_int errNum;
+    clFinish(commandQueue);
+    clReleaseCommandQueue(commandQueue);
+    commandQueue = clCreateCommandQueue( context, deviceId, CL_QUEUE_PROFILING_ENABLE, &errNum );
+    checkError(errNum, CL_SUCCESS);
+
+    // A pair of counts for each of the iterations run between read backs
+    std::vector<cl_uint> zeroCounts(2 * NUM_ASYNCHRONOUS_ITERATIONS, 0);
+    frontierCountsDevice = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                          sizeof(cl_uint) * zeroCounts.size(), &zeroCounts[0], &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    // The compressed vertex array holds byte offsets, so count bytes for those
+    int edgeCount = (compressedGraph != NULL) ? compressedGraph->edgeByteCount : graph->edgeCount;
+
+    countFrontierKernel = clCreateKernel(program, "countFrontier", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(countFrontierKernel, 0, sizeof(cl_mem), &vertexArrayDevice);
+    errNum |= clSetKernelArg(countFrontierKernel, 1, sizeof(cl_mem), &maskArrayDevice);
+    errNum |= clSetKernelArg(countFrontierKernel, 2, sizeof(cl_mem), &frontierCountsDevice);
+    // 3 set in runIterations() for each iteration
+    errNum |= clSetKernelArg(countFrontierKernel, 4, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(countFrontierKernel, 5, sizeof(int), &edgeCount);
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Add the frontier counts and kernel times gathered since the last call to
+/// the current search's stats.  Everything enqueued must have finished.
+/// Counting the frontier goes in countTime rather than the search's timings.
+///
+void DijkstraSession::collectStats()
+{
+    for (size_t i = 0; i < kernelEvents.size(); i++)
+    {
+        currentStats->kernelTime += getEventTimeInSeconds(kernelEvents[i]);
+        clReleaseEvent(kernelEvents[i]);
+    }
+    kernelEvents.clear();
+
+    for (size_t i = 0; i < countEvents.size(); i++)
+    {
+        currentStats->countTime += getEventTimeInSeconds(countEvents[i]);
+        clReleaseEvent(countEvents[i]);
+    }
+    countEvents.clear();
+
+    double startTime = getCurrentTimeInSeconds();
+    cl_uint counts[2 * NUM_ASYNCHRONOUS_ITERATIONS];
+    cl_int errNum = clEnqueueReadBuffer(commandQueue, frontierCountsDevice, CL_TRUE, 0, sizeof(counts),
+                                        counts, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    long long edgeCounts = 0;
+    for (int i = 0; i < NUM_ASYNCHRONOUS_ITERATIONS; i++)
+    {
+        currentStats->frontierVertices += counts[2 * i];
+        edgeCounts += counts[2 * i + 1];
+    }
+
+    if (compressedGraph != NULL)
+    {
+        edgeCounts = (long long)((double)edgeCounts * compressedGraph->edgeCount / compressedGraph->edgeByteCount);
+    }
+    currentStats->edgesRelaxed += edgeCounts;
+
+    memset(counts, 0, sizeof(counts));
+    errNum = clEnqueueWriteBuffer(commandQueue, frontierCountsDevice, CL_TRUE, 0, sizeof(counts),
+                                  counts, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+    currentStats->countTime += getCurrentTimeInSeconds() - startTime;
+}
+
+///
+/// Read the mask array back from the device and check whether it is empty
+///
+bool DijkstraSession::frontierEmpty()
+{
+    cl_event readDone;
+    cl_int errNum = clEnqueueReadBuffer(commandQueue, maskArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
+                                        maskArrayHost, 0, NULL, &readDone);
+    checkError(errNum, CL_SUCCESS);
+    clWaitForEvents(1, &readDone);
+
+    if (currentStats != NULL)
+    {
+        currentStats->maskReadbacks++;
+        currentStats->readbackTime += getEventTimeInSeconds(readDone);
+        collectStats();
+    }
+    clReleaseEvent(readDone);
+
+    return maskArrayEmpty(maskArrayHost, graph->vertexCount);
+}
+
+///
+/// Compute the shortest path distance from each of sourceVertices[n] to every
+/// vertex in the graph and store it in outResultCosts[n * graph->vertexCount].
+///
+/// \param sourceVertices Indices into the vertex array from which to
+///                       start each search
+/// \param numResults Number of searches to run
+/// \param outResultCosts A pre-allocated array where the results for
+///                       each shortest path search will be written.
+///                       This must be sized numResults * graph->vertexCount.
+/// \param outPredecessors Optional array receiving the predecessors of each search
+///
+void DijkstraSession::solve( int *sourceVertices, int numResults, float *outResultCosts,
+                             int *outPredecessors, DijkstraStats *outStats )
+{
+    cl_int errNum = CL_SUCCESS;
+
+    if (outPredecessors != NULL && !initPredecessors())
+    {
+        outPredecessors = NULL;
+    }
+    bool trackPredecessors = (outPredecessors != NULL && hasInt64Atomics);
+
+    if (outStats != NULL)
+    {
+        initStats();
+    }
+
+    for ( int i = 0 ; i < numResults; i++ )
+    {
+        double startTime = getCurrentTimeInSeconds();
+        if (outStats != NULL)
+        {
+            currentStats = &outStats[i];
+            memset(currentStats, 0, sizeof(DijkstraStats));
+            currentStats->sourceVertex = sourceVertices[i];
+        }
+
+        initializeSearch( sourceVertices[i], trackPredecessors );
+
+        while(!frontierEmpty())
+        {
+            runIterations( trackPredecessors );
+        }
+
+        // Copy the result back
+        cl_event readDone;
+        errNum = clEnqueueReadBuffer(commandQueue, costArrayDevice, CL_FALSE, 0, sizeof(float) * graph->vertexCount,
+                                     &outResultCosts[i * graph->vertexCount], 0, NULL, &readDone);
+        checkError(errNum, CL_SUCCESS);
+        clWaitForEvents(1, &readDone);
+        if (currentStats != NULL)
+        {
+            currentStats->readbackTime += getEventTimeInSeconds(readDone);
+        }
+        clReleaseEvent(readDone);
+
+        if (outPredecessors != NULL)
+        {
+            readPredecessors( sourceVertices[i], trackPredecessors,
+                              &outPredecessors[i * graph->vertexCount] );
+        }
+
+        if (currentStats != NULL)
+        {
+            collectStats();
+            currentStats->elapsedTime = getCurrentTimeInSeconds() - startTime - currentStats->countTime;
+            currentStats = NULL;
+        }
+    }
+}
+
+///
+/// Check whether the cost of endVertex is final.  It is once no vertex left in the
+/// frontier is cheaper, since edge weights are never negative.  This only reads
+/// two values back from the device rather than the whole mask array.
+///
+bool DijkstraSession::endVertexSettled( int endVertex, float *outCost )
+{
+    cl_int errNum;
+    cl_event readDone;
+    float noFrontier = FLT_MAX;
+    cl_int frontierMinimum;
+
+    size_t localWorkSize = maxWorkGroupSize;
+    size_t globalWorkSize = roundWorkSizeUp(localWorkSize, graph->vertexCount);
+
+    errNum = clEnqueueWriteBuffer(commandQueue, frontierMinimumDevice, CL_FALSE, 0, sizeof(cl_int),
+                                  &noFrontier, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    errNum = clEnqueueNDRangeKernel(commandQueue, frontierMinimumKernel, 1, 0, &globalWorkSize, &localWorkSize,
+                                    0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    errNum = clEnqueueReadBuffer(commandQueue, costArrayDevice, CL_FALSE, sizeof(float) * endVertex, sizeof(float),
+                                 outCost, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    errNum = clEnqueueReadBuffer(commandQueue, frontierMinimumDevice, CL_FALSE, 0, sizeof(cl_int),
+                                 &frontierMinimum, 0, NULL, &readDone);
+    checkError(errNum, CL_SUCCESS);
+    clWaitForEvents(1, &readDone);
+    clReleaseEvent(readDone);
+
+    // The kernel compares the costs' bit patterns, which are written and read
+    // back as floats here
+    float minimumCost;
+    memcpy(&minimumCost, &frontierMinimum, sizeof(float));
+
+    return (minimumCost == FLT_MAX || minimumCost >= *outCost);
+}
+
+///
+/// Compute the shortest path distance from sourceVertices[n] to endVertices[n]
+/// and store it in outResultCosts[n].
+///
+void DijkstraSession::solvePointToPoint( int *sourceVertices, int *endVertices, int numResults,
+                                         float *outResultCosts, int *outPredecessors )
+{
+    if (outPredecessors != NULL && !initPredecessors())
+    {
+        outPredecessors = NULL;
+    }
+    bool trackPredecessors = (outPredecessors != NULL && hasInt64Atomics);
+
+    for ( int i = 0 ; i < numResults; i++ )
+    {
+        initializeSearch( sourceVertices[i], trackPredecessors );
+
+        while(!endVertexSettled(endVertices[i], &outResultCosts[i]))
+        {
+            runIterations( trackPredecessors );
+        }
+
+        if (outPredecessors != NULL)
+        {
+            readPredecessors( sourceVertices[i], trackPredecessors,
+                              &outPredecessors[i * graph->vertexCount] );
+        }
+    }
+}
+
+
+///
+/// Create the kernels and buffer used to repair searches after edge weight
+/// changes.  Returns false if the session can not track predecessors.
+///
+bool DijkstraSession::initRepair()
+{
+    if (scatterEdgeWeightsKernel != NULL)
+    {
+        return true;
+    }
+
+    if (!initPredecessors())
+    {
+        return false;
+    }
+
+    cl_int errNum;
+
+    previousCostArrayDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * graph->vertexCount,
+                                             NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    scatterEdgeWeightsKernel = clCreateKernel(program, "scatterEdgeWeights", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(scatterEdgeWeightsKernel, 0, sizeof(cl_mem), &weightArrayDevice);
+    // 1, 2 and 3 set in updateEdgeWeights()
+    checkError(errNum, CL_SUCCESS);
+
+    markChangedEdgesKernel = clCreateKernel(program, "markChangedEdges", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 0, sizeof(cl_mem), &edgeArrayDevice);
+    // 1 to 4 set in updateEdgeWeights()
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 5, sizeof(cl_mem), &maskArrayDevice);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 6, sizeof(cl_mem), &costArrayDevice);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 7, sizeof(cl_mem), &predecessorArrayDevice);
+    // 8 to 10 set in updateEdgeWeights()
+    checkError(errNum, CL_SUCCESS);
+
+    invalidateSubtreeKernel = clCreateKernel(program, "invalidateSubtree", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 0, sizeof(cl_mem), &vertexArrayDevice);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 1, sizeof(cl_mem), &edgeArrayDevice);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 2, sizeof(cl_mem), &predecessorArrayDevice);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 3, sizeof(cl_mem), &maskArrayDevice);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 4, sizeof(cl_mem), &costArrayDevice);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 5, sizeof(cl_mem), &updatingCostArrayDevice);
+    // 6 set in updateEdgeWeights() for each search
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 7, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(invalidateSubtreeKernel, 8, sizeof(int), &graph->edgeCount);
+    checkError(errNum, CL_SUCCESS);
+
+    seedInvalidatedVerticesKernel = clCreateKernel(program, "seedInvalidatedVertices", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(seedInvalidatedVerticesKernel, 0, sizeof(cl_mem), &vertexArrayDevice);
+    errNum |= clSetKernelArg(seedInvalidatedVerticesKernel, 1, sizeof(cl_mem), &edgeArrayDevice);
+    errNum |= clSetKernelArg(seedInvalidatedVerticesKernel, 2, sizeof(cl_mem), &maskArrayDevice);
+    errNum |= clSetKernelArg(seedInvalidatedVerticesKernel, 3, sizeof(cl_mem), &costArrayDevice);
+    errNum |= clSetKernelArg(seedInvalidatedVerticesKernel, 4, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(seedInvalidatedVerticesKernel, 5, sizeof(int), &graph->edgeCount);
+    checkError(errNum, CL_SUCCESS);
+
+    repairPredecessorsKernel = clCreateKernel(program, "repairPredecessors", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 0, sizeof(cl_mem), &vertexArrayDevice);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 1, sizeof(cl_mem), &edgeArrayDevice);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 2, sizeof(cl_mem), &weightArrayDevice);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 3, sizeof(cl_mem), &costArrayDevice);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 4, sizeof(cl_mem), &previousCostArrayDevice);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 5, sizeof(cl_mem), &predecessorArrayDevice);
+    // 6 set in updateEdgeWeights() for each search
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 7, sizeof(int), &graph->vertexCount);
+    errNum |= clSetKernelArg(repairPredecessorsKernel, 8, sizeof(int), &graph->edgeCount);
+    checkError(errNum, CL_SUCCESS);
+
+    return true;
+}
+
+///
+/// Change the weights of a batch of edges and repair the costs and predecessors
+/// of searches made with the old weights in place.
+///
+void DijkstraSession::updateEdgeWeights( int *changedEdges, float *newWeights, int numChanges,
+                                         int *sourceVertices, int numResults, float *inOutResultCosts,
+                                         int *inOutPredecessors )
+{
+    if (compressedGraph != NULL)
+    {
+        cerr << "Edge weights can not be updated on compressed graphs" << endl;
+        return;
+    }
+
+    if (numChanges <= 0)
+    {
+        return;
+    }
+
+    if (!initRepair())
+    {
+        return;
+    }
+
+    // The vertex each changed edge leaves from, and its weight before the change
+    int *changedSources = (int*) malloc(sizeof(int) * numChanges);
+    float *oldWeights = (float*) malloc(sizeof(float) * numChanges);
+    for (int c = 0; c < numChanges; c++)
+    {
+        changedSources[c] = (int)(upper_bound(graph->vertexArray, graph->vertexArray + graph->vertexCount,
+                                              changedEdges[c]) - graph->vertexArray) - 1;
+        oldWeights[c] = graph->weightArray[changedEdges[c]];
+    }
+
+    cl_int errNum;
+    cl_mem changedEdgesDevice = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                               sizeof(int) * numChanges, changedEdges, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    cl_mem changedSourcesDevice = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                 sizeof(int) * numChanges, changedSources, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    cl_mem oldWeightsDevice = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                             sizeof(float) * numChanges, oldWeights, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    cl_mem newWeightsDevice = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                             sizeof(float) * numChanges, newWeights, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    errNum |= clSetKernelArg(scatterEdgeWeightsKernel, 1, sizeof(cl_mem), &changedEdgesDevice);
+    errNum |= clSetKernelArg(scatterEdgeWeightsKernel, 2, sizeof(cl_mem), &newWeightsDevice);
+    errNum |= clSetKernelArg(scatterEdgeWeightsKernel, 3, sizeof(int), &numChanges);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 1, sizeof(cl_mem), &changedSourcesDevice);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 2, sizeof(cl_mem), &changedEdgesDevice);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 3, sizeof(cl_mem), &oldWeightsDevice);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 4, sizeof(cl_mem), &newWeightsDevice);
+    errNum |= clSetKernelArg(markChangedEdgesKernel, 9, sizeof(int), &numChanges);
+    checkError(errNum, CL_SUCCESS);
 
-    clReleaseMemObject(vertexArrayDevice);
-    clReleaseMemObject(edgeArrayDevice);
-    clReleaseMemObject(weightArrayDevice);
-    clReleaseMemObject(maskArrayDevice);
-    clReleaseMemObject(costArrayDevice);
-    clReleaseMemObject(updatingCostArrayDevice);
+    // One work-item per changed edge.  The invalidation follows the predecessors
+    // rather than the weights, so the new weights can go in straight away.
+    size_t localWorkSize = maxWorkGroupSize;
+    size_t changeWorkSize = roundWorkSizeUp(localWorkSize, numChanges);
+    errNum = clEnqueueNDRangeKernel(commandQueue, scatterEdgeWeightsKernel, 1, 0, &changeWorkSize, &localWorkSize,
+                                    0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
 
-    clReleaseKernel(initializeBuffersKernel);
-    clReleaseKernel(ssspKernel1);
-    clReleaseKernel(ssspKernel2);
+    for ( int i = 0 ; i < numResults; i++ )
+    {
+        float *resultCosts = &inOutResultCosts[i * graph->vertexCount];
+        int *resultPredecessors = &inOutPredecessors[i * graph->vertexCount];
 
-    clReleaseCommandQueue(commandQueue);
-    clReleaseProgram(program);
+        // Start from the previous costs with an empty frontier
+        int noSource = -1;
+        errNum |= clSetKernelArg(initializeBuffersKernel, 3, sizeof(int), &noSource);
+        checkError(errNum, CL_SUCCESS);
+        enqueueVertexKernel(initializeBuffersKernel);
+
+        errNum = clEnqueueWriteBuffer(commandQueue, costArrayDevice, CL_FALSE, 0, sizeof(float) * graph->vertexCount,
+                                      resultCosts, 0, NULL, NULL);
+        errNum |= clEnqueueWriteBuffer(commandQueue, updatingCostArrayDevice, CL_FALSE, 0,
+                                       sizeof(float) * graph->vertexCount, resultCosts, 0, NULL, NULL);
+        errNum |= clEnqueueWriteBuffer(commandQueue, previousCostArrayDevice, CL_FALSE, 0,
+                                       sizeof(float) * graph->vertexCount, resultCosts, 0, NULL, NULL);
+        errNum |= clEnqueueWriteBuffer(commandQueue, predecessorArrayDevice, CL_FALSE, 0,
+                                       sizeof(int) * graph->vertexCount, resultPredecessors, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        // Invalidate the subtrees below the edges that got heavier
+        int increases = 1;
+        errNum |= clSetKernelArg(markChangedEdgesKernel, 8, sizeof(int), &sourceVertices[i]);
+        errNum |= clSetKernelArg(markChangedEdgesKernel, 10, sizeof(int), &increases);
+        errNum |= clSetKernelArg(invalidateSubtreeKernel, 6, sizeof(int), &sourceVertices[i]);
+        errNum |= clSetKernelArg(repairPredecessorsKernel, 6, sizeof(int), &sourceVertices[i]);
+        checkError(errNum, CL_SUCCESS);
+
+        errNum = clEnqueueNDRangeKernel(commandQueue, markChangedEdgesKernel, 1, 0, &changeWorkSize, &localWorkSize,
+                                        0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        bool invalidated = false;
+        while(!frontierEmpty())
+        {
+            enqueueVertexKernel(invalidateSubtreeKernel);
+            invalidated = true;
+        }
+
+        // Then resume the search from the vertices with an edge into the
+        // invalidated ones and the ends of the lighter edges
+        increases = 0;
+        errNum |= clSetKernelArg(markChangedEdgesKernel, 10, sizeof(int), &increases);
+        checkError(errNum, CL_SUCCESS);
+
+        if (invalidated)
+        {
+            enqueueVertexKernel(seedInvalidatedVerticesKernel);
+        }
+
+        errNum = clEnqueueNDRangeKernel(commandQueue, markChangedEdgesKernel, 1, 0, &changeWorkSize, &localWorkSize,
+                                        0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+
+        while(!frontierEmpty())
+        {
+            runIterations( false );
+        }
+
+        enqueueVertexKernel(repairPredecessorsKernel);
+
+        errNum = clEnqueueReadBuffer(commandQueue, costArrayDevice, CL_FALSE, 0, sizeof(float) * graph->vertexCount,
+                                     resultCosts, 0, NULL, NULL);
+        errNum |= clEnqueueReadBuffer(commandQueue, predecessorArrayDevice, CL_TRUE, 0, sizeof(int) * graph->vertexCount,
+                                      resultPredecessors, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+    }
+
+    // The device already holds the new weights, keep the host copy in step once
+    // it is done with them.  When the buffer uses the host array in place the
+    // kernel wrote it already, and mapping it makes those writes visible.
+    clFinish(commandQueue);
+    cl_mem_flags weightFlags = 0;
+    clGetMemObjectInfo(weightArrayDevice, CL_MEM_FLAGS, sizeof(cl_mem_flags), &weightFlags, NULL);
+    if (weightFlags & CL_MEM_USE_HOST_PTR)
+    {
+        void *mapped = clEnqueueMapBuffer(commandQueue, weightArrayDevice, CL_TRUE, CL_MAP_READ, 0,
+                                          sizeof(float) * graph->edgeCount, 0, NULL, NULL, &errNum);
+        checkError(errNum, CL_SUCCESS);
+        errNum = clEnqueueUnmapMemObject(commandQueue, weightArrayDevice, mapped, 0, NULL, NULL);
+        checkError(errNum, CL_SUCCESS);
+        clFinish(commandQueue);
+    }
+    else
+    {
+        for (int c = 0; c < numChanges; c++)
+        {
+            graph->weightArray[changedEdges[c]] = newWeights[c];
+        }
+    }
+
+    clReleaseMemObject(changedEdgesDevice);
+    clReleaseMemObject(changedSourcesDevice);
+    clReleaseMemObject(oldWeightsDevice);
+    clReleaseMemObject(newWeightsDevice);
+    free(changedSources);
+    free(oldWeights);
+}
+
+///
+/// Create the kernels and buffers used by the bounded searches
+///
+void DijkstraSession::initBounded()
+{
+    if (compactCostsKernel != NULL)
+    {
+        return;
+    }
+
+    cl_int errNum;
+
+    targetArrayDevice = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(int) * graph->vertexCount, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    compactVerticesDevice = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(int) * graph->vertexCount, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    compactCostsDevice = clCreateBuffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * graph->vertexCount, NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+    resultCountDevice = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    countSettledTargetsKernel = clCreateKernel(program, "countSettledTargets", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(countSettledTargetsKernel, 0, sizeof(cl_mem), &targetArrayDevice);
+    errNum |= clSetKernelArg(countSettledTargetsKernel, 1, sizeof(cl_mem), &costArrayDevice);
+    errNum |= clSetKernelArg(countSettledTargetsKernel, 2, sizeof(cl_mem), &frontierMinimumDevice);
+    errNum |= clSetKernelArg(countSettledTargetsKernel, 3, sizeof(cl_mem), &resultCountDevice);
+    errNum |= clSetKernelArg(countSettledTargetsKernel, 4, sizeof(int), &graph->vertexCount);
+    checkError(errNum, CL_SUCCESS);
+
+    compactCostsKernel = clCreateKernel(program, "compactCosts", &errNum);
+    checkError(errNum, CL_SUCCESS);
+    errNum |= clSetKernelArg(compactCostsKernel, 0, sizeof(cl_mem), &costArrayDevice);
+    // 1 set in compactResults()
+    errNum |= clSetKernelArg(compactCostsKernel, 2, sizeof(cl_mem), &compactVerticesDevice);
+    errNum |= clSetKernelArg(compactCostsKernel, 3, sizeof(cl_mem), &compactCostsDevice);
+    errNum |= clSetKernelArg(compactCostsKernel, 4, sizeof(cl_mem), &resultCountDevice);
+    // 5 set in compactResults()
+    errNum |= clSetKernelArg(compactCostsKernel, 6, sizeof(int), &graph->vertexCount);
+    checkError(errNum, CL_SUCCESS);
+}
+
+///
+/// Check whether the costs of at least k of the targets are final.  Like
+/// endVertexSettled() this only reads two values back from the device.
+///
+bool DijkstraSession::targetsSettled( int k )
+{
+    cl_int errNum;
+    cl_event readDone;
+    float noFrontier = FLT_MAX;
+    cl_int noneSettled = 0;
+    cl_int frontierMinimum;
+    cl_int settledCount;
+
+    errNum = clEnqueueWriteBuffer(commandQueue, frontierMinimumDevice, CL_FALSE, 0, sizeof(cl_int),
+                                  &noFrontier, 0, NULL, NULL);
+    errNum |= clEnqueueWriteBuffer(commandQueue, resultCountDevice, CL_FALSE, 0, sizeof(cl_int),
+                                   &noneSettled, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    enqueueVertexKernel(frontierMinimumKernel);
+    enqueueVertexKernel(countSettledTargetsKernel);
+
+    errNum = clEnqueueReadBuffer(commandQueue, frontierMinimumDevice, CL_FALSE, 0, sizeof(cl_int),
+                                 &frontierMinimum, 0, NULL, NULL);
+    errNum |= clEnqueueReadBuffer(commandQueue, resultCountDevice, CL_FALSE, 0, sizeof(cl_int),
+                                  &settledCount, 0, NULL, &readDone);
+    checkError(errNum, CL_SUCCESS);
+    clWaitForEvents(1, &readDone);
+    clReleaseEvent(readDone);
+
+    // Once the frontier is empty every reachable target is settled
+    float minimumCost;
+    memcpy(&minimumCost, &frontierMinimum, sizeof(float));
+
+    return (minimumCost == FLT_MAX || settledCount >= k);
+}
+
+///
+/// Gather the vertices with a cost of at most maxCost, limited to those flagged
+/// in targetArray if it is not NULL, and return them sorted by cost
+///
+int DijkstraSession::compactResults( cl_mem targetArray, float maxCost, int *outVertices, float *outCosts )
+{
+    cl_int errNum;
+    cl_int count = 0;
+
+    errNum = clEnqueueWriteBuffer(commandQueue, resultCountDevice, CL_FALSE, 0, sizeof(cl_int),
+                                  &count, 0, NULL, NULL);
+    errNum |= clSetKernelArg(compactCostsKernel, 1, sizeof(cl_mem), (targetArray != NULL) ? &targetArray : NULL);
+    errNum |= clSetKernelArg(compactCostsKernel, 5, sizeof(float), &maxCost);
+    checkError(errNum, CL_SUCCESS);
+
+    enqueueVertexKernel(compactCostsKernel);
+
+    errNum = clEnqueueReadBuffer(commandQueue, resultCountDevice, CL_TRUE, 0, sizeof(cl_int),
+                                 &count, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    std::vector<int> vertices(count);
+    std::vector<float> costs(count);
+    errNum = clEnqueueReadBuffer(commandQueue, compactVerticesDevice, CL_FALSE, 0, sizeof(int) * count,
+                                 &vertices[0], 0, NULL, NULL);
+    errNum |= clEnqueueReadBuffer(commandQueue, compactCostsDevice, CL_TRUE, 0, sizeof(float) * count,
+                                  &costs[0], 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    // The kernel gathers them in no particular order
+    std::vector< pair<float, int> > sorted(count);
+    for (int i = 0; i < count; i++)
+    {
+        sorted[i] = make_pair(costs[i], vertices[i]);
+    }
+    sort(sorted.begin(), sorted.end());
+
+    for (int i = 0; i < count; i++)
+    {
+        outVertices[i] = sorted[i].second;
+        outCosts[i] = sorted[i].first;
+    }
+
+    return count;
+}
+
+///
+/// Find every vertex within radius of sourceVertex
+///
+int DijkstraSession::solveWithinRadius( int sourceVertex, float radius, int *outVertices, float *outCosts )
+{
+    initBounded();
+
+    cl_int errNum = clSetKernelArg(ssspKernel2, 7, sizeof(float), &radius);
+    checkError(errNum, CL_SUCCESS);
+
+    initializeSearch( sourceVertex, false );
+    while(!frontierEmpty())
+    {
+        runIterations( false );
+    }
+
+    float noMaxCost = FLT_MAX;
+    errNum = clSetKernelArg(ssspKernel2, 7, sizeof(float), &noMaxCost);
+    checkError(errNum, CL_SUCCESS);
+
+    return compactResults( NULL, radius, outVertices, outCosts );
+}
+
+///
+/// Find the k target vertices nearest to sourceVertex
+///
+int DijkstraSession::solveNearestTargets( int sourceVertex, int *targetVertices, int numTargets, int k,
+                                          int *outVertices, float *outCosts )
+{
+    if (k <= 0 || numTargets <= 0)
+    {
+        return 0;
+    }
+
+    initBounded();
+
+    std::vector<int> targetFlags(graph->vertexCount, 0);
+    for (int i = 0; i < numTargets; i++)
+    {
+        targetFlags[targetVertices[i]] = 1;
+    }
+
+    cl_int errNum = clEnqueueWriteBuffer(commandQueue, targetArrayDevice, CL_FALSE, 0, sizeof(int) * graph->vertexCount,
+                                         &targetFlags[0], 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    initializeSearch( sourceVertex, false );
+    while(!targetsSettled(k))
+    {
+        runIterations( false );
+    }
+
+    // Every target gathered is settled, and any target still unsettled costs
+    // at least as much, so the first k gathered are the nearest
+    std::vector<int> vertices(numTargets);
+    std::vector<float> costs(numTargets);
+    float settledCost;
+    cl_int frontierMinimum;
+    errNum = clEnqueueReadBuffer(commandQueue, frontierMinimumDevice, CL_TRUE, 0, sizeof(cl_int),
+                                 &frontierMinimum, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+    memcpy(&settledCost, &frontierMinimum, sizeof(float));
+
+    int count = compactResults( targetArrayDevice, settledCost, &vertices[0], &costs[0] );
+    count = min(count, k);
+    copy(vertices.begin(), vertices.begin() + count, outVertices);
+    copy(costs.begin(), costs.begin() + count, outCosts);
+
+    return count;
+}
+
+///
+/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
+/// function will compute the shortest path distance from sourceVertices[n] ->
+/// endVertices[n] and store the cost in outResultCosts[n].  The number of results
+/// it will compute is given by numResults.
+///
+/// This function will run the algorithm on a single GPU.
+///
+/// \param gpuContext Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernel.  This can
+///                 be determined externally by the caller or the multi
+///                 GPU version will automatically split the work across
+///                 devices
+/// \param graph Structure containing the vertex, edge, and weight arra
+///              for the input graph
+/// \param startVertices Indices into the vertex array from which to
+///                      start the search
+/// \param outResultsCosts A pre-allocated array where the results for
+///                        each shortest path search will be written
+/// \param numResults Should be the size of all three passed inarrays
+///
+void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
+                  int *sourceVertices, float *outResultCosts, int numResults,
+                  DijkstraStats *outStats )
+{
+    DijkstraSession session( context, deviceId, graph );
+    if (!session.isValid())
+    {
+        return;
+    }
+
+    cout << "Computing '" << numResults << "' results." << endl;
+    session.solve( sourceVertices, numResults, outResultCosts, NULL, outStats );
+    cout << "Computed '" << numResults << "' results" << endl;
+}
+
+///
+/// Run Dijkstra's shortest path on a compressed graph on a single device
+///
+void runDijkstraCompressed( cl_context context, cl_device_id deviceId, CompressedGraphData *compressedGraph,
+                            int *sourceVertices, float *outResultCosts, int numResults,
+                            DijkstraStats *outStats )
+{
+    DijkstraSession session( context, deviceId, compressedGraph );
+    if (!session.isValid())
+    {
+        return;
+    }
+
+    cout << "Computing '" << numResults << "' results on the compressed graph." << endl;
+    session.solve( sourceVertices, numResults, outResultCosts, NULL, outStats );
     cout << "Computed '" << numResults << "' results" << endl;
+}
+
+///
+/// Follow the predecessors back from endVertex to recover the shortest path
+///
+int extractPath( const int *predecessors, int vertexCount, int sourceVertex, int endVertex,
+                 int *outPath )
+{
+    int length = 0;
+    int vertex = endVertex;
 
+    // A path can visit each vertex at most once, which also stops a broken
+    // predecessor chain from looping forever
+    while (vertex >= 0 && length < vertexCount)
+    {
+        outPath[length++] = vertex;
+        if (vertex == sourceVertex)
+        {
+            reverse(outPath, outPath + length);
+            return length;
+        }
+        vertex = predecessors[vertex];
+    }
+
+    return 0;
 }
 
+///
+/// Run point-to-point Dijkstra's shortest path on a single device
+///
+void runDijkstraPointToPoint( cl_context context, cl_device_id deviceId, GraphData* graph,
+                              int *sourceVertices, int *endVertices, float *outResultCosts,
+                              int numResults, int *outPredecessors )
+{
+    DijkstraSession session( context, deviceId, graph );
+    if (!session.isValid())
+    {
+        return;
+    }
 
+    cout << "Computing '" << numResults << "' point-to-point results." << endl;
+    session.solvePointToPoint( sourceVertices, endVertices, numResults, outResultCosts, outPredecessors );
+    cout << "Computed '" << numResults << "' point-to-point results" << endl;
+}
 
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
@@ -637,8 +1985,8 @@ void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available.  It will
-/// create N threads, one for each GPU, and chunk the workload up to perform
-/// (numResults / N) searches per GPU.
+/// create N threads, one for each GPU, which pull batches of searches from a
+/// shared queue until all numResults searches are done.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param graph Structure containing the vertex, edge, and weight arra
@@ -672,45 +2020,25 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
     }
 
     DevicePlan *devicePlans = (DevicePlan*) malloc(sizeof(DevicePlan) * deviceCount);
-    pthread_t *threadIDs = (pthread_t*) malloc(sizeof(pthread_t) * deviceCount);
-
-    // Divide the workload out per device
-    int resultsPerDevice = numResults / deviceCount;
 
-    int offset = 0;
+    // All of the GPUs pull their work from the same queue
+    WorkQueue workQueue;
+    initWorkQueue(&workQueue, sourceVertices, outResultCosts, graph->vertexCount,
+                  numResults, numResults / (deviceCount * NUM_BATCHES_PER_DEVICE));
 
     for (unsigned int i = 0; i < deviceCount; i++)
     {
         devicePlans[i].context = gpuContext;
-        devicePlans[i].deviceId = getDev(gpuContext, i);;
+        devicePlans[i].deviceId = getDev(gpuContext, i);
         devicePlans[i].graph = graph;
-        devicePlans[i].sourceVertices = &sourceVertices[offset];
-        devicePlans[i].outResultCosts = &outResultCosts[offset * graph->vertexCount];
-        devicePlans[i].numResults = resultsPerDevice;
-
-        offset += resultsPerDevice;
-    }
-
-    // Add any remaining work to the last GPU
-    if (offset < numResults)
-    {
-        devicePlans[deviceCount - 1].numResults += (numResults - offset);
-    }
-
-    // Launch all the threads
-    for (unsigned int i = 0; i < deviceCount; i++)
-    {
-        pthread_create(&threadIDs[i], NULL, (void* (*)(void*))dijkstraThread, (void*)(devicePlans + i));
+        devicePlans[i].workQueue = &workQueue;
+        devicePlans[i].copyGraph = false;
     }
 
-    // Wait for the results from all threads
-    for (unsigned int i = 0; i < deviceCount; i++)
-    {
-        pthread_join(threadIDs[i], NULL);
-    }
+    runDevicePlans(devicePlans, deviceCount);
 
+    releaseWorkQueue(&workQueue);
     free (devicePlans);
-    free (threadIDs);
 }
 
 ///
@@ -720,8 +2048,8 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available along with
-/// the CPU.  It will create N threads, one for each device, and chunk the workload up to perform
-/// (numResults / N) searches per device.
+/// the CPU.  It will create N threads, one for each device, which pull batches of
+/// searches from a shared queue until all numResults searches are done.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param cpuContext Current CPU context, must be created by caller
@@ -738,8 +2066,6 @@ void runDijkstraMultiGPUandCPU( cl_context gpuContext, cl_context cpuContext, Gr
                                 int *sourceVertices,
                                 float *outResultCosts, int numResults )
 {
-    float ratioCPUtoGPU = 2.26; // CPU seems to run it at 2.26X on GT120 GPU
-
     // Find out how many GPU's to compute on all available GPUs
     cl_int errNum;
     size_t deviceBytes;
@@ -769,67 +2095,141 @@ void runDijkstraMultiGPUandCPU( cl_context gpuContext, cl_context cpuContext, Gr
     cl_uint totalDeviceCount = gpuDeviceCount + cpuDeviceCount;
 
     DevicePlan *devicePlans = (DevicePlan*) malloc(sizeof(DevicePlan) * totalDeviceCount);
-    pthread_t *threadIDs = (pthread_t*) malloc(sizeof(pthread_t) * totalDeviceCount);
-
-    int gpuResults = numResults / (ratioCPUtoGPU);
-    cout << "gpuResults: " << gpuResults;
-    int cpuResults = numResults - gpuResults;
-    cout << "cpuResults: " << cpuResults;
 
-    // Divide the workload out per device
-    int resultsPerGPU = gpuResults / totalDeviceCount;
-
-    int offset = 0;
+    // The GPUs and CPUs all pull their work from the same queue, so there is
+    // no need to guess ahead of time how much faster one is than the other
+    WorkQueue workQueue;
+    initWorkQueue(&workQueue, sourceVertices, outResultCosts, graph->vertexCount,
+                  numResults, numResults / (totalDeviceCount * NUM_BATCHES_PER_DEVICE));
 
     int curDevice = 0;
     for (unsigned int i = 0; i < gpuDeviceCount; i++)
     {
         devicePlans[curDevice].context = gpuContext;
-        devicePlans[curDevice].deviceId = getDev(gpuContext, i);;
+        devicePlans[curDevice].deviceId = getDev(gpuContext, i);
         devicePlans[curDevice].graph = graph;
-        devicePlans[curDevice].sourceVertices = &sourceVertices[offset];
-        devicePlans[curDevice].outResultCosts = &outResultCosts[offset * graph->vertexCount];
-        devicePlans[curDevice].numResults = resultsPerGPU;
-
-        offset += resultsPerGPU;
+        devicePlans[curDevice].workQueue = &workQueue;
+        devicePlans[curDevice].copyGraph = false;
         curDevice++;
     }
 
-    int resultsPerCPU = cpuResults;
-
     for (unsigned int i = 0; i < cpuDeviceCount; i++)
     {
         devicePlans[curDevice].context = cpuContext;
-        devicePlans[curDevice].deviceId = getDev(cpuContext, i);;
+        devicePlans[curDevice].deviceId = getDev(cpuContext, i);
         devicePlans[curDevice].graph = graph;
-        devicePlans[curDevice].sourceVertices = &sourceVertices[offset];
-        devicePlans[curDevice].outResultCosts = &outResultCosts[offset * graph->vertexCount];
-        devicePlans[curDevice].numResults = resultsPerCPU;
-
-        offset += resultsPerCPU;
+        devicePlans[curDevice].workQueue = &workQueue;
+        devicePlans[curDevice].copyGraph = false;
         curDevice++;
     }
 
-    // Add any remaining work to the last GPU
-    if (offset < numResults)
+    runDevicePlans(devicePlans, totalDeviceCount);
+
+    releaseWorkQueue(&workQueue);
+    free (devicePlans);
+}
+
+///
+/// Run Dijkstra's shortest path on the CPU split into sub-devices, each with
+/// its own copy of the graph, pulling searches from a shared queue
+///
+void runDijkstraSubDevices( cl_context cpuContext, GraphData* graph, int *sourceVertices,
+                            float *outResultCosts, int numResults, int numPartitions )
+{
+    cl_device_id cpuDevice = getMaxFlopsDev(cpuContext);
+
+#ifdef CL_VERSION_1_2
+    cl_int errNum;
+    std::vector<cl_device_partition_property> properties;
+    if (numPartitions > 0)
     {
-        devicePlans[totalDeviceCount - 1].numResults += (numResults - offset);
-    }
+        cl_uint computeUnits;
+        cl_uint maxSubDevices;
+        errNum = clGetDeviceInfo(cpuDevice, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &computeUnits, NULL);
+        errNum |= clGetDeviceInfo(cpuDevice, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(cl_uint), &maxSubDevices, NULL);
+        checkError(errNum, CL_SUCCESS);
 
-    // Launch all the threads
-    for (unsigned int i = 0; i < totalDeviceCount; i++)
+        // Give each partition its share of the compute units, the first ones
+        // taking one more when they do not divide evenly
+        cl_uint parts = min(min((cl_uint)numPartitions, computeUnits), max(maxSubDevices, (cl_uint)1));
+        properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+        for (cl_uint i = 0; i < parts; i++)
+        {
+            properties.push_back(computeUnits / parts + ((i < computeUnits % parts) ? 1 : 0));
+        }
+        properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+    }
+    else
     {
-        pthread_create(&threadIDs[i], NULL, (void* (*)(void*))dijkstraThread, (void*)(devicePlans + i));
+        properties.push_back(CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN);
+        properties.push_back(CL_DEVICE_AFFINITY_DOMAIN_NUMA);
     }
+    properties.push_back(0);
 
-    // Wait for the results from all threads
-    for (unsigned int i = 0; i < totalDeviceCount; i++)
+    cl_uint deviceCount = 0;
+    errNum = clCreateSubDevices(cpuDevice, &properties[0], 0, NULL, &deviceCount);
+    if (errNum == CL_SUCCESS && deviceCount > 0)
     {
-        pthread_join(threadIDs[i], NULL);
+        cl_device_id *subDevices = (cl_device_id*) malloc(sizeof(cl_device_id) * deviceCount);
+        errNum = clCreateSubDevices(cpuDevice, &properties[0], deviceCount, subDevices, &deviceCount);
+        checkError(errNum, CL_SUCCESS);
+
+        if (numPartitions > 0 && deviceCount != (cl_uint)numPartitions)
+        {
+            cerr << "Asked for " << numPartitions << " sub-devices, the CPU was split into "
+                 << deviceCount << "." << endl;
+        }
+        else
+        {
+            cout << "Split the CPU into " << deviceCount << " sub-devices." << endl;
+        }
+
+        // Each sub-device gets a context of its own, so that its buffers are
+        // only ever placed for it
+        cl_context *subDeviceContexts = (cl_context*) malloc(sizeof(cl_context) * deviceCount);
+        for (unsigned int i = 0; i < deviceCount; i++)
+        {
+            subDeviceContexts[i] = clCreateContext(NULL, 1, &subDevices[i], NULL, NULL, &errNum);
+            checkError(errNum, CL_SUCCESS);
+        }
+
+        DevicePlan *devicePlans = (DevicePlan*) malloc(sizeof(DevicePlan) * deviceCount);
+
+        WorkQueue workQueue;
+        initWorkQueue(&workQueue, sourceVertices, outResultCosts, graph->vertexCount,
+                      numResults, numResults / (deviceCount * NUM_BATCHES_PER_DEVICE));
+
+        for (unsigned int i = 0; i < deviceCount; i++)
+        {
+            devicePlans[i].context = subDeviceContexts[i];
+            devicePlans[i].deviceId = subDevices[i];
+            devicePlans[i].graph = graph;
+            devicePlans[i].workQueue = &workQueue;
+            devicePlans[i].copyGraph = true;
+        }
+
+        runDevicePlans(devicePlans, deviceCount);
+
+        releaseWorkQueue(&workQueue);
+        free (devicePlans);
+
+        for (unsigned int i = 0; i < deviceCount; i++)
+        {
+            clReleaseContext(subDeviceContexts[i]);
+            clReleaseDevice(subDevices[i]);
+        }
+        free (subDeviceContexts);
+        free (subDevices);
+        return;
     }
 
-    free (devicePlans);
-    free (threadIDs);
+    cerr << "Could not split the CPU into sub-devices, running on the whole device." << endl;
+#else
+    (void)numPartitions;
+    cerr << "Sub-devices need OpenCL 1.2, running on the whole device." << endl;
+#endif
+
+    runDijkstra(cpuContext, cpuDevice, graph, sourceVertices, outResultCosts, numResults);
 }
 
 ///
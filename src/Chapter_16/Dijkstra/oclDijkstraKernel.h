@@ -34,6 +34,8 @@
     #include <CL/cl.h>
 #endif
 
+#include <vector>
+
 ///
 //  Types
 //
@@ -61,6 +63,80 @@ typedef struct
 
 } GraphData;
 
+///
+//  A compressed form of GraphData which takes less memory and bandwidth.  Each
+//  vertex's edges are sorted by destination and stored as a byte stream of
+//  (destination, weight) pairs.  The destination is a varint (7 bits per byte,
+//  high bit set on all but the last byte) holding the zig-zag encoded difference
+//  from the vertex itself for the first edge and the difference from the
+//  previous destination for the rest.  The weight follows as a little-endian
+//  16-bit integer which is multiplied by weightScale, so weights are rounded
+//  to within weightScale / 2.
+//
+typedef struct
+{
+    // (V) Byte offset of the edges of each vertex in edgeBytes
+    int *vertexArray;
+
+    // Vertex count
+    int vertexCount;
+
+    // (E) The encoded edges
+    unsigned char *edgeBytes;
+
+    // Size of edgeBytes
+    int edgeByteCount;
+
+    // Edge count
+    int edgeCount;
+
+    // Multiplier turning the stored weights back into costs
+    float weightScale;
+
+} CompressedGraphData;
+
+///
+//  Counters and timings of a single search, filled in when they are asked for.
+//  Collecting them enables profiling on the device's command queue and counts
+//  the frontier before every relaxation.  The counting is timed on its own and
+//  left out of the other timings.
+//
+typedef struct
+{
+    // Vertex the search started from
+    int sourceVertex;
+
+    // Relaxation iterations run, including any that ran after the frontier
+    // had emptied and before the mask was next read back
+    int iterations;
+
+    // Kernels enqueued by the search, not counting the counters themselves
+    int kernelLaunches;
+
+    // Times the mask array was read back to check for an empty frontier
+    int maskReadbacks;
+
+    // Vertices in the frontier summed over all of the iterations
+    long long frontierVertices;
+
+    // Edges leaving the frontier summed over all of the iterations.  For
+    // compressed graphs this is estimated from the encoded bytes.
+    long long edgesRelaxed;
+
+    // Device time spent in the kernels and in reading back the mask array
+    // and the costs, in seconds, from the command queue's profiling events
+    double kernelTime;
+    double readbackTime;
+
+    // Device time spent counting the frontier plus the wall clock time of
+    // reading the counts back, in seconds
+    double countTime;
+
+    // Wall clock time of the whole search in seconds, less countTime
+    double elapsedTime;
+
+} DijkstraStats;
+
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
 /// function will compute the shortest path distance from sourceVertices[n] ->
@@ -69,7 +145,10 @@ typedef struct
 ///
 /// This version of the function will run the algorithm on either just the CPU,
 /// CPU + GPU, GPU, or Multi GPU depending on what compute resources are available
-/// on the system.
+/// on the system.  A single search runs on one GPU, or the CPU if there is none.
+/// Several searches run on all of the GPUs and the CPU together when both are
+/// present, see runDijkstraMultiGPUandCPU().  With only a CPU they run on the
+/// whole device, or on sub-devices if numPartitions asks for them.
 ///
 /// \param graph Structure containing the vertex, edge, and weight arra
 ///              for the input graph
@@ -79,9 +158,11 @@ typedef struct
 ///                        each shortest path search will be written.
 ///                        This must be sized numResults * graph->numVertices.
 /// \param numResults Should be the size of all three passed inarrays
+/// \param numPartitions When only a CPU is available, split it as
+///                      runDijkstraSubDevices() does, or -1 not to split it
 ///
 void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
-                        float *outResultCosts, int numResults );
+                        float *outResultCosts, int numResults, int numPartitions = -1 );
 
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
@@ -104,10 +185,321 @@ void runDijkstraOpenCL( GraphData* graph, int *sourceVertices,
 ///                        each shortest path search will be written.
 ///                        This must be sized numResults * graph->numVertices.
 /// \param numResults Should be the size of all three passed inarrays
+/// \param outStats If not NULL, receives the counters and timings of each
+///                 search, see DijkstraSession::solve()
 ///
 void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
-                  int *sourceVertices, float *outResultCosts, int numResults );
+                  int *sourceVertices, float *outResultCosts, int numResults,
+                  DijkstraStats *outStats = NULL );
+
+///
+/// A DijkstraSession holds everything needed to run Dijkstra's shortest path on
+/// a single device against a single graph: the command queue, the built program,
+/// the kernels and the graph arrays uploaded to the device.  These are all set up
+/// once when the session is created, so it should be used instead of runDijkstra()
+/// when answering many queries against the same graph.
+///
+/// A session must only be used by one thread at a time.
+///
+class DijkstraSession
+{
+public:
+
+    ///
+    /// \param context Current context, must be created by caller
+    /// \param deviceId The device ID on which to run the kernels
+    /// \param graph Structure containing the vertex, edge, and weight arrays
+    ///              for the input graph.  It must stay valid for the lifetime
+    ///              of the session.
+    ///
+    DijkstraSession( cl_context context, cl_device_id deviceId, GraphData *graph );
+
+    ///
+    /// Create a session searching a compressed graph.  Predecessors are not
+    /// available for compressed graphs.
+    ///
+    /// \param context Current context, must be created by caller
+    /// \param deviceId The device ID on which to run the kernels
+    /// \param compressedGraph The compressed graph, which must stay valid for
+    ///                        the lifetime of the session
+    ///
+    DijkstraSession( cl_context context, cl_device_id deviceId, CompressedGraphData *compressedGraph );
+
+    ~DijkstraSession();
+
+    ///
+    /// Whether the program was built and the graph uploaded successfully
+    ///
+    bool isValid() const;
+
+    ///
+    /// Compute the shortest path distance from each of sourceVertices[n] to every
+    /// vertex in the graph and store it in outResultCosts[n * graph->vertexCount].
+    ///
+    /// \param sourceVertices Indices into the vertex array from which to
+    ///                       start each search
+    /// \param numResults Number of searches to run
+    /// \param outResultCosts A pre-allocated array where the results for
+    ///                       each shortest path search will be written.
+    ///                       This must be sized numResults * graph->vertexCount.
+    /// \param outPredecessors If not NULL, receives the vertex before each vertex
+    ///                        on its shortest path from sourceVertices[n], or -1,
+    ///                        at outPredecessors[n * graph->vertexCount].  Pass it
+    ///                        to extractPath() to recover a path.
+    /// \param outStats If not NULL, receives the counters and timings of each
+    ///                 search at outStats[n]
+    ///
+    void solve( int *sourceVertices, int numResults, float *outResultCosts,
+                int *outPredecessors = NULL, DijkstraStats *outStats = NULL );
 
+    ///
+    /// Compute the shortest path distance from sourceVertices[n] to endVertices[n]
+    /// and store it in outResultCosts[n].  Each search stops as soon as its end
+    /// vertex is settled rather than running until every vertex is, and only the
+    /// one cost is read back from the device.
+    ///
+    /// \param sourceVertices Vertices from which to start each search
+    /// \param endVertices Vertices at which to end each search
+    /// \param numResults Number of searches to run
+    /// \param outResultCosts A pre-allocated array of numResults costs.  Vertices
+    ///                       that cannot be reached get a cost of FLT_MAX.
+    /// \param outPredecessors If not NULL, receives the predecessors as in solve().
+    ///                        Only those along the path to endVertices[n] are
+    ///                        guaranteed to be final.
+    ///
+    void solvePointToPoint( int *sourceVertices, int *endVertices, int numResults,
+                            float *outResultCosts, int *outPredecessors = NULL );
+
+    ///
+    /// Change the weights of a batch of edges and repair the costs and
+    /// predecessors of searches made with the old weights, rather than running
+    /// them again.  Vertices whose predecessor edge got heavier are invalidated
+    /// along with everything below them in the predecessor tree, and the search
+    /// is then resumed from the edges into them and the edges that got lighter.
+    /// Only the part of each search affected by the changes is redone.
+    ///
+    /// The invalidation goes by the predecessors alone, so the results must come
+    /// from solve() on this graph with outPredecessors, as updated by earlier
+    /// calls.  The new weights are also written to graph->weightArray, so later
+    /// searches see them too.  Not available for compressed graphs.
+    ///
+    /// \param changedEdges Indices into the edge array of the edges to change.
+    ///                     Each edge may appear at most once.
+    /// \param newWeights The new weight of each changed edge
+    /// \param numChanges Number of edges to change
+    /// \param sourceVertices Vertices from which each search was made
+    /// \param numResults Number of searches to repair
+    /// \param inOutResultCosts The costs computed by solve() for sourceVertices,
+    ///                         laid out as in solve(), which are repaired in place
+    /// \param inOutPredecessors The predecessors computed along with them, which
+    ///                          are repaired in place
+    ///
+    void updateEdgeWeights( int *changedEdges, float *newWeights, int numChanges,
+                            int *sourceVertices, int numResults, float *inOutResultCosts,
+                            int *inOutPredecessors );
+
+    ///
+    /// Find every vertex within radius of sourceVertex.  Relaxations giving a
+    /// cost above radius are dropped, so the search only covers the part of the
+    /// graph inside the radius.
+    ///
+    /// \param sourceVertex Vertex from which to start the search
+    /// \param radius Highest cost to search to
+    /// \param outVertices A pre-allocated array of graph->vertexCount entries
+    ///                    which receives the vertices found, cheapest first
+    /// \param outCosts A pre-allocated array of graph->vertexCount entries which
+    ///                 receives the cost of each vertex in outVertices
+    /// \return Number of vertices found, including sourceVertex itself
+    ///
+    int solveWithinRadius( int sourceVertex, float radius, int *outVertices, float *outCosts );
+
+    ///
+    /// Find the k target vertices nearest to sourceVertex.  The search stops as
+    /// soon as the costs of k of the targets are final.
+    ///
+    /// \param sourceVertex Vertex from which to start the search
+    /// \param targetVertices The vertices to search for
+    /// \param numTargets Number of vertices in targetVertices
+    /// \param k Number of targets to find
+    /// \param outVertices A pre-allocated array of k entries which receives the
+    ///                    nearest targets, cheapest first
+    /// \param outCosts A pre-allocated array of k entries which receives the
+    ///                 cost of each vertex in outVertices
+    /// \return Number of targets found, which is less than k if fewer can be
+    ///         reached from sourceVertex
+    ///
+    int solveNearestTargets( int sourceVertex, int *targetVertices, int numTargets, int k,
+                             int *outVertices, float *outCosts );
+
+private:
+
+    void init( cl_context context, cl_device_id deviceId, GraphData *graph,
+               CompressedGraphData *compressedGraph );
+    bool initPredecessors();
+    void enqueueVertexKernel( cl_kernel kernel );
+    void initializeSearch( int sourceVertex, bool trackPredecessors );
+    void runIterations( bool trackPredecessors );
+    void readPredecessors( int sourceVertex, bool trackPredecessors, int *outPredecessors );
+    bool endVertexSettled( int endVertex, float *outCost );
+    bool initRepair();
+    void initStats();
+    void collectStats();
+    void initBounded();
+    bool targetsSettled( int k );
+    int compactResults( cl_mem targetArray, float maxCost, int *outVertices, float *outCosts );
+    bool frontierEmpty();
+
+    // Sessions own OpenCL objects and are not copyable
+    DijkstraSession( const DijkstraSession & );
+    DijkstraSession &operator=( const DijkstraSession & );
+
+    cl_context context;
+    cl_device_id deviceId;
+    GraphData *graph;
+
+    // For compressed graphs, graph points at compressedGraphSize, which only
+    // holds the vertex and edge counts
+    CompressedGraphData *compressedGraph;
+    GraphData compressedGraphSize;
+
+    cl_command_queue commandQueue;
+    cl_program program;
+
+    cl_kernel initializeBuffersKernel;
+    cl_kernel ssspKernel1;
+    cl_kernel ssspKernel2;
+    cl_kernel frontierMinimumKernel;
+
+    // Created the first time predecessors are asked for.  Devices with 64-bit
+    // atomics track them during relaxation, others derive them afterwards.
+    bool hasInt64Atomics;
+    cl_kernel initializeCostParentKernel;
+    cl_kernel ssspKernel1Predecessor;
+    cl_kernel ssspKernel2Predecessor;
+    cl_kernel initializePredecessorsKernel;
+    cl_kernel derivePredecessorsKernel;
+
+    // Created the first time edge weights are updated
+    cl_kernel scatterEdgeWeightsKernel;
+    cl_kernel markChangedEdgesKernel;
+    cl_kernel invalidateSubtreeKernel;
+    cl_kernel seedInvalidatedVerticesKernel;
+    cl_kernel repairPredecessorsKernel;
+    cl_mem previousCostArrayDevice;
+
+    // Created the first time stats are asked for.  While a search collects
+    // them, currentStats points at its entry and kernelEvents and countEvents
+    // hold the events of the search and counting kernels enqueued since the
+    // last mask read back.
+    cl_kernel countFrontierKernel;
+    cl_mem frontierCountsDevice;
+    DijkstraStats *currentStats;
+    std::vector<cl_event> kernelEvents;
+    std::vector<cl_event> countEvents;
+
+    // Created the first time a bounded search is run
+    cl_kernel countSettledTargetsKernel;
+    cl_kernel compactCostsKernel;
+    cl_mem targetArrayDevice;
+    cl_mem compactVerticesDevice;
+    cl_mem compactCostsDevice;
+    cl_mem resultCountDevice;
+
+    cl_mem vertexArrayDevice;
+    cl_mem edgeArrayDevice;
+    cl_mem weightArrayDevice;
+    cl_mem maskArrayDevice;
+    cl_mem costArrayDevice;
+    cl_mem updatingCostArrayDevice;
+    cl_mem frontierMinimumDevice;
+    cl_mem predecessorArrayDevice;
+    cl_mem updatingCostParentArrayDevice;
+
+    size_t maxWorkGroupSize;
+    int *maskArrayHost;
+};
+
+///
+/// Run Dijkstra's shortest path on a compressed graph on a single device.  This
+/// works as runDijkstra() does, but uses less device memory and bandwidth at the
+/// cost of rounding the edge weights.
+///
+/// \param context Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernel
+/// \param compressedGraph The compressed graph, as built by compressGraph()
+/// \param sourceVertices Indices into the vertex array from which to
+///                       start the search
+/// \param outResultCosts A pre-allocated array where the results for
+///                       each shortest path search will be written.
+///                       This must be sized numResults * vertexCount.
+/// \param numResults Should be the size of all three passed in arrays
+/// \param outStats If not NULL, receives the counters and timings of each
+///                 search, see DijkstraSession::solve()
+///
+void runDijkstraCompressed( cl_context context, cl_device_id deviceId, CompressedGraphData *compressedGraph,
+                            int *sourceVertices, float *outResultCosts, int numResults,
+                            DijkstraStats *outStats = NULL );
+
+///
+/// Compute all-pairs shortest paths with a blocked Floyd-Warshall over the
+/// whole distance matrix, which needs vertexCount^2 floats of device memory.
+/// The results are laid out as they are by runDijkstra().  Devices that can't
+/// hold the matrix or run 16x16 work-groups fall back to runDijkstra().
+///
+/// \param context Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernels
+/// \param graph Structure containing the vertex, edge, and weight arrays
+///              for the input graph
+/// \param sourceVertices Indices of the vertices whose rows of the distance
+///                       matrix are wanted
+/// \param outResultCosts A pre-allocated array where the results for
+///                       each source vertex will be written.
+///                       This must be sized numResults * graph->vertexCount.
+/// \param numResults Should be the size of all three passed in arrays
+///
+void runFloydWarshall( cl_context context, cl_device_id deviceId, GraphData* graph,
+                       int *sourceVertices, float *outResultCosts, int numResults );
+
+///
+/// Follow the predecessors written by DijkstraSession::solve() back from endVertex
+/// to sourceVertex to recover the shortest path between them.
+///
+/// \param predecessors The predecessors of one search, graph->vertexCount long
+/// \param vertexCount Number of vertices in the graph
+/// \param sourceVertex The vertex the search started from
+/// \param endVertex The vertex to find the path to
+/// \param outPath A pre-allocated array of vertexCount entries which receives
+///                the vertices from sourceVertex to endVertex inclusive
+/// \return The number of vertices in the path, or 0 if there is none
+///
+int extractPath( const int *predecessors, int vertexCount, int sourceVertex, int endVertex,
+                 int *outPath );
+
+///
+/// Run point-to-point Dijkstra's shortest path on the GraphData provided to this
+/// function.  This function will compute the shortest path distance from
+/// sourceVertices[n] -> endVertices[n] and store the cost in outResultCosts[n].
+/// The number of results it will compute is given by numResults.
+///
+/// This function will run the algorithm on a single device, stopping each
+/// search as soon as its end vertex is settled.
+///
+/// \param context Current context, must be created by caller
+/// \param deviceId The device ID on which to run the kernel
+/// \param graph Structure containing the vertex, edge, and weight arrays
+///              for the input graph
+/// \param sourceVertices Vertices from which to start each search
+/// \param endVertices Vertices at which to end each search
+/// \param outResultCosts A pre-allocated array of numResults costs
+/// \param numResults Should be the size of all three passed in arrays
+/// \param outPredecessors If not NULL, receives the predecessors of each search
+///                        as in DijkstraSession::solve(), for use with
+///                        extractPath().  This must be sized
+///                        numResults * graph->vertexCount.
+///
+void runDijkstraPointToPoint( cl_context context, cl_device_id deviceId, GraphData* graph,
+                              int *sourceVertices, int *endVertices, float *outResultCosts,
+                              int numResults, int *outPredecessors = NULL );
 
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
@@ -116,8 +508,8 @@ void runDijkstra( cl_context context, cl_device_id deviceId, GraphData* graph,
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available.  It will
-/// create N threads, one for each GPU, and chunk the workload up to perform
-/// (numResults / N) searches per GPU.
+/// create N threads, one for each GPU, which pull batches of searches from a
+/// shared queue until all numResults searches are done.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param graph Structure containing the vertex, edge, and weight arra
@@ -140,8 +532,8 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
 /// it will compute is given by numResults.
 ///
 /// This function will run the algorithm on as many GPUs as is available along with
-/// the CPU.  It will create N threads, one for each device, and chunk the workload up to perform
-/// (numResults / N) searches per device.
+/// the CPU.  It will create N threads, one for each device, which pull batches of
+/// searches from a shared queue until all numResults searches are done.
 ///
 /// \param gpuContext Current GPU context, must be created by caller
 /// \param cpuContext Current CPU context, must be created by caller
@@ -158,6 +550,30 @@ void runDijkstraMultiGPU( cl_context gpuContext, GraphData* graph, int *sourceVe
 void runDijkstraMultiGPUandCPU( cl_context gpuContext, cl_context cpuContext, GraphData* graph,
                                 int *sourceVertices, float *outResultCosts, int numResults );
 
+///
+/// Run Dijkstra's shortest path on the CPU split into sub-devices.  A single
+/// search does not keep many cores busy, so rather than running the searches
+/// one at a time across the whole CPU, each sub-device runs its own searches
+/// on its own copy of the graph, pulling them from a shared queue as in
+/// runDijkstraMultiGPU().  Sub-devices need OpenCL 1.2.  Without them, or if
+/// the device can not be partitioned, this runs as runDijkstra() does.
+///
+/// \param cpuContext Current CPU context, must be created by caller
+/// \param graph Structure containing the vertex, edge, and weight arrays
+///              for the input graph
+/// \param sourceVertices Indices into the vertex array from which to
+///                       start the search
+/// \param outResultCosts A pre-allocated array where the results for
+///                       each shortest path search will be written.
+///                       This must be sized numResults * graph->vertexCount.
+/// \param numResults Should be the size of all three passed in arrays
+/// \param numPartitions Number of sub-devices to split the CPU into, sharing its
+///                      compute units as evenly as they go, or 0 for one
+///                      sub-device per NUMA node
+///
+void runDijkstraSubDevices( cl_context cpuContext, GraphData* graph, int *sourceVertices,
+                            float *outResultCosts, int numResults, int numPartitions );
+
 
 ///
 /// Run Dijkstra's shortest path on the GraphData provided to this function.  This
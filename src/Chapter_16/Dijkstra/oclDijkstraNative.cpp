@@ -0,0 +1,433 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//
+//  Description:
+//      Native multi-threaded CPU implementation of Dijkstra's shortest path,
+//      for both single-source and point-to-point queries.
+//
+//
+#include <float.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "oclDijkstraNative.h"
+
+///
+//  Namespaces
+//
+using namespace std;
+
+///
+//  Types
+//
+
+// An entry in the priority queue: the tentative cost of reaching a vertex
+typedef pair<float, int> HeapEntry;
+
+// The searches shared between the native worker threads
+typedef struct
+{
+    GraphData *graph;
+    GraphData *reverseGraph;
+    int *sourceVertices;
+    int *endVertices;
+    float *outResultCosts;
+    int numResults;
+
+    // Index of the next search to run, advanced atomically by the workers
+    int nextResult;
+} NativeWork;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Private Functions
+//
+//
+
+///
+/// Compute the cost of the shortest path from sourceVertex to every vertex
+/// using a binary heap.  Rather than decreasing keys, a vertex is pushed again
+/// whenever its cost improves and stale entries are skipped when popped.
+///
+static void dijkstraNativeSearch( GraphData *graph, int sourceVertex, float *costArray,
+                                  vector<HeapEntry> &heap )
+{
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        costArray[v] = FLT_MAX;
+    }
+
+    heap.clear();
+    costArray[sourceVertex] = 0.0f;
+    heap.push_back(HeapEntry(0.0f, sourceVertex));
+
+    while (!heap.empty())
+    {
+        pop_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        HeapEntry top = heap.back();
+        heap.pop_back();
+
+        int vertex = top.second;
+        if (top.first > costArray[vertex])
+        {
+            continue;
+        }
+
+        int edgeStart = graph->vertexArray[vertex];
+        int edgeEnd = (vertex + 1 < graph->vertexCount) ? graph->vertexArray[vertex + 1] : graph->edgeCount;
+
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = graph->edgeArray[edge];
+            float cost = top.first + graph->weightArray[edge];
+            if (cost < costArray[nid])
+            {
+                costArray[nid] = cost;
+                heap.push_back(HeapEntry(cost, nid));
+                push_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+            }
+        }
+    }
+}
+
+///
+/// Thread function that runs searches until there are none left
+///
+static void *dijkstraNativeThread( void *arg )
+{
+    NativeWork *work = (NativeWork*) arg;
+    GraphData *graph = work->graph;
+    vector<HeapEntry> heap;
+
+    for (;;)
+    {
+        int result = __sync_fetch_and_add(&work->nextResult, 1);
+        if (result >= work->numResults)
+        {
+            break;
+        }
+
+        dijkstraNativeSearch(graph, work->sourceVertices[result],
+                             &work->outResultCosts[(size_t)result * graph->vertexCount], heap);
+    }
+
+    return NULL;
+}
+
+///
+/// Thread function that runs point-to-point queries until there are none left
+///
+static void *dijkstraNativePointToPointThread( void *arg )
+{
+    NativeWork *work = (NativeWork*) arg;
+    DijkstraNativeQuery query(work->graph, work->reverseGraph);
+
+    for (;;)
+    {
+        int result = __sync_fetch_and_add(&work->nextResult, 1);
+        if (result >= work->numResults)
+        {
+            break;
+        }
+
+        work->outResultCosts[result] = query.solve(work->sourceVertices[result], work->endVertices[result],
+                                                   NULL, NULL);
+    }
+
+    return NULL;
+}
+
+///
+/// Run func on one thread per CPU core, up to one per result
+///
+static void runNativeThreads( void *(*func)(void *), NativeWork *work )
+{
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = (int)min((long)work->numResults, max(numCPUs, 1L));
+
+    vector<pthread_t> threadIDs(numThreads);
+    for (int i = 0; i < numThreads; i++)
+    {
+        pthread_create(&threadIDs[i], NULL, func, (void*)work);
+    }
+
+    for (int i = 0; i < numThreads; i++)
+    {
+        pthread_join(threadIDs[i], NULL);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  DijkstraNativeQuery
+//
+//
+
+///
+/// Create the working arrays for queries against graph
+///
+DijkstraNativeQuery::DijkstraNativeQuery( GraphData *graph, GraphData *reverseGraph ) :
+    bestCost(FLT_MAX),
+    meetingVertex(-1)
+{
+    graphs[0] = graph;
+    graphs[1] = reverseGraph;
+
+    int numDirections = (reverseGraph != NULL) ? 2 : 1;
+    for (int direction = 0; direction < numDirections; direction++)
+    {
+        costs[direction].assign(graph->vertexCount, FLT_MAX);
+        parents[direction].assign(graph->vertexCount, -1);
+    }
+}
+
+///
+/// Reset the entries touched by the last query
+///
+void DijkstraNativeQuery::reset()
+{
+    for (int direction = 0; direction < 2; direction++)
+    {
+        for (size_t i = 0; i < touched[direction].size(); i++)
+        {
+            costs[direction][touched[direction][i]] = FLT_MAX;
+            parents[direction][touched[direction][i]] = -1;
+        }
+        touched[direction].clear();
+        heaps[direction].clear();
+    }
+
+    bestCost = FLT_MAX;
+    meetingVertex = -1;
+}
+
+///
+/// Lower the cost of reaching vertex in the given direction and queue it
+///
+void DijkstraNativeQuery::relax( int direction, int vertex, float cost, int parent )
+{
+    if (costs[direction][vertex] == FLT_MAX)
+    {
+        touched[direction].push_back(vertex);
+    }
+
+    costs[direction][vertex] = cost;
+    parents[direction][vertex] = parent;
+    heaps[direction].push_back(HeapEntry(cost, vertex));
+    push_heap(heaps[direction].begin(), heaps[direction].end(), greater<HeapEntry>());
+}
+
+///
+/// Search forward from sourceVertex until endVertex is settled
+///
+void DijkstraNativeQuery::search( int sourceVertex, int endVertex )
+{
+    GraphData *graph = graphs[0];
+    vector<float> &costArray = costs[0];
+    vector<HeapEntry> &heap = heaps[0];
+
+    relax(0, sourceVertex, 0.0f, -1);
+
+    while (!heap.empty())
+    {
+        pop_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        HeapEntry top = heap.back();
+        heap.pop_back();
+
+        int vertex = top.second;
+        if (top.first > costArray[vertex])
+        {
+            continue;
+        }
+
+        if (vertex == endVertex)
+        {
+            bestCost = top.first;
+            meetingVertex = endVertex;
+            return;
+        }
+
+        int edgeStart = graph->vertexArray[vertex];
+        int edgeEnd = (vertex + 1 < graph->vertexCount) ? graph->vertexArray[vertex + 1] : graph->edgeCount;
+
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = graph->edgeArray[edge];
+            float cost = top.first + graph->weightArray[edge];
+            if (cost < costArray[nid])
+            {
+                relax(0, nid, cost, vertex);
+            }
+        }
+    }
+}
+
+///
+/// Search forward from sourceVertex and backward from endVertex, always
+/// expanding the side with the cheaper next vertex.  Whenever a vertex reached
+/// by one side has already been reached by the other, the two halves form a
+/// path.  The search stops once the next vertices of both sides together cost
+/// at least as much as the best path found, as no cheaper path can remain.
+///
+void DijkstraNativeQuery::searchBidirectional( int sourceVertex, int endVertex )
+{
+    relax(0, sourceVertex, 0.0f, -1);
+    relax(1, endVertex, 0.0f, -1);
+
+    while (!heaps[0].empty() && !heaps[1].empty())
+    {
+        float forwardTop = heaps[0].front().first;
+        float backwardTop = heaps[1].front().first;
+        if (forwardTop + backwardTop >= bestCost)
+        {
+            break;
+        }
+
+        int direction = (forwardTop <= backwardTop) ? 0 : 1;
+        GraphData *graph = graphs[direction];
+        vector<HeapEntry> &heap = heaps[direction];
+        vector<float> &costArray = costs[direction];
+        vector<float> &otherCostArray = costs[1 - direction];
+
+        pop_heap(heap.begin(), heap.end(), greater<HeapEntry>());
+        HeapEntry top = heap.back();
+        heap.pop_back();
+
+        int vertex = top.second;
+        if (top.first > costArray[vertex])
+        {
+            continue;
+        }
+
+        int edgeStart = graph->vertexArray[vertex];
+        int edgeEnd = (vertex + 1 < graph->vertexCount) ? graph->vertexArray[vertex + 1] : graph->edgeCount;
+
+        for (int edge = edgeStart; edge < edgeEnd; edge++)
+        {
+            int nid = graph->edgeArray[edge];
+            float cost = top.first + graph->weightArray[edge];
+            if (cost < costArray[nid])
+            {
+                relax(direction, nid, cost, vertex);
+
+                if (otherCostArray[nid] != FLT_MAX && cost + otherCostArray[nid] < bestCost)
+                {
+                    bestCost = cost + otherCostArray[nid];
+                    meetingVertex = nid;
+                }
+            }
+        }
+    }
+}
+
+///
+/// Compute the cost of the shortest path from sourceVertex to endVertex
+///
+float DijkstraNativeQuery::solve( int sourceVertex, int endVertex, int *outPath, int *outPathLength )
+{
+    reset();
+
+    if (sourceVertex == endVertex)
+    {
+        bestCost = 0.0f;
+        meetingVertex = sourceVertex;
+    }
+    else if (graphs[1] != NULL)
+    {
+        searchBidirectional(sourceVertex, endVertex);
+    }
+    else
+    {
+        search(sourceVertex, endVertex);
+    }
+
+    if (outPath != NULL)
+    {
+        int length = 0;
+        if (meetingVertex >= 0)
+        {
+            // The forward half is followed back from the meeting vertex to the
+            // source, so it is reversed once written
+            for (int v = meetingVertex; v >= 0; v = parents[0][v])
+            {
+                outPath[length++] = v;
+            }
+            reverse(outPath, outPath + length);
+
+            // The backward search's parents lead on towards the end vertex
+            if (graphs[1] != NULL)
+            {
+                for (int v = parents[1][meetingVertex]; v >= 0; v = parents[1][v])
+                {
+                    outPath[length++] = v;
+                }
+            }
+        }
+
+        if (outPathLength != NULL)
+        {
+            *outPathLength = length;
+        }
+    }
+    else if (outPathLength != NULL)
+    {
+        *outPathLength = 0;
+    }
+
+    return bestCost;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Public Functions
+//
+//
+
+///
+/// Run Dijkstra's shortest path natively on all of the CPU cores
+///
+void runDijkstraNative( GraphData* graph, int *sourceVertices,
+                        float *outResultCosts, int numResults )
+{
+    NativeWork work;
+    work.graph = graph;
+    work.reverseGraph = NULL;
+    work.sourceVertices = sourceVertices;
+    work.endVertices = NULL;
+    work.outResultCosts = outResultCosts;
+    work.numResults = numResults;
+    work.nextResult = 0;
+
+    runNativeThreads(dijkstraNativeThread, &work);
+}
+
+///
+/// Run point-to-point Dijkstra's shortest path natively on all of the CPU cores
+///
+void runDijkstraNativePointToPoint( GraphData* graph, GraphData *reverseGraph,
+                                    int *sourceVertices, int *endVertices,
+                                    float *outResultCosts, int numResults )
+{
+    NativeWork work;
+    work.graph = graph;
+    work.reverseGraph = reverseGraph;
+    work.sourceVertices = sourceVertices;
+    work.endVertices = endVertices;
+    work.outResultCosts = outResultCosts;
+    work.numResults = numResults;
+    work.nextResult = 0;
+
+    runNativeThreads(dijkstraNativePointToPointThread, &work);
+}
@@ -0,0 +1,123 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//
+//  Description:
+//      Native multi-threaded CPU implementation of Dijkstra's shortest path,
+//      used as a baseline for the OpenCL implementations.  Unlike
+//      runDijkstraRef(), which mirrors the GPU kernels, this is the classic
+//      priority queue algorithm.
+//
+//
+#ifndef DIJKSTRA_NATIVE_H
+#define DIJKSTRA_NATIVE_H
+
+#include <vector>
+#include "oclDijkstraKernel.h"
+
+///
+/// Run Dijkstra's shortest path on the GraphData provided to this function.  This
+/// function will compute the shortest path distance from sourceVertices[n] to
+/// every vertex and store the costs in outResultCosts[n * graph->vertexCount].
+/// Vertices that cannot be reached get a cost of FLT_MAX.
+///
+/// Each search uses a binary heap, and the searches are spread over one thread
+/// per CPU core which take sources from a shared counter until all numResults
+/// are done.
+///
+/// \param graph Structure containing the vertex, edge, and weight arrays
+///              for the input graph
+/// \param sourceVertices Indices into the vertex array from which to
+///                       start the search
+/// \param outResultCosts A pre-allocated array where the results for
+///                       each shortest path search will be written.
+///                       This must be sized numResults * graph->vertexCount.
+/// \param numResults Number of searches to run
+///
+void runDijkstraNative( GraphData* graph, int *sourceVertices,
+                        float *outResultCosts, int numResults );
+
+///
+/// A DijkstraNativeQuery answers point-to-point shortest path queries on the
+/// CPU.  A search stops as soon as the end vertex is settled, and when a
+/// reverse graph is given it searches forward from the source and backward
+/// from the end vertex at the same time.  The working arrays are kept between
+/// queries and only the entries a query touched are reset, so a query costs
+/// time proportional to the part of the graph it explores.
+///
+/// A query object must only be used by one thread at a time.
+///
+class DijkstraNativeQuery
+{
+public:
+
+    ///
+    /// \param graph Structure containing the vertex, edge, and weight arrays
+    ///              for the input graph
+    /// \param reverseGraph The graph with every edge reversed, as built by
+    ///                     buildReverseGraph(), or NULL to search only forward
+    ///                     from the source.  Both graphs must stay valid for the
+    ///                     lifetime of the query object.
+    ///
+    DijkstraNativeQuery( GraphData *graph, GraphData *reverseGraph );
+
+    ///
+    /// Compute the cost of the shortest path from sourceVertex to endVertex.
+    ///
+    /// \param sourceVertex Vertex from which to start the search
+    /// \param endVertex Vertex at which to end the search
+    /// \param outPath If not NULL, receives the vertices along the path from
+    ///                sourceVertex to endVertex inclusive.  This must be sized
+    ///                graph->vertexCount.
+    /// \param outPathLength If not NULL, receives the number of vertices written
+    ///                      to outPath, or 0 if endVertex cannot be reached
+    /// \return The cost of the path, or FLT_MAX if endVertex cannot be reached
+    ///
+    float solve( int sourceVertex, int endVertex, int *outPath, int *outPathLength );
+
+private:
+
+    void reset();
+    void relax( int direction, int vertex, float cost, int parent );
+    void search( int sourceVertex, int endVertex );
+    void searchBidirectional( int sourceVertex, int endVertex );
+
+    // Index 0 of each array is the forward search and index 1 the backward search
+    GraphData *graphs[2];
+    std::vector<float> costs[2];
+    std::vector<int> parents[2];
+    std::vector<int> touched[2];
+    std::vector< std::pair<float, int> > heaps[2];
+
+    // Best path found so far and the vertex where its two halves meet
+    float bestCost;
+    int meetingVertex;
+};
+
+///
+/// Run point-to-point Dijkstra's shortest path on the GraphData provided to this
+/// function.  This function will compute the shortest path distance from
+/// sourceVertices[n] -> endVertices[n] and store the cost in outResultCosts[n].
+/// The queries are spread over one thread per CPU core.
+///
+/// \param graph Structure containing the vertex, edge, and weight arrays
+///              for the input graph
+/// \param reverseGraph The reversed graph to search from both ends, or NULL
+/// \param sourceVertices Vertices from which to start each search
+/// \param endVertices Vertices at which to end each search
+/// \param outResultCosts A pre-allocated array of numResults costs
+/// \param numResults Number of queries to run
+///
+void runDijkstraNativePointToPoint( GraphData* graph, GraphData *reverseGraph,
+                                    int *sourceVertices, int *endVertices,
+                                    float *outResultCosts, int numResults );
+
+#endif // DIJKSTRA_NATIVE_H
@@ -0,0 +1,197 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//
+//  Description:
+//      All-pairs shortest path using a blocked Floyd-Warshall on the device.
+//      When a cost is wanted from every vertex, relaxing the whole distance
+//      matrix tile by tile is far more regular work than running one
+//      Dijkstra search per source vertex.
+//
+//
+#include <float.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include "oclDijkstraKernel.h"
+
+///
+//  Macros
+//
+#define checkError(a, b) checkErrorFileLine(a, b, __FILE__ , __LINE__)
+
+///
+//  Macro Options
+//
+#define FW_BLOCK_SIZE 16    // Tile width, must match BLOCK_SIZE in floydWarshall.cl
+
+///
+//  Function prototypes
+//
+cl_program loadAndBuildProgram( cl_context gpuContext, cl_device_id deviceId, const char *fileName );
+void checkErrorFileLine(int errNum, int expected, const char* file, const int lineNumber);
+
+///
+//  Namespaces
+//
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Private Functions
+//
+//
+
+///
+/// Fill in the padded distance matrix from the graph: zero on the diagonal,
+/// the lightest edge between each pair of adjacent vertices and FLT_MAX
+/// everywhere else, including the padding
+///
+void initializeDistanceMatrix( GraphData *graph, float *distance, int matrixWidth )
+{
+    for (size_t i = 0; i < (size_t)matrixWidth * matrixWidth; i++)
+    {
+        distance[i] = FLT_MAX;
+    }
+
+    for (int v = 0; v < graph->vertexCount; v++)
+    {
+        float *row = &distance[(size_t)v * matrixWidth];
+        row[v] = 0.0f;
+
+        int edgeEnd = (v + 1 < graph->vertexCount) ? graph->vertexArray[v + 1] : graph->edgeCount;
+        for (int edge = graph->vertexArray[v]; edge < edgeEnd; edge++)
+        {
+            int nid = graph->edgeArray[edge];
+            if (graph->weightArray[edge] < row[nid])
+            {
+                row[nid] = graph->weightArray[edge];
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+//  Public Functions
+//
+//
+
+///
+/// Run the blocked Floyd-Warshall all-pairs shortest path on a single device
+///
+void runFloydWarshall( cl_context context, cl_device_id deviceId, GraphData* graph,
+                       int *sourceVertices, float *outResultCosts, int numResults )
+{
+    cl_int errNum;
+    int matrixWidth = ((graph->vertexCount + FW_BLOCK_SIZE - 1) / FW_BLOCK_SIZE) * FW_BLOCK_SIZE;
+    int blockCount = matrixWidth / FW_BLOCK_SIZE;
+    size_t matrixSize = sizeof(float) * (size_t)matrixWidth * matrixWidth;
+
+    // Each work-group holds a whole tile, and the whole matrix has to fit in a
+    // single buffer.  If the device can't manage either, run a Dijkstra search
+    // per source instead.
+    size_t maxWorkGroupSize;
+    cl_ulong maxAllocSize;
+    errNum = clGetDeviceInfo(deviceId, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    checkError(errNum, CL_SUCCESS);
+    errNum = clGetDeviceInfo(deviceId, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAllocSize, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    if (maxWorkGroupSize < FW_BLOCK_SIZE * FW_BLOCK_SIZE || matrixSize > maxAllocSize)
+    {
+        cout << "Distance matrix does not fit the device, falling back to Dijkstra." << endl;
+        runDijkstra( context, deviceId, graph, sourceVertices, outResultCosts, numResults );
+        return;
+    }
+
+    float *distance = (float*) malloc(matrixSize);
+    if (distance == NULL)
+    {
+        cerr << "Failed to allocate the " << matrixWidth << "x" << matrixWidth << " distance matrix." << endl;
+        return;
+    }
+    initializeDistanceMatrix( graph, distance, matrixWidth );
+
+    cl_command_queue commandQueue = clCreateCommandQueue( context, deviceId, 0, &errNum );
+    checkError(errNum, CL_SUCCESS);
+
+    cl_program program = loadAndBuildProgram( context, deviceId, "floydWarshall.cl" );
+    if (program == NULL)
+    {
+        clReleaseCommandQueue(commandQueue);
+        free(distance);
+        return;
+    }
+
+    cl_mem distanceDevice = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                           matrixSize, distance, &errNum);
+    checkError(errNum, CL_SUCCESS);
+
+    const char *kernelNames[3] = { "floydWarshallPhase1", "floydWarshallPhase2", "floydWarshallPhase3" };
+    cl_kernel phaseKernels[3];
+    for (int phase = 0; phase < 3; phase++)
+    {
+        phaseKernels[phase] = clCreateKernel(program, kernelNames[phase], &errNum);
+        checkError(errNum, CL_SUCCESS);
+
+        errNum |= clSetKernelArg(phaseKernels[phase], 0, sizeof(cl_mem), &distanceDevice);
+        errNum |= clSetKernelArg(phaseKernels[phase], 1, sizeof(int), &matrixWidth);
+        checkError(errNum, CL_SUCCESS);
+    }
+
+    // Phase 1 solves one tile, phase 2 the row and the column of tiles through
+    // it and phase 3 the rest of the matrix
+    size_t localWorkSize[2] = { FW_BLOCK_SIZE, FW_BLOCK_SIZE };
+    size_t globalWorkSize[3][2] =
+    {
+        { FW_BLOCK_SIZE, FW_BLOCK_SIZE },
+        { (size_t)matrixWidth, 2 * FW_BLOCK_SIZE },
+        { (size_t)matrixWidth, (size_t)matrixWidth }
+    };
+
+    cout << "Computing all pairs over a " << matrixWidth << "x" << matrixWidth << " distance matrix." << endl;
+    for (int k = 0; k < blockCount; k++)
+    {
+        for (int phase = 0; phase < 3; phase++)
+        {
+            errNum = clSetKernelArg(phaseKernels[phase], 2, sizeof(int), &k);
+            checkError(errNum, CL_SUCCESS);
+
+            // The queue is in order, so each phase sees the results of the last
+            errNum = clEnqueueNDRangeKernel(commandQueue, phaseKernels[phase], 2, 0, globalWorkSize[phase],
+                                            localWorkSize, 0, NULL, NULL);
+            checkError(errNum, CL_SUCCESS);
+        }
+    }
+
+    errNum = clEnqueueReadBuffer(commandQueue, distanceDevice, CL_TRUE, 0, matrixSize,
+                                 distance, 0, NULL, NULL);
+    checkError(errNum, CL_SUCCESS);
+
+    // Copy out the rows asked for, leaving the padding behind
+    for (int i = 0; i < numResults; i++)
+    {
+        memcpy(&outResultCosts[(size_t)i * graph->vertexCount],
+               &distance[(size_t)sourceVertices[i] * matrixWidth],
+               sizeof(float) * graph->vertexCount);
+    }
+    cout << "Computed '" << numResults << "' results" << endl;
+
+    for (int phase = 0; phase < 3; phase++)
+    {
+        clReleaseKernel(phaseKernels[phase]);
+    }
+    clReleaseMemObject(distanceDevice);
+    clReleaseProgram(program);
+    clReleaseCommandQueue(commandQueue);
+    free(distance);
+}
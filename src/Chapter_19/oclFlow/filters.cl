@@ -24,6 +24,55 @@
 // with configurable weights usable as 2 passes for a 
 // separable 3x3 filter.  
 // The filter_G function generates the "G" matrix used in optical flow. 
+// Each filter comes in two versions: the _g kernels write a global buffer
+// which the host then copies into the image, the _img kernels write the 
+// image directly on devices that support image writes.
+
+__constant sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
+    CLK_ADDRESS_CLAMP_TO_EDGE |
+    CLK_FILTER_NEAREST ;
+
+uint downfilter_x( __read_only image2d_t src, int ix, int iy )
+{
+    float x0 = read_imageui( src, srcSampler, (int2)(ix-2, iy ) ).x/16.0f;
+    float x1 = read_imageui( src, srcSampler, (int2)(ix-1, iy ) ).x/4.0f;
+    float x2 = (3*read_imageui( src, srcSampler, (int2)(ix, iy )).x)/8.0f;
+    float x3 = read_imageui( src, srcSampler, (int2)(ix+1, iy ) ).x/4.0f;
+    float x4 = read_imageui( src, srcSampler, (int2)(ix+2, iy ) ).x/16.0f;
+
+    return (uint)round( x0 + x1 + x2 + x3 + x4 );
+}
+
+// src is the level 0 sized scratch image holding the x pass of a level src_h
+// rows high, so the rows below it are clamped here rather than by the sampler
+uint downfilter_y( __read_only image2d_t src, int ix, int iy, int src_h )
+{
+    float x0 = read_imageui( src, srcSampler, (int2)(2*ix, 2*iy -2 ) ).x/16.0f;
+    float x1 = read_imageui( src, srcSampler, (int2)(2*ix, 2*iy -1 ) ).x/4.0f;
+    float x2 = (3*read_imageui( src, srcSampler, (int2)(2*ix, min(2*iy, src_h-1) ) ).x)/8.0f;
+    float x3 = read_imageui( src, srcSampler, (int2)(2*ix, min(2*iy +1, src_h-1) ) ).x/4.0f;
+    float x4 = read_imageui( src, srcSampler, (int2)(2*ix, min(2*iy +2, src_h-1) ) ).x/16.0f;
+
+    return (uint)round(x0 + x1 + x2 + x3 + x4);
+}
+
+int filter_3x1( __read_only image2d_t src, int ix, int iy, int W0, int W1, int W2 )
+{
+    float x0 = read_imagei( src, srcSampler, (int2)(ix-1, iy)).x * W0;
+    float x1 = read_imagei( src, srcSampler, (int2)(ix, iy  )).x * W1;
+    float x2 = read_imagei( src, srcSampler, (int2)(ix+1, iy)).x * W2;
+
+    return (int)round( x0 + x1 + x2 ); 
+}
+
+int filter_1x3( __read_only image2d_t src, int ix, int iy, int W0, int W1, int W2 )
+{
+    float x0 = read_imagei( src, srcSampler, (int2)(ix, iy-1)).x * W0;
+    float x1 = read_imagei( src, srcSampler, (int2)(ix, iy  )).x * W1;
+    float x2 = read_imagei( src, srcSampler, (int2)(ix, iy+1)).x * W2;
+
+    return (int)round( x0 + x1 + x2 );
+}
 
 // launched over downsampled area
 // first pass sampling from larger level, so x2 the coordinates
@@ -31,53 +80,133 @@ __kernel void downfilter_x_g(
     __read_only image2d_t src,
     __global uchar *dst, int dst_w, int dst_h )
 {
-
-    sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
-        CLK_ADDRESS_CLAMP_TO_EDGE |
-        CLK_FILTER_NEAREST ;
-
     const int ix = get_global_id(0);
     const int iy = get_global_id(1);
 
-    float x0 = read_imageui( src, srcSampler, (int2)(ix-2, iy ) ).x/16.0f;
-    float x1 = read_imageui( src, srcSampler, (int2)(ix-1, iy ) ).x/4.0f;
-    float x2 = (3*read_imageui( src, srcSampler, (int2)(ix, iy )).x)/8.0f;
-    float x3 = read_imageui( src, srcSampler, (int2)(ix+1, iy ) ).x/4.0f;
-    float x4 = read_imageui( src, srcSampler, (int2)(ix+2, iy ) ).x/16.0f;
-
-    int output = round( x0 + x1 + x2 + x3 + x4 );
+    int output = downfilter_x( src, ix, iy );
 
     if( ix < dst_w && iy < dst_h ) {
         dst[iy*dst_w + ix ] = (uchar)output;  // uncoalesced when writing to memory object
     }
 }
 
+__kernel void downfilter_x_img( 
+    __read_only image2d_t src,
+    __write_only image2d_t dst, int dst_w, int dst_h )
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if( ix < dst_w && iy < dst_h ) {
+        write_imageui( dst, (int2)(ix, iy), (uint4)(downfilter_x( src, ix, iy )) );
+    }
+}
+
 // Simultaneously does a Y smoothing filter and downsampling (i.e. only does filter at 
 // downsampled points.  Writes to the next smaller pyramid level whose max dimensions are
 // given by dst_w/dst_h
+// the whole level is written, as by downfilter_y_img
 __kernel void downfilter_y_g(
     __read_only image2d_t src,
-    __global uchar *dst, int dst_w, int dst_h )
+    __global uchar *dst, int dst_w, int dst_h, int src_h )
 {
-    sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
-        CLK_ADDRESS_CLAMP_TO_EDGE |
-        CLK_FILTER_NEAREST ;
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if( ix < dst_w && iy < dst_h ) {
+        dst[iy*dst_w + ix ] = (uchar)downfilter_y( src, ix, iy, src_h );
+    }
+}
 
+// the image is written in full, downfilter_y clamps the rows past src_h
+__kernel void downfilter_y_img(
+    __read_only image2d_t src,
+    __write_only image2d_t dst, int dst_w, int dst_h, int src_h )
+{
     const int ix = get_global_id(0);
     const int iy = get_global_id(1);
 
-    float x0 = read_imageui( src, srcSampler, (int2)(2*ix, 2*iy -2 ) ).x/16.0f;
-    float x1 = read_imageui( src, srcSampler, (int2)(2*ix, 2*iy -1 ) ).x/4.0f;
-    float x2 = (3*read_imageui( src, srcSampler, (int2)(2*ix, 2*iy ) ).x)/8.0f;
-    float x3 = read_imageui( src, srcSampler, (int2)(2*ix, 2*iy +1) ).x/4.0f;
-    float x4 = read_imageui( src, srcSampler, (int2)(2*ix, 2*iy +2) ).x/16.0f;
+    if( ix < dst_w && iy < dst_h ) {
+        write_imageui( dst, (int2)(ix, iy), (uint4)(downfilter_y( src, ix, iy, src_h )) );
+    }
+}
 
-    int output = round(x0 + x1 + x2 + x3 + x4);
+// Fused 5x5 Gaussian downsample, replacing a downfilter_x/downfilter_y pair.
+// Each work-group produces a DS_LOCAL_X x DS_LOCAL_Y block of the half size
+// output.  The source block under it plus a 2 pixel apron is read into local
+// memory once, the horizontal pass is done there at the kept columns only, and
+// the vertical pass gives the output.  The weights are (1,4,6,4,1) in each
+// direction, summed as integers and divided by 256 with a single rounding shift.
+#define DS_LOCAL_X 16
+#define DS_LOCAL_Y 8
+#define DS_TILE_W (2*DS_LOCAL_X + 3)
+#define DS_TILE_H (2*DS_LOCAL_Y + 3)
 
-    if( ix < dst_w-2 && iy < dst_h-2 ) {
+uint downfilter_5x5( __read_only image2d_t src, __local uint *tile, __local uint *hpass )
+{
+    const int lx = get_local_id(0);
+    const int ly = get_local_id(1);
+    const int lid = ly*DS_LOCAL_X + lx;
+    // source position of the top left of the tile
+    const int sx = 2*(int)get_group_id(0)*DS_LOCAL_X - 2;
+    const int sy = 2*(int)get_group_id(1)*DS_LOCAL_Y - 2;
+
+    for( int t=lid ; t < DS_TILE_W*DS_TILE_H ; t += DS_LOCAL_X*DS_LOCAL_Y ) {
+        int tx = t % DS_TILE_W;
+        int ty = t / DS_TILE_W;
+        tile[t] = read_imageui( src, srcSampler, (int2)(sx + tx, sy + ty) ).x;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // horizontal pass for every tile row, at the even source columns
+    for( int t=lid ; t < DS_LOCAL_X*DS_TILE_H ; t += DS_LOCAL_X*DS_LOCAL_Y ) {
+        int hx = t % DS_LOCAL_X;
+        int ty = t / DS_LOCAL_X;
+        __local uint *row = tile + ty*DS_TILE_W + 2*hx;
+        hpass[t] = row[0] + 4*row[1] + 6*row[2] + 4*row[3] + row[4];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // vertical pass at the even source rows
+    __local uint *col = hpass + 2*ly*DS_LOCAL_X + lx;
+    uint sum = col[0] + 4*col[DS_LOCAL_X] + 6*col[2*DS_LOCAL_X] + 4*col[3*DS_LOCAL_X] + col[4*DS_LOCAL_X];
+    return (sum + 128) >> 8;
+}
+
+// launched over the downsampled area with DS_LOCAL_X x DS_LOCAL_Y work-groups
+__kernel __attribute__((reqd_work_group_size(DS_LOCAL_X, DS_LOCAL_Y, 1)))
+void downfilter_5x5_g( 
+    __read_only image2d_t src,
+    __global uchar *dst, int dst_w, int dst_h )
+{
+    __local uint tile[DS_TILE_W*DS_TILE_H];
+    __local uint hpass[DS_LOCAL_X*DS_TILE_H];
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    // every work-item takes part in the tile loads, even outside the image
+    uint output = downfilter_5x5( src, tile, hpass );
+
+    if( ix < dst_w && iy < dst_h ) {
         dst[iy*dst_w + ix ] = (uchar)output;
     }
- 
+}
+
+__kernel __attribute__((reqd_work_group_size(DS_LOCAL_X, DS_LOCAL_Y, 1)))
+void downfilter_5x5_img( 
+    __read_only image2d_t src,
+    __write_only image2d_t dst, int dst_w, int dst_h )
+{
+    __local uint tile[DS_TILE_W*DS_TILE_H];
+    __local uint hpass[DS_LOCAL_X*DS_TILE_H];
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    uint output = downfilter_5x5( src, tile, hpass );
+
+    if( ix < dst_w && iy < dst_h ) {
+        write_imageui( dst, (int2)(ix, iy), (uint4)(output) );
+    }
 }
 
 // signed int16 output
@@ -87,17 +216,10 @@ __kernel void filter_3x1_g(
     __global short *dst,int dst_w, int dst_h, int W0, int W1, int W2
 )
 {
-    sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
-                            CLK_ADDRESS_CLAMP_TO_EDGE | 
-                            CLK_FILTER_NEAREST ;
     const int ix = get_global_id(0);
     const int iy = get_global_id(1);
 
-    float x0 = read_imagei( src, srcSampler, (int2)(ix-1, iy)).x * W0;
-    float x1 = read_imagei( src, srcSampler, (int2)(ix, iy  )).x * W1;
-    float x2 = read_imagei( src, srcSampler, (int2)(ix+1, iy)).x * W2;
-
-    int output = round( x0 + x1 + x2 ); 
+    int output = filter_3x1( src, ix, iy, W0, W1, W2 );
 
     if( ix < dst_w && iy < dst_h ) {
         dst[iy*dst_w + ix ] = (short)output;
@@ -105,43 +227,63 @@ __kernel void filter_3x1_g(
 
 }
 
+__kernel void filter_3x1_img( 
+    __read_only image2d_t src, 
+    __write_only image2d_t dst,int dst_w, int dst_h, int W0, int W1, int W2
+)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if( ix < dst_w && iy < dst_h ) {
+        write_imagei( dst, (int2)(ix, iy), (int4)(filter_3x1( src, ix, iy, W0, W1, W2 )) );
+    }
+}
+
 
 // signed int16 output
 __kernel void filter_1x3_g( __read_only image2d_t src, __global short *dst, int dst_w, int dst_h, int W0, int W1, int W2 )
 {
-    sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
-                            CLK_ADDRESS_CLAMP_TO_EDGE | 
-                            CLK_FILTER_NEAREST ;
     const int ix = get_global_id(0);
     const int iy = get_global_id(1);
 
-	if( ix > 0 && iy > 0 && ix < dst_w-1 && iy < dst_h-1 ) {
-		float x0 = read_imagei( src, srcSampler, (float2)(ix, iy-1)).x * W0;
-		float x1 = read_imagei( src, srcSampler, (float2)(ix, iy  )).x * W1;
-		float x2 = read_imagei( src, srcSampler, (float2)(ix, iy+1)).x * W2;
+    // the border is zeroed as by filter_1x3_img
+    if( ix < dst_w && iy < dst_h ) {
+        int output = 0;
+        if( ix > 0 && iy > 0 && ix < dst_w-1 && iy < dst_h-1 ) {
+            output = filter_1x3( src, ix, iy, W0, W1, W2 );
+        }
+        dst[iy*dst_w + ix ] = (short)output;
+    }
+}
+
+// the one pixel border has no derivative and is set to 0
+__kernel void filter_1x3_img( __read_only image2d_t src, __write_only image2d_t dst, int dst_w, int dst_h, int W0, int W1, int W2 )
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
 
-		int output = round( x0 + x1 + x2 );
-		dst[iy*dst_w + ix ] = (short)output;
-	}
+    if( ix < dst_w && iy < dst_h ) {
+        int output = 0;
+        if( ix > 0 && iy > 0 && ix < dst_w-1 && iy < dst_h-1 ) {
+            output = filter_1x3( src, ix, iy, W0, W1, W2 );
+        }
+        write_imagei( dst, (int2)(ix, iy), (int4)(output) );
+    }
 }
 
 
 
+// window radius, set with -D FRAD=n to match lkflow.cl
+#ifndef FRAD
 #define FRAD 4
+#endif
 // G is int4 output
 // This kernel generates the "G" matrix (2x2 covariance matrix on the derivatives)
 // Each thread does one pixel, sampling its neighbourhood of +/- FRAD radius 
 // and generates the G matrix entries.
-__kernel void filter_G( __read_only image2d_t Ix, 
-                        __read_only image2d_t Iy,
-                        __global int4 *G, int dst_w, int dst_h )
+int4 structure_tensor( __read_only image2d_t Ix, __read_only image2d_t Iy, int idx, int idy )
 {
-   sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
-                           CLK_ADDRESS_CLAMP_TO_EDGE | 
-                           CLK_FILTER_NEAREST ;
-   const int idx = get_global_id(0);
-   const int idy = get_global_id(1); 
-
    int Ix2 = 0;
    int IxIy = 0;
    int Iy2 = 0;
@@ -156,18 +298,79 @@ __kernel void filter_G( __read_only image2d_t Ix,
         
     }
    }
-   int4 G2x2 = (int4)( Ix2, IxIy, IxIy, Iy2 );
+   return (int4)( Ix2, IxIy, IxIy, Iy2 );
+}
+
+__kernel void filter_G( __read_only image2d_t Ix, 
+                        __read_only image2d_t Iy,
+                        __global int4 *G, int dst_w, int dst_h )
+{
+   const int idx = get_global_id(0);
+   const int idy = get_global_id(1); 
+
+   int4 G2x2 = structure_tensor( Ix, Iy, idx, idy );
    if( idx < dst_w && idy < dst_h ) {
         G[ idy * dst_w + idx ] = G2x2;
    }
    
 }
 
+__kernel void filter_G_img( __read_only image2d_t Ix, 
+                            __read_only image2d_t Iy,
+                            __write_only image2d_t G, int dst_w, int dst_h )
+{
+   const int idx = get_global_id(0);
+   const int idy = get_global_id(1); 
+
+   if( idx < dst_w && idy < dst_h ) {
+        write_imagei( G, (int2)(idx, idy), structure_tensor( Ix, Iy, idx, idy ) );
+   }
+}
+
+// Shi-Tomasi corner response: the smaller eigenvalue of G.  G is symmetric,
+// so its eigenvalues are (a+d)/2 +/- sqrt(((a-d)/2)^2 + b^2).
+__kernel void min_eigen( __read_only image2d_t G, __global float *eig, int w, int h )
+{
+   const int idx = get_global_id(0);
+   const int idy = get_global_id(1); 
+
+   if( idx < w && idy < h ) {
+        int4 Gmat = read_imagei( G, srcSampler, (int2)(idx, idy) );
+        float a = (float)Gmat.s0;
+        float b = (float)Gmat.s1;
+        float d = (float)Gmat.s3;
+        float half_diff = (a - d)*0.5f;
+        eig[ idy * w + idx ] = (a + d)*0.5f - sqrt( half_diff*half_diff + b*b );
+   }
+}
+
+// Append the 3x3 local maxima of eig that are at least min_eig to corners as
+// (x, y, eig, 0).  On a plateau only the first pixel (in scan order) is kept.
+// Pixels closer than border to the edge are skipped, their window is clamped.
+// count must be zeroed before the launch and may end up above max_corners.
+__kernel void select_features( __global const float *eig, int w, int h, int border, float min_eig,
+                               __global float4 *corners, __global int *count, int max_corners )
+{
+   const int idx = get_global_id(0);
+   const int idy = get_global_id(1); 
+
+   if( idx < border || idy < border || idx >= w - border || idy >= h - border ) return;
+
+   float e = eig[ idy * w + idx ];
+   if( e < min_eig ) return;
+   for( int j=-1 ; j<=1 ; j++ ) {
+    for( int i=-1 ; i<=1 ; i++ ) {
+      float n = eig[ (idy + j) * w + idx + i ];
+      // equal neighbours earlier in scan order win
+      if( n > e || (n == e && (j < 0 || (j == 0 && i < 0))) ) return;
+    }
+   }
+   int slot = atomic_inc( count );
+   if( slot < max_corners ) corners[ slot ] = (float4)( idx, idy, e, 0.0f );
+}
+
 __kernel void convertToRGBAFloat( __read_only image2d_t src, __global float4 *dst, int w, int h)
 {
-    sampler_t srcSampler = CLK_NORMALIZED_COORDS_FALSE | 
-                            CLK_ADDRESS_CLAMP_TO_EDGE | 
-                            CLK_FILTER_NEAREST ;
     const int ix = get_global_id(0);
     const int iy = get_global_id(1);
 
@@ -180,4 +383,15 @@ __kernel void convertToRGBAFloat( __read_only image2d_t src, __global float4 *ds
         fpix.w = pix.w;
         dst[iy*w + ix ] = fpix;
     }
+}
+
+__kernel void convertToRGBAFloat_img( __read_only image2d_t src, __write_only image2d_t dst, int w, int h)
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+
+    if( ix < w && iy < h ) {
+        uint4 pix = read_imageui( src, srcSampler, (int2)(ix, iy));
+        write_imagef( dst, (int2)(ix, iy), convert_float4(pix) );
+    }
 }
@@ -0,0 +1,551 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//  Description:
+//      Headless driver for the LK optical flow sample.  Frames are read from a
+//      PGM sequence or from a Y4M/raw YUV video file and the flow between each
+//      pair of consecutive frames is computed without any GL context and can
+//      be written out as Middlebury .flo files.  With --features the dense
+//      flow is replaced by tracking a set of corners through the sequence,
+//      and with --pipeline the upload, flow and read back of consecutive
+//      frames overlap.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <oclUtils.h>
+#include <shrUtils.h>
+#include "oclFlow.h"
+#include "flowProfiler.h"
+
+///
+//  Where the frames come from
+//
+enum FrameSourceType
+{
+    SOURCE_PGM,
+    SOURCE_Y4M,
+    SOURCE_YUV
+};
+
+struct FrameSource
+{
+    FrameSourceType type;
+    unsigned int w;
+    unsigned int h;
+
+    // PGM sequences are either a printf style pattern such as frame%02d.pgm,
+    // numbered from first, or a list of file names
+    const char *pattern;
+    const char **files;
+    int numFiles;
+    int first;
+    int next;
+
+    // Y4M and raw YUV files only use the Y plane, the chroma is skipped
+    FILE *fd;
+    long chromaSize;
+};
+
+static bool endsWith( const char *str, const char *suffix )
+{
+    size_t len = strlen(str);
+    size_t suffixLen = strlen(suffix);
+    return len >= suffixLen && strcmp(str + len - suffixLen, suffix) == 0;
+}
+
+///
+//  Read the next frame of a PGM sequence into grey
+//
+static bool readPGMFrame( FrameSource *src, unsigned char *grey )
+{
+    char fname[1024];
+    if( src->pattern != NULL ) {
+        sprintf(fname, src->pattern, src->first + src->next);
+    } else {
+        if( src->next >= src->numFiles ) return false;
+        strcpy(fname, src->files[src->next]);
+    }
+
+    unsigned char *image_ub = NULL;
+    unsigned int w, h;
+    if( !shrLoadPGMub( fname, &image_ub, &w, &h ) ) return false;
+    if( src->w == 0 ) {
+        src->w = w;
+        src->h = h;
+    }
+    if( w != src->w || h != src->h ) {
+        fprintf(stderr, "%s is %d x %d, expected %d x %d\n", fname, w, h, src->w, src->h);
+        free(image_ub);
+        return false;
+    }
+    if( grey != NULL ) memcpy(grey, image_ub, w*h);
+    free(image_ub);
+    src->next++;
+    return true;
+}
+
+///
+//  Read the next frame of a Y4M or raw YUV file into grey
+//
+static bool readVideoFrame( FrameSource *src, unsigned char *grey )
+{
+    if( src->type == SOURCE_Y4M ) {
+        // every frame starts with a FRAME line, possibly with parameters
+        char line[256];
+        if( fgets(line, sizeof(line), src->fd) == NULL || strncmp(line, "FRAME", 5) != 0 )
+            return false;
+    }
+
+    if( fread(grey, 1, src->w*src->h, src->fd) != src->w*src->h ) return false;
+    fseek(src->fd, src->chromaSize, SEEK_CUR);
+    src->next++;
+    return true;
+}
+
+static bool readFrame( FrameSource *src, unsigned char *grey )
+{
+    if( src->type == SOURCE_PGM ) return readPGMFrame( src, grey );
+    return readVideoFrame( src, grey );
+}
+
+///
+//  Open a Y4M file and parse its stream header, e.g.
+//  "YUV4MPEG2 W640 H480 F30:1 Ip A1:1 C420jpeg"
+//
+static bool openY4M( FrameSource *src, const char *fname )
+{
+    src->fd = fopen(fname, "rb");
+    if( src->fd == NULL ) {
+        fprintf(stderr, "Could not open %s\n", fname);
+        return false;
+    }
+
+    char header[1024];
+    if( fgets(header, sizeof(header), src->fd) == NULL || strncmp(header, "YUV4MPEG2", 9) != 0 ) {
+        fprintf(stderr, "%s is not a Y4M file\n", fname);
+        return false;
+    }
+
+    // 4:2:0 is the default when the header has no C tag
+    char colorspace[64] = "420";
+    for( char *tok = strtok(header + 9, " \n"); tok != NULL; tok = strtok(NULL, " \n") ) {
+        if( tok[0] == 'W' ) src->w = atoi(tok + 1);
+        else if( tok[0] == 'H' ) src->h = atoi(tok + 1);
+        else if( tok[0] == 'C' ) {
+            strncpy(colorspace, tok + 1, sizeof(colorspace) - 1);
+            colorspace[sizeof(colorspace) - 1] = '\0';
+        }
+    }
+
+    long cw = (src->w + 1) / 2;
+    long ch = (src->h + 1) / 2;
+    if( strstr(colorspace, "p1") != NULL ) {
+        // 10, 12 and 16 bit samples
+        fprintf(stderr, "%s: only 8 bit Y4M files are supported (C%s)\n", fname, colorspace);
+        return false;
+    } else if( strncmp(colorspace, "420", 3) == 0 ) {
+        src->chromaSize = 2 * cw * ch;
+    } else if( strncmp(colorspace, "422", 3) == 0 ) {
+        src->chromaSize = 2 * cw * src->h;
+    } else if( strcmp(colorspace, "444") == 0 ) {
+        src->chromaSize = 2 * (long)src->w * src->h;
+    } else if( strcmp(colorspace, "mono") == 0 ) {
+        src->chromaSize = 0;
+    } else {
+        fprintf(stderr, "%s: unsupported Y4M colorspace C%s\n", fname, colorspace);
+        return false;
+    }
+
+    src->type = SOURCE_Y4M;
+    return src->w > 0 && src->h > 0;
+}
+
+///
+//  Open a raw planar 4:2:0 (I420) file of w x h frames
+//
+static bool openYUV( FrameSource *src, const char *fname, unsigned int w, unsigned int h )
+{
+    src->fd = fopen(fname, "rb");
+    if( src->fd == NULL ) {
+        fprintf(stderr, "Could not open %s\n", fname);
+        return false;
+    }
+    src->type = SOURCE_YUV;
+    src->w = w;
+    src->h = h;
+    src->chromaSize = 2 * (long)((w + 1) / 2) * ((h + 1) / 2);
+    return true;
+}
+
+///
+//  Open a PGM sequence, the size is taken from its first frame
+//
+static bool openPGM( FrameSource *src, const char **files, int numFiles )
+{
+    src->type = SOURCE_PGM;
+    if( numFiles == 1 && strchr(files[0], '%') != NULL ) {
+        src->pattern = files[0];
+    } else {
+        src->files = files;
+        src->numFiles = numFiles;
+    }
+
+    // load the first frame just to find the size
+    if( !readPGMFrame( src, NULL ) ) return false;
+    src->next = 0;
+    return true;
+}
+
+///
+//  Write a flow field in the Middlebury .flo format: the tag 202021.25
+//  ("PIEH"), the width and height as 32 bit ints and then the u,v pairs
+//  row by row
+//
+static bool writeFlo( const char *fname, const cl_float2 *flow, int w, int h )
+{
+    FILE *fd = fopen(fname, "wb");
+    if( fd == NULL ) {
+        fprintf(stderr, "Could not write %s\n", fname);
+        return false;
+    }
+    float tag = 202021.25f;
+    fwrite(&tag, sizeof(float), 1, fd);
+    fwrite(&w, sizeof(int), 1, fd);
+    fwrite(&h, sizeof(int), 1, fd);
+    fwrite(flow, sizeof(cl_float2), w*h, fd);
+    fclose(fd);
+    return true;
+}
+
+///
+//  Write the tracked points of one frame pair as text, one point per line:
+//  x y new_x new_y status error
+//
+static bool writePoints( const char *fname, const cl_float2 *points, const cl_float2 *nextPoints,
+                         const cl_uchar *status, const cl_float *error, int count )
+{
+    FILE *fd = fopen(fname, "w");
+    if( fd == NULL ) {
+        fprintf(stderr, "Could not write %s\n", fname);
+        return false;
+    }
+    for( int i = 0; i < count; i++ ) {
+        fprintf(fd, "%.3f %.3f %.3f %.3f %d %.3f\n", points[i].s[0], points[i].s[1],
+            nextPoints[i].s[0], nextPoints[i].s[1], status[i], status[i] ? error[i] : 0.0f);
+    }
+    fclose(fd);
+    return true;
+}
+
+///
+//  Write an 8 bit image as a binary PGM
+//
+static bool writePGM( const char *fname, const unsigned char *data, int w, int h )
+{
+    FILE *fd = fopen(fname, "wb");
+    if( fd == NULL ) {
+        fprintf(stderr, "Could not write %s\n", fname);
+        return false;
+    }
+    fprintf(fd, "P5\n%d %d\n255\n", w, h);
+    fwrite(data, 1, w*h, fd);
+    fclose(fd);
+    return true;
+}
+
+static void printUsage()
+{
+    printf("Usage: flowBatch [--device=n] [--out=dir] [--frames=n] [--start=n] [--size=WxH] [--levels=n] [--maxmotion=px] [--features=n] [--mindist=px] [--fbcheck[=px]] [--pipeline] [--profile[=json]] [--copies] [--separable] input...\n");
+    printf("  input       a .y4m file, a raw I420 .yuv file (needs --size), a printf\n");
+    printf("              style PGM pattern such as frame%%02d.pgm or a list of PGM files\n");
+    printf("  --device    OpenCL device to use (default 0)\n");
+    printf("  --out       directory to write flowNNNNN.flo (or pointsNNNNN.txt with\n");
+    printf("              --features) files to (default none)\n");
+    printf("  --frames    maximum number of flow fields to compute (default all)\n");
+    printf("  --start     first frame number of a PGM pattern (default 0)\n");
+    printf("  --levels    number of pyramid levels (default from --maxmotion)\n");
+    printf("  --maxmotion largest motion to track in pixels, picks the number of levels\n");
+    printf("              (default 28)\n");
+    printf("  --features  track up to n corners instead of computing dense flow.  The\n");
+    printf("              corners are detected again when fewer than half are left\n");
+    printf("  --mindist   smallest distance between detected corners (default 10)\n");
+    printf("  --fbcheck   also compute the backward flow and mark the vectors whose\n");
+    printf("              forward-backward error is above px (default 1) as\n");
+    printf("              inconsistent.  --out writes the mask as maskNNNNN.pgm\n");
+    printf("  --pipeline  overlap the upload of the next frame, the flow of the current\n");
+    printf("              one and the read back of the previous one (dense flow only)\n");
+    printf("  --profile   time every command enqueued and print the min, mean and\n");
+    printf("              95th percentile of each stage at the end, as a table or JSON\n");
+    printf("  --copies    filters write a scratch buffer which is copied to the pyramid\n");
+    printf("              images, instead of writing the images directly\n");
+    printf("  --separable build the image pyramids with separate x and y downsample\n");
+    printf("              passes instead of the fused 5x5 kernel\n");
+}
+
+///
+//  Run the dense flow through the pipelined engine.  Each frame is read from
+//  the source straight into pinned memory and uploads while the flow of the
+//  frame before computes and the flow before that is read back, so the time
+//  per frame is the interval between flows coming out of the pipeline.
+//
+static void runPipelined( FrameSource *src, const unsigned char *firstFrame, unsigned int devN,
+                          unsigned int maxFlows, const char *outDir )
+{
+    initOCLFlowPipeline(devN, src->w, src->h);
+    printf("Running on %s, pipelined\n", device_string);
+
+    memcpy( nextOCLFlowFrame(), firstFrame, src->w * src->h );
+    submitOCLFlowFrame( NULL );
+    unsigned int numFrames = 1;
+
+    unsigned int numFlows = 0;
+    double kernelTime = 0.0;
+    shrDeltaT(0);
+    shrDeltaT(1);
+    for( ;; ) {
+        const cl_float2 *flow;
+        float t_flow = 0.0f;
+        if( (maxFlows == 0 || numFrames <= maxFlows) && readFrame( src, nextOCLFlowFrame() ) ) {
+            flow = submitOCLFlowFrame( &t_flow );
+            numFrames++;
+            if( flow == NULL ) continue;
+        } else {
+            flow = drainOCLFlowPipeline( &t_flow );
+            if( flow == NULL ) break;
+        }
+        double t_frame = shrDeltaT(1) * 1000.0;
+
+        if( outDir != NULL ) {
+            char fname[1024];
+            sprintf(fname, "%s/flow%05d.flo", outDir, numFlows);
+            writeFlo( fname, flow, src->w, src->h );
+        }
+        printf("frame %5d: lkflow %8.3f ms, interval %8.3f ms, %7.1f fps\n",
+            numFlows, t_flow, t_frame, 1000.0 / t_frame);
+        kernelTime += t_flow;
+        numFlows++;
+    }
+    double elapsed = shrDeltaT(0);
+
+    if( numFlows > 0 ) {
+        printf("\n%d flow fields in %.3f s\n", numFlows, elapsed);
+        printf("  average lkflow time: %.3f ms\n", kernelTime / numFlows);
+        printf("  sustained:           %.1f fps\n", numFlows / elapsed);
+    } else {
+        fprintf(stderr, "Need at least two frames to compute flow\n");
+    }
+}
+
+int main( int argc, char** argv )
+{
+    unsigned int devN = 0;
+    unsigned int maxFlows = 0;
+    int start = 0;
+    char *outDir = NULL;
+    char *size = NULL;
+    int maxFeatures = 0;
+    float minDistance = 10.0f;
+    bool pipelined = false;
+
+    shrGetCmdLineArgumentu(argc, (const char **)argv, "device", &devN);
+    shrGetCmdLineArgumentu(argc, (const char **)argv, "frames", &maxFlows);
+    shrGetCmdLineArgumenti(argc, (const char **)argv, "start", &start);
+    shrGetCmdLineArgumentstr(argc, (const char **)argv, "out", &outDir);
+    shrGetCmdLineArgumentstr(argc, (const char **)argv, "size", &size);
+    shrGetCmdLineArgumenti(argc, (const char **)argv, "levels", &numLevels);
+    shrGetCmdLineArgumentf(argc, (const char **)argv, "maxmotion", &maxMotion);
+    shrGetCmdLineArgumenti(argc, (const char **)argv, "features", &maxFeatures);
+    shrGetCmdLineArgumentf(argc, (const char **)argv, "mindist", &minDistance);
+    if( shrCheckCmdLineFlag(argc, (const char **)argv, "fbcheck") ) {
+        useConsistencyCheck = true;
+        shrGetCmdLineArgumentf(argc, (const char **)argv, "fbcheck", &fbMaxError);
+    }
+    if( shrCheckCmdLineFlag(argc, (const char **)argv, "pipeline") ) pipelined = true;
+    bool profileJSON = false;
+    if( shrCheckCmdLineFlag(argc, (const char **)argv, "profile") ) {
+        char *format = NULL;
+        flowProfiler.enabled = true;
+        if( shrGetCmdLineArgumentstr(argc, (const char **)argv, "profile", &format) ) {
+            profileJSON = strcmp(format, "json") == 0;
+        }
+    }
+    if( shrCheckCmdLineFlag(argc, (const char **)argv, "copies") ) useImageWrites = false;
+    if( shrCheckCmdLineFlag(argc, (const char **)argv, "separable") ) useFusedDownfilter = false;
+
+    // everything that is not an option is an input file
+    const char **inputs = (const char **)malloc(argc * sizeof(const char *));
+    int numInputs = 0;
+    for( int i = 1; i < argc; i++ ) {
+        if( argv[i][0] != '-' ) inputs[numInputs++] = argv[i];
+    }
+    if( numInputs == 0 ) {
+        printUsage();
+        return 1;
+    }
+    if( pipelined && (maxFeatures > 0 || useConsistencyCheck) ) {
+        fprintf(stderr, "--pipeline only computes the dense forward flow\n");
+        return 1;
+    }
+
+    FrameSource src;
+    memset(&src, 0, sizeof(src));
+    src.first = start;
+    bool opened;
+    if( endsWith(inputs[0], ".y4m") ) {
+        opened = openY4M( &src, inputs[0] );
+    } else if( endsWith(inputs[0], ".yuv") ) {
+        unsigned int w = 0, h = 0;
+        if( size == NULL || sscanf(size, "%ux%u", &w, &h) != 2 ) {
+            fprintf(stderr, "Raw YUV input needs --size=WxH\n");
+            return 1;
+        }
+        opened = openYUV( &src, inputs[0], w, h );
+    } else {
+        opened = openPGM( &src, inputs, numInputs );
+    }
+    if( !opened ) return 1;
+    printf("Input %s: %d x %d\n", inputs[0], src.w, src.h);
+
+    unsigned char *grey = (unsigned char *)malloc(src.w * src.h);
+    cl_float2 *flow = NULL;
+    cl_float2 *points = NULL;
+    cl_float2 *nextPoints = NULL;
+    cl_uchar *status = NULL;
+    cl_float *pointErr = NULL;
+    int numPoints = 0;
+    if( maxFeatures > 0 ) {
+        points = (cl_float2 *)malloc(maxFeatures * sizeof(cl_float2));
+        nextPoints = (cl_float2 *)malloc(maxFeatures * sizeof(cl_float2));
+        status = (cl_uchar *)malloc(maxFeatures * sizeof(cl_uchar));
+        pointErr = (cl_float *)malloc(maxFeatures * sizeof(cl_float));
+    } else {
+        flow = (cl_float2 *)malloc(src.w * src.h * sizeof(cl_float2));
+    }
+    unsigned char *mask = NULL;
+    if( useConsistencyCheck ) mask = (unsigned char *)malloc(src.w * src.h);
+    if( !readFrame( &src, grey ) ) {
+        fprintf(stderr, "Could not read the first frame\n");
+        return 1;
+    }
+
+    if( pipelined ) {
+        runPipelined( &src, grey, devN, maxFlows, outDir );
+        if( flowProfiler.enabled ) flowProfiler.report( stdout, profileJSON );
+        if( src.fd != NULL ) fclose(src.fd);
+        free(grey);
+        free(inputs);
+        return 0;
+    }
+
+    cl_int err;
+    cl_context clCtx = initOCLFlowHeadless(devN, src.w, src.h);
+    printf("Running on %s\n", device_string);
+
+    int curr = 0;
+    ocl_set_image( images[curr], clCtx, grey, err );
+
+    // the per frame time covers the upload, the flow and the read back.  The
+    // sustained rate also includes reading and writing the files.
+    unsigned int numFlows = 0;
+    double pyramidTime = 0.0;
+    double kernelTime = 0.0;
+    double backwardTime = 0.0;
+    double frameTime = 0.0;
+    shrDeltaT(0);
+    while( (maxFlows == 0 || numFlows < maxFlows) && readFrame( &src, grey ) ) {
+        int next = 1 - curr;
+
+        shrDeltaT(1);
+        ocl_set_image( images[next], clCtx, grey, err );
+        float t_flow;
+        int numTracked = 0;
+        if( maxFeatures > 0 ) {
+            if( numPoints < maxFeatures / 2 ) {
+                numPoints = detectOCLFeatures( curr, points, maxFeatures, 0.01f, minDistance );
+            }
+            t_flow = trackOCLFeatures( curr, next, points, numPoints, nextPoints, status, pointErr );
+        } else {
+            t_flow = computeOCLFlowStages( curr, next );
+            readOCLFlow( flow );
+            if( useConsistencyCheck ) readOCLFlowConsistency( NULL, mask );
+        }
+        double t_frame = shrDeltaT(1) * 1000.0;
+
+        if( outDir != NULL ) {
+            char fname[1024];
+            if( maxFeatures > 0 ) {
+                sprintf(fname, "%s/points%05d.txt", outDir, numFlows);
+                writePoints( fname, points, nextPoints, status, pointErr, numPoints );
+            } else {
+                sprintf(fname, "%s/flow%05d.flo", outDir, numFlows);
+                writeFlo( fname, flow, src.w, src.h );
+                if( useConsistencyCheck ) {
+                    sprintf(fname, "%s/mask%05d.pgm", outDir, numFlows);
+                    writePGM( fname, mask, src.w, src.h );
+                }
+            }
+        }
+        if( maxFeatures > 0 ) {
+            // carry the tracked points on to the next pair
+            for( int i = 0; i < numPoints; i++ ) {
+                if( status[i] ) points[numTracked++] = nextPoints[i];
+            }
+            printf("frame %5d: pyramids %8.3f ms, klt %8.3f ms, %5d/%5d points, frame %8.3f ms, %7.1f fps\n",
+                numFlows, t_pyramids, t_flow, numTracked, numPoints, t_frame, 1000.0 / t_frame);
+            numPoints = numTracked;
+        } else if( useConsistencyCheck ) {
+            int consistent = 0;
+            for( unsigned int i = 0; i < src.w * src.h; i++ ) {
+                if( mask[i] ) consistent++;
+            }
+            printf("frame %5d: pyramids %8.3f ms, lkflow %8.3f ms, backward %8.3f ms, %5.1f%% consistent, frame %8.3f ms, %7.1f fps\n",
+                numFlows, t_pyramids, t_flow, t_backward, 100.0 * consistent / (src.w * src.h), t_frame, 1000.0 / t_frame);
+            backwardTime += t_backward;
+        } else {
+            printf("frame %5d: pyramids %8.3f ms, lkflow %8.3f ms, frame %8.3f ms, %7.1f fps\n",
+                numFlows, t_pyramids, t_flow, t_frame, 1000.0 / t_frame);
+        }
+
+        pyramidTime += t_pyramids;
+        kernelTime += t_flow;
+        frameTime += t_frame;
+        numFlows++;
+        curr = next;
+    }
+    double elapsed = shrDeltaT(0);
+
+    if( numFlows > 0 ) {
+        printf("\n%d flow fields in %.3f s\n", numFlows, elapsed);
+        printf("  average pyramids:    %.3f ms (%s, %s)\n", pyramidTime / numFlows,
+            useFusedDownfilter ? "fused downsample" : "separable downsample",
+            useImageWrites ? "direct image writes" : "scratch buffer copies");
+        printf("  average %s time: %.3f ms\n", maxFeatures > 0 ? "klt   " : "lkflow", kernelTime / numFlows);
+        if( useConsistencyCheck ) printf("  average backward:    %.3f ms (lkflow J to I and the check)\n", backwardTime / numFlows);
+        printf("  average frame time:  %.3f ms (%.1f fps)\n", frameTime / numFlows, 1000.0 * numFlows / frameTime);
+        printf("  sustained:           %.1f fps\n", numFlows / elapsed);
+    } else {
+        fprintf(stderr, "Need at least two frames to compute flow\n");
+    }
+    if( flowProfiler.enabled ) flowProfiler.report( stdout, profileJSON );
+
+    if( src.fd != NULL ) fclose(src.fd);
+    free(flow);
+    free(points);
+    free(nextPoints);
+    free(status);
+    free(pointErr);
+    free(mask);
+    free(grey);
+    free(inputs);
+    return 0;
+}
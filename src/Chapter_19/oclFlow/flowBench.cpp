@@ -0,0 +1,269 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//  Description:
+//      Accuracy and speed benchmark for the LK optical flow sample.  The flow
+//      of each frame pair is compared against Middlebury style .flo ground
+//      truth for every combination of pyramid levels, window radius, LK
+//      iterations and gain given on the command line, and the average
+//      endpoint error, angular error and time per frame of each setting are
+//      printed as a table.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <oclUtils.h>
+#include <shrUtils.h>
+#include "oclFlow.h"
+
+// larger components mark unknown flow in the Middlebury ground truth
+#define UNKNOWN_FLOW_THRESH 1e9f
+
+#define MAX_SETTINGS 16
+
+struct FlowPair
+{
+    unsigned char *frame1;
+    unsigned char *frame2;
+    cl_float2 *truth;
+    unsigned int w;
+    unsigned int h;
+};
+
+///
+//  Read a Middlebury .flo file: the tag 202021.25, the width and height as
+//  32 bit ints and then the u,v pairs row by row
+//
+static cl_float2 *readFlo( const char *fname, unsigned int *w, unsigned int *h )
+{
+    FILE *fd = fopen(fname, "rb");
+    if( fd == NULL ) {
+        fprintf(stderr, "Could not open %s\n", fname);
+        return NULL;
+    }
+    float tag;
+    int size[2];
+    if( fread(&tag, sizeof(float), 1, fd) != 1 || tag != 202021.25f ||
+        fread(size, sizeof(int), 2, fd) != 2 || size[0] <= 0 || size[1] <= 0 ) {
+        fprintf(stderr, "%s is not a .flo file\n", fname);
+        fclose(fd);
+        return NULL;
+    }
+    cl_float2 *flow = (cl_float2 *)malloc(size[0] * size[1] * sizeof(cl_float2));
+    if( fread(flow, sizeof(cl_float2), size[0] * size[1], fd) != (size_t)(size[0] * size[1]) ) {
+        fprintf(stderr, "%s is truncated\n", fname);
+        free(flow);
+        fclose(fd);
+        return NULL;
+    }
+    fclose(fd);
+    *w = size[0];
+    *h = size[1];
+    return flow;
+}
+
+static bool loadPair( FlowPair *pair, const char *frame1, const char *frame2, const char *truth )
+{
+    unsigned int w2, h2, tw, th;
+    pair->frame1 = NULL;
+    pair->frame2 = NULL;
+    if( !shrLoadPGMub( frame1, &pair->frame1, &pair->w, &pair->h ) ||
+        !shrLoadPGMub( frame2, &pair->frame2, &w2, &h2 ) ) {
+        fprintf(stderr, "Could not load %s and %s\n", frame1, frame2);
+        return false;
+    }
+    pair->truth = readFlo( truth, &tw, &th );
+    if( pair->truth == NULL ) return false;
+    if( w2 != pair->w || h2 != pair->h || tw != pair->w || th != pair->h ) {
+        fprintf(stderr, "%s, %s and %s are not the same size\n", frame1, frame2, truth);
+        return false;
+    }
+    return true;
+}
+
+///
+//  Average endpoint error (pixels) and angular error (degrees, between the
+//  space-time vectors (u,v,1)) over the pixels with known ground truth
+//
+static void flowError( const cl_float2 *flow, const cl_float2 *truth, int n, double *aee, double *ae )
+{
+    double sumEE = 0.0, sumAE = 0.0;
+    int count = 0;
+    for( int i = 0; i < n; i++ ) {
+        float tu = truth[i].s[0], tv = truth[i].s[1];
+        if( fabsf(tu) > UNKNOWN_FLOW_THRESH || fabsf(tv) > UNKNOWN_FLOW_THRESH ) continue;
+        float u = flow[i].s[0], v = flow[i].s[1];
+        sumEE += sqrt( (u-tu)*(u-tu) + (v-tv)*(v-tv) );
+        double c = (u*tu + v*tv + 1.0) / sqrt( (u*u + v*v + 1.0) * (tu*tu + tv*tv + 1.0) );
+        if( c > 1.0 ) c = 1.0;
+        if( c < -1.0 ) c = -1.0;
+        sumAE += acos(c);
+        count++;
+    }
+    *aee = count > 0 ? sumEE / count : 0.0;
+    *ae = count > 0 ? sumAE / count * 180.0 / 3.14159265358979 : 0.0;
+}
+
+///
+//  Parse a comma separated list such as "3,4,5" into values, returns the count
+//
+static int parseInts( const char *list, int *values, int maxValues )
+{
+    int n = 0;
+    while( list != NULL && *list && n < maxValues ) {
+        values[n++] = atoi(list);
+        list = strchr(list, ',');
+        if( list != NULL ) list++;
+    }
+    return n;
+}
+
+static int parseFloats( const char *list, float *values, int maxValues )
+{
+    int n = 0;
+    while( list != NULL && *list && n < maxValues ) {
+        values[n++] = (float)atof(list);
+        list = strchr(list, ',');
+        if( list != NULL ) list++;
+    }
+    return n;
+}
+
+static void printUsage()
+{
+    printf("Usage: flowBench [--device=n] [--levels=a,b,...] [--frad=a,b,...] [--iters=a,b,...] [--gain=a,b,...] [--runs=n] frame1.pgm frame2.pgm truth.flo ...\n");
+    printf("  input       one or more triples of two frames and the ground truth\n");
+    printf("              flow from the first to the second as a .flo file\n");
+    printf("  --device    OpenCL device to use (default 0)\n");
+    printf("  --levels    pyramid levels to try, 0 picks them from the size (default 3)\n");
+    printf("  --frad      LK window radii to try (default 4)\n");
+    printf("  --iters     LK iterations per level to try (default 8)\n");
+    printf("  --gain      LK update gains to try (default 4)\n");
+    printf("  --runs      timed runs of each pair after a warm up run (default 3)\n");
+}
+
+int main( int argc, char** argv )
+{
+    unsigned int devN = 0;
+    int runs = 3;
+    char *list;
+
+    int levels[MAX_SETTINGS] = { 3 }, numLevelSettings = 1;
+    int frads[MAX_SETTINGS] = { 4 }, numFrads = 1;
+    int iters[MAX_SETTINGS] = { 8 }, numIters = 1;
+    float gains[MAX_SETTINGS] = { 4.0f };
+    int numGains = 1;
+
+    shrGetCmdLineArgumentu(argc, (const char **)argv, "device", &devN);
+    shrGetCmdLineArgumenti(argc, (const char **)argv, "runs", &runs);
+    if( shrGetCmdLineArgumentstr(argc, (const char **)argv, "levels", &list) )
+        numLevelSettings = parseInts( list, levels, MAX_SETTINGS );
+    if( shrGetCmdLineArgumentstr(argc, (const char **)argv, "frad", &list) )
+        numFrads = parseInts( list, frads, MAX_SETTINGS );
+    if( shrGetCmdLineArgumentstr(argc, (const char **)argv, "iters", &list) )
+        numIters = parseInts( list, iters, MAX_SETTINGS );
+    if( shrGetCmdLineArgumentstr(argc, (const char **)argv, "gain", &list) )
+        numGains = parseFloats( list, gains, MAX_SETTINGS );
+    if( runs < 1 ) runs = 1;
+
+    // everything that is not an option is an input file
+    const char **inputs = (const char **)malloc(argc * sizeof(const char *));
+    int numInputs = 0;
+    for( int i = 1; i < argc; i++ ) {
+        if( argv[i][0] != '-' ) inputs[numInputs++] = argv[i];
+    }
+    if( numInputs == 0 || numInputs % 3 != 0 ) {
+        printUsage();
+        return 1;
+    }
+
+    int numPairs = numInputs / 3;
+    FlowPair *pairs = (FlowPair *)malloc(numPairs * sizeof(FlowPair));
+    unsigned int maxSize = 0;
+    for( int p = 0; p < numPairs; p++ ) {
+        if( !loadPair( &pairs[p], inputs[3*p], inputs[3*p+1], inputs[3*p+2] ) ) return 1;
+        if( pairs[p].w * pairs[p].h > maxSize ) maxSize = pairs[p].w * pairs[p].h;
+    }
+    cl_float2 *flow = (cl_float2 *)malloc(maxSize * sizeof(cl_float2));
+
+    // compiled with the first setting, the kernels are rebuilt when it changes
+    lkWindowRadius = frads[0];
+    lkIterations = iters[0];
+    lkGain = gains[0];
+    numLevels = levels[0];
+    cl_int err;
+    cl_context clCtx = initOCLFlowHeadless(devN, pairs[0].w, pairs[0].h);
+    unsigned int currW = pairs[0].w, currH = pairs[0].h;
+    int currLevels = levels[0];
+    printf("Running on %s, %d pairs, %d runs each\n\n", device_string, numPairs, runs);
+
+    printf("levels frad iters  gain |    AEE px     AE deg |  ms/frame  lkflow ms\n");
+    for( int l = 0; l < numLevelSettings; l++ )
+    for( int f = 0; f < numFrads; f++ )
+    for( int i = 0; i < numIters; i++ )
+    for( int g = 0; g < numGains; g++ ) {
+        if( frads[f] != lkWindowRadius || iters[i] != lkIterations || gains[g] != lkGain ) {
+            setOCLFlowParameters( frads[f], iters[i], gains[g] );
+        }
+
+        double sumAEE = 0.0, sumAE = 0.0;
+        double frameTime = 0.0, kernelTime = 0.0;
+        int usedLevels = 0;
+        for( int p = 0; p < numPairs; p++ ) {
+            FlowPair &pair = pairs[p];
+            if( pair.w != currW || pair.h != currH || levels[l] != currLevels ) {
+                resizeOCLFlow( pair.w, pair.h, levels[l] );
+                currW = pair.w;
+                currH = pair.h;
+                currLevels = levels[l];
+            }
+            usedLevels = numLevels;
+
+            // the first run warms up, the pyramids of both frames are built
+            // every run so the time covers the upload, pyramids, flow and read back
+            for( int r = 0; r <= runs; r++ ) {
+                shrDeltaT(1);
+                ocl_set_image( images[0], clCtx, pair.frame1, err );
+                ocl_set_image( images[1], clCtx, pair.frame2, err );
+                resetOCLFlowFrames();
+                float t_flow = computeOCLFlowStages( 0, 1 );
+                readOCLFlow( flow );
+                double t_frame = shrDeltaT(1) * 1000.0;
+                if( r > 0 ) {
+                    frameTime += t_frame;
+                    kernelTime += t_flow;
+                }
+            }
+
+            double aee, ae;
+            flowError( flow, pair.truth, pair.w * pair.h, &aee, &ae );
+            sumAEE += aee;
+            sumAE += ae;
+        }
+
+        // the flow does not depend on the timing, errors are averaged per pair
+        printf("%6d %4d %5d %5.2f | %9.4f %10.4f | %9.3f %10.3f\n",
+            usedLevels, frads[f], iters[i], gains[g],
+            sumAEE / numPairs, sumAE / numPairs,
+            frameTime / (numPairs * runs), kernelTime / (numPairs * runs));
+    }
+
+    for( int p = 0; p < numPairs; p++ ) {
+        free(pairs[p].frame1);
+        free(pairs[p].frame2);
+        free(pairs[p].truth);
+    }
+    free(pairs);
+    free(flow);
+    free(inputs);
+    return 0;
+}
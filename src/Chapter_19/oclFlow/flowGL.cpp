@@ -52,31 +52,9 @@ GLuint tex, vbo;
 //
 // Header information for communicating the flow object 
 //
-#ifdef MAC
-#define SINGLE_CHANNEL_TYPE CL_R
-#else
-#define SINGLE_CHANNEL_TYPE CL_INTENSITY
-#endif 
-
-template<cl_channel_order co, cl_channel_type dt>
-struct ocl_image {
-    cl_mem image_mem;
-    unsigned int w;
-    unsigned int h;
-    cl_image_format image_format;
-} ;
+#include "oclFlow.h"
 cl_context clCtx;
 void shutdown();
-cl_context initOCLFlow(GLuint vbo, int devId);
-float computeOCLFlow(int curr, int next);
-ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> ocl_set_image( cl_context context, unsigned char *image_grey_ub, int w, int h, cl_int &err );
-extern ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> images[2];
-void ocl_set_image( ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, cl_context context, unsigned char *image_grey_ub, cl_int &err );
-ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> ocl_init_image( cl_context context, unsigned char *image_grey_ub, int w, int h, cl_int &err );
-extern char device_string[1024];
-//
-// end flow header info
-//
 GLuint initVBO( int , int );
 int currentFrame = 0;
 // IPP version
@@ -0,0 +1,115 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+//  Description:
+//      Per stage GPU timing of the optical flow pipeline, see flowProfiler.h
+//
+#include <algorithm>
+#include "flowProfiler.h"
+
+FlowProfiler flowProfiler;
+
+FlowProfiler::FlowProfiler()
+    : enabled(false), frames(0)
+{
+}
+
+void FlowProfiler::record( const char *stage, cl_event event )
+{
+    if( !enabled || event == NULL ) return;
+
+    clRetainEvent( event );
+    Pending p;
+    p.stage = stage;
+    p.event = event;
+    pending.push_back( p );
+}
+
+void FlowProfiler::collect( bool wait )
+{
+    size_t kept = 0;
+    for( size_t i = 0; i < pending.size(); i++ ) {
+        cl_event event = pending[i].event;
+        if( wait ) {
+            clWaitForEvents( 1, &event );
+        } else {
+            cl_int status;
+            clGetEventInfo( event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL );
+            if( status != CL_COMPLETE ) {
+                // keep it for the next collect
+                pending[kept++] = pending[i];
+                continue;
+            }
+        }
+
+        // start and end are in nanoseconds
+        cl_ulong start = 0;
+        cl_ulong end = 0;
+        clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL );
+        clGetEventProfilingInfo( event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL );
+        clReleaseEvent( event );
+
+        const std::string &stage = pending[i].stage;
+        if( samples.find(stage) == samples.end() ) stages.push_back( stage );
+        samples[stage].push_back( ((double)end - (double)start) * 1.0e-6 );
+    }
+    pending.resize( kept );
+}
+
+void FlowProfiler::frameDone()
+{
+    if( enabled ) frames++;
+}
+
+void FlowProfiler::report( FILE *fd, bool json )
+{
+    collect( true );
+
+    double total = 0.0;
+    for( size_t s = 0; s < stages.size(); s++ ) {
+        std::vector<double> &t = samples[stages[s]];
+        for( size_t i = 0; i < t.size(); i++ ) total += t[i];
+    }
+    int perFrame = frames > 0 ? frames : 1;
+
+    if( json ) {
+        fprintf(fd, "{\n  \"frames\": %d,\n  \"total_ms_per_frame\": %.4f,\n  \"stages\": [\n", frames, total / perFrame);
+    } else {
+        fprintf(fd, "\n%-28s %7s %9s %9s %9s %11s %6s\n", "stage", "count", "min ms", "mean ms", "p95 ms", "ms/frame", "share");
+    }
+
+    for( size_t s = 0; s < stages.size(); s++ ) {
+        std::vector<double> t = samples[stages[s]];
+        std::sort( t.begin(), t.end() );
+        double sum = 0.0;
+        for( size_t i = 0; i < t.size(); i++ ) sum += t[i];
+        double mean = sum / t.size();
+        // nearest rank
+        size_t rank = (size_t)(0.95 * t.size() + 0.5);
+        double p95 = t[ rank > 0 ? rank - 1 : 0 ];
+        double share = total > 0.0 ? 100.0 * sum / total : 0.0;
+
+        if( json ) {
+            fprintf(fd, "    { \"stage\": \"%s\", \"count\": %d, \"min_ms\": %.4f, \"mean_ms\": %.4f, \"p95_ms\": %.4f, \"ms_per_frame\": %.4f, \"share\": %.2f }%s\n",
+                stages[s].c_str(), (int)t.size(), t[0], mean, p95, sum / perFrame, share, s + 1 < stages.size() ? "," : "");
+        } else {
+            fprintf(fd, "%-28s %7d %9.4f %9.4f %9.4f %11.4f %5.1f%%\n",
+                stages[s].c_str(), (int)t.size(), t[0], mean, p95, sum / perFrame, share);
+        }
+    }
+
+    if( json ) {
+        fprintf(fd, "  ]\n}\n");
+    } else {
+        fprintf(fd, "%-28s %7s %9s %9s %9s %11.4f\n", "total", "", "", "", "", total / perFrame);
+        fprintf(fd, "(%d frames)\n", frames);
+    }
+}
@@ -0,0 +1,62 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+// Collects the GPU time of every command the flow pipeline enqueues, grouped
+// by stage (a kernel or copy at one pyramid level), and reports the min, mean
+// and 95th percentile of each stage over a run.  The times come from the
+// profiling events of the commands, so they exclude any host side overhead.
+//
+#ifndef FLOW_PROFILER_H
+#define FLOW_PROFILER_H
+
+#include <CL/cl.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+class FlowProfiler
+{
+public:
+    FlowProfiler();
+
+    // Add the command of event to stage.  The profiler keeps its own
+    // reference to the event until it has read the command's time, so the
+    // caller can release it straight away.  Does nothing unless enabled.
+    void record( const char *stage, cl_event event );
+
+    // Read the times of the commands that have completed, or with wait set,
+    // wait for all of them
+    void collect( bool wait );
+
+    // Count one more flow field, for the per frame times
+    void frameDone();
+
+    // Print the statistics of each stage, in the order the stages were first
+    // recorded, as a table or as JSON.  Waits for the pending commands.
+    void report( FILE *fd, bool json );
+
+    bool enabled;
+
+private:
+    struct Pending {
+        std::string stage;
+        cl_event event;
+    };
+    std::vector<Pending> pending;
+    std::vector<std::string> stages;
+    std::map< std::string, std::vector<double> > samples;
+    int frames;
+};
+
+extern FlowProfiler flowProfiler;
+
+#endif // FLOW_PROFILER_H
@@ -28,12 +28,24 @@
 //    at each point (in filters.cl::filter_G())
 // guess_in, guess_out: the previous level's guess and this level's guess to
 //    be used by the next level
+// guess_in_w, guess_in_h: dimensions of the previous level
 // w,h: image dimensions
 // use_guess: flag whether or not to use the guess_in to seed motion, 
 //   (set false for example at the top pyramid level where no previous
 //    guess exists).
 
+// The window radius, iterations per level and gain can be set with -D build
+// options to compare settings, FRAD must match the one filters.cl is built
+// with since it also sets the window G is summed over.
+#ifndef FRAD
 #define FRAD 4
+#endif
+#ifndef LK_ITERS
+#define LK_ITERS 8
+#endif
+#ifndef LK_GAIN
+#define LK_GAIN 4.0f
+#endif
 #define eps 0.0000001f;
 #define LOCAL_X 16
 #define LOCAL_Y 8
@@ -58,6 +70,7 @@ __kernel void lkflow(
     __read_only image2d_t J_float,
     __global float2 *guess_in,
     int guess_in_w,
+    int guess_in_h,
     __global float2 *guess_out,
     int guess_out_w,
     int guess_out_h,
@@ -82,33 +95,18 @@ __kernel void lkflow(
     int2 iIidx = { get_global_id(0), get_global_id(1)};
     float2 Iidx = { get_global_id(0)+0.5, get_global_id(1)+0.5 };
 
-	// load some data into local memory because it will be re-used frequently
-	// load upper left region of smem
+	// load some data into local memory because it will be re-used frequently.
+	// The tile is the work-group plus an apron of FRAD all around, loaded in
+	// steps of the work-group size so that any radius fits.  With FRAD 4 that
+	// is the upper left block plus the right, bottom and corner aprons.
 	int2 tIdx = { get_local_id(0), get_local_id(1) };
-	smem[ tIdx.y ][ tIdx.x ] = read_imageui( I, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ).x;
-	smemIy[ tIdx.y ][ tIdx.x ] = read_imageui( Iy, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ).x;
-	smemIx[ tIdx.y ][ tIdx.x ] = read_imageui( Ix, nnSampler, Iidx+(float2)(-FRAD,-FRAD) ).x;
-
-	// upper right
-	if( tIdx.x < 2*FRAD ) { 
-		smem[ tIdx.y ][ tIdx.x + LOCAL_X ] = read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ).x;
-		smemIy[ tIdx.y ][ tIdx.x + LOCAL_X ] = read_imageui( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ).x;
-		smemIx[ tIdx.y ][ tIdx.x + LOCAL_X ] = read_imageui( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD,-FRAD) ).x;
-
-	}
-	// lower left
-	if( tIdx.y < 2*FRAD ) {
-		smem[ tIdx.y + LOCAL_Y ][ tIdx.x ] = read_imageui( I, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ).x;
-		smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x ] = read_imageui( Iy, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ).x;
-		smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x ] = read_imageui( Ix, nnSampler, Iidx+(float2)(-FRAD, LOCAL_Y-FRAD) ).x;
-
-	}
-	// lower right
-	if( tIdx.x < 2*FRAD && tIdx.y < 2*FRAD ) {
-		smem[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = read_imageui( I, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ).x;
-		smemIy[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = read_imageui( Iy, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ).x;
-		smemIx[ tIdx.y + LOCAL_Y ][ tIdx.x + LOCAL_X ] = read_imageui( Ix, nnSampler, Iidx+(float2)(LOCAL_X - FRAD, LOCAL_Y - FRAD) ).x;
-
+	for( int ty = tIdx.y ; ty < 2*FRAD + LOCAL_Y ; ty += LOCAL_Y ) {
+		for( int tx = tIdx.x ; tx < 2*FRAD + LOCAL_X ; tx += LOCAL_X ) {
+			float2 pos = Iidx + (float2)(tx - tIdx.x - FRAD, ty - tIdx.y - FRAD);
+			smem[ ty ][ tx ] = read_imageui( I, nnSampler, pos ).x;
+			smemIy[ ty ][ tx ] = read_imageui( Iy, nnSampler, pos ).x;
+			smemIx[ ty ][ tx ] = read_imageui( Ix, nnSampler, pos ).x;
+		}
 	}
 	barrier(CLK_LOCAL_MEM_FENCE);
     float2 g = {0,0}; 
@@ -116,8 +114,9 @@ __kernel void lkflow(
 	// Previous pyramid levels provide input guess.  Use if available.
     if( use_guess != 0 ) {
         //lookup in higher level, div by two to find position because its smaller
-        int gin_x = iIidx.x/2;
-        int gin_y = iIidx.y/2;
+        //clamp for the work-items past the edge of the image
+        int gin_x = min( iIidx.x/2, guess_in_w-1 );
+        int gin_y = min( iIidx.y/2, guess_in_h-1 );
         float2 g_in = guess_in[gin_y * guess_in_w + gin_x ];
 		// multiply the motion by two because we are in a larger level. 
         g.x = g_in.x*2;
@@ -133,8 +132,8 @@ __kernel void lkflow(
     float4 Ginv = { Gmat.s3/det_G, -Gmat.s1/det_G, -Gmat.s2/det_G, Gmat.s0/det_G };
 
 	// for large motions we can approximate them faster by applying gain to the motion
-    float gain = 4.f;
-    for( int k=0 ; k <8 ; k++ ) {
+    float gain = LK_GAIN;
+    for( int k=0 ; k < LK_ITERS ; k++ ) {
         float2 Jidx = { Iidx.x + g.x + v.x, Iidx.y + g.y + v.y };
         float2 b = {0,0};
         float2 n = {0,0};
@@ -180,3 +179,158 @@ __kernel void lkflow(
     }
     
 }
+
+// Sparse (KLT) version of lkflow, one work-item per feature point instead of
+// one per pixel.  Launched for each level from the top down like lkflow.
+// points: feature positions in base level pixels.  Each point is tracked from
+//    the pixel it falls in on the level.
+// flow: the guess from the previous level on input, this level's flow on output
+// status: set to 0 when a point is lost, because its G is too poorly
+//    conditioned (min eigenvalue below min_eig) or it leaves the image
+// err: mean absolute difference between I and J over the window at the final
+//    position, written on the base level
+// Unlike lkflow the update is not damped by a gain: the derivatives from
+// filter_3x1/filter_1x3 are 32x the gradient, which DERIV_SCALE undoes so each
+// iteration is a full Newton step.  With the per-point cost this low, more
+// iterations are affordable to converge tightly.
+#define DERIV_SCALE 32.0f
+#define KLT_ITERS 20
+#define KLT_EPS 0.01f
+
+__kernel void lkflow_sparse(
+    __read_only image2d_t I,
+    __read_only image2d_t Ix,
+    __read_only image2d_t Iy,
+    __read_only image2d_t G,
+    __read_only image2d_t J_float,
+    __global const float2 *points,
+    __global float2 *flow,
+    __global uchar *status,
+    __global float *err,
+    int num_points,
+    int level,
+    int w,
+    int h,
+    int use_guess,
+    float min_eig )
+{
+    sampler_t bilinSampler = CLK_NORMALIZED_COORDS_FALSE |
+                           CLK_ADDRESS_CLAMP_TO_EDGE |
+                           CLK_FILTER_LINEAR ;
+    sampler_t nnSampler = CLK_NORMALIZED_COORDS_FALSE |
+                           CLK_ADDRESS_CLAMP_TO_EDGE |
+                           CLK_FILTER_NEAREST ;
+
+    const int p = get_global_id(0);
+    if( p >= num_points ) return;
+
+    float2 g = {0,0};
+    if( use_guess != 0 ) {
+        if( status[p] == 0 ) return;
+        // previous level is half the size
+        g = flow[p]*2.0f;
+    } else {
+        status[p] = 1;
+    }
+
+    // the pixel holding the point on this level
+    int2 iIidx = convert_int2( points[p] / (float)(1 << level) );
+    float2 Iidx = convert_float2( iIidx ) + (float2)(0.5f, 0.5f);
+    if( iIidx.x < 0 || iIidx.y < 0 || iIidx.x >= w || iIidx.y >= h ) {
+        status[p] = 0;
+        return;
+    }
+
+    int4 Gmat = read_imagei( G, nnSampler, iIidx );
+    float a = (float)Gmat.s0;
+    float c = (float)Gmat.s1;
+    float d = (float)Gmat.s3;
+    float half_diff = (a - d)*0.5f;
+    if( (a + d)*0.5f - sqrt( half_diff*half_diff + c*c ) < min_eig ) {
+        status[p] = 0;
+        return;
+    }
+    float det_G = a*d - c*c;
+    float4 Ginv = (float4)( d, -c, -c, a ) * (DERIV_SCALE/det_G);
+
+    float2 v = {0,0};
+    for( int k=0 ; k < KLT_ITERS ; k++ ) {
+        float2 Jidx = Iidx + g + v;
+        float2 b = {0,0};
+
+        // calculate the mismatch vector
+        for( int j=-FRAD ; j <= FRAD ; j++ ) {
+            for( int i=-FRAD ; i<= FRAD ; i++ ) {
+                float Isample = (float)read_imageui( I, nnSampler, Iidx+(float2)(i,j) ).x;
+                float Jsample = read_imagef( J_float, bilinSampler, Jidx+(float2)(i,j) ).x;
+                float dIk = Isample - Jsample;
+                b += dIk * (float2)( read_imagei( Ix, nnSampler, Iidx+(float2)(i,j) ).x,
+                                     read_imagei( Iy, nnSampler, Iidx+(float2)(i,j) ).x );
+            }
+        }
+
+        // n = G^-1 * b
+        float2 n = (float2)( Ginv.s0*b.s0 + Ginv.s1*b.s1, Ginv.s2*b.s0 + Ginv.s3*b.s1 );
+        v = v + n;
+        if( length(n) < KLT_EPS ) break;
+    }
+    g = g + v;
+    flow[p] = g;
+
+    if( level == 0 ) {
+        float2 Jidx = Iidx + g;
+        if( Jidx.x < 0.0f || Jidx.y < 0.0f || Jidx.x >= w || Jidx.y >= h ) {
+            status[p] = 0;
+            return;
+        }
+        float sum = 0.0f;
+        for( int j=-FRAD ; j <= FRAD ; j++ ) {
+            for( int i=-FRAD ; i<= FRAD ; i++ ) {
+                float Isample = (float)read_imageui( I, nnSampler, Iidx+(float2)(i,j) ).x;
+                float Jsample = read_imagef( J_float, bilinSampler, Jidx+(float2)(i,j) ).x;
+                sum += fabs( Isample - Jsample );
+            }
+        }
+        err[p] = sum / ((2*FRAD+1)*(2*FRAD+1));
+    }
+}
+
+// Bilinear lookup in a float2 buffer, clamped to the edges
+float2 sample_flow( __global const float2 *flow, int w, int h, float2 pos )
+{
+    pos = clamp( pos, (float2)(0.0f, 0.0f), (float2)(w-1, h-1) );
+    int2 p0 = convert_int2( floor(pos) );
+    int2 p1 = min( p0 + (int2)(1, 1), (int2)(w-1, h-1) );
+    float2 f = pos - convert_float2( p0 );
+
+    float2 top = mix( flow[ p0.y*w + p0.x ], flow[ p0.y*w + p1.x ], f.x );
+    float2 bottom = mix( flow[ p1.y*w + p0.x ], flow[ p1.y*w + p1.x ], f.x );
+    return mix( top, bottom, f.y );
+}
+
+// Forward-backward consistency of a pair of flows.  Following the forward
+// flow from a pixel and then the backward flow from where it lands should
+// come back to the pixel.  fb_err gets the distance it misses by, and mask
+// gets 255 where that is at most max_err and 0 where it is not or the pixel
+// moves out of the image, which mostly marks occlusions and bad matches.
+__kernel void flow_consistency(
+    __global const float2 *fwd,
+    __global const float2 *bwd,
+    __global float *fb_err,
+    __global uchar *mask,
+    int w,
+    int h,
+    float max_err )
+{
+    const int ix = get_global_id(0);
+    const int iy = get_global_id(1);
+    if( ix >= w || iy >= h ) return;
+
+    float2 f = fwd[ iy*w + ix ];
+    float2 q = (float2)( ix, iy ) + f;
+    float e = length( f + sample_flow( bwd, w, h, q ) );
+    bool inside = q.x >= 0.0f && q.y >= 0.0f && q.x <= w-1 && q.y <= h-1;
+
+    fb_err[ iy*w + ix ] = e;
+    mask[ iy*w + ix ] = ( inside && e <= max_err ) ? 255 : 0;
+}
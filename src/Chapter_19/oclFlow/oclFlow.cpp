@@ -13,20 +13,34 @@
 #include <shrUtils.h>
 #include <oclUtils.h>
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#ifndef OCLFLOW_HEADLESS
 #include <GL/gl.h>
 #ifdef  __GNUC__
 #include <GL/glx.h>
 #endif
+#endif
+#include "oclFlow.h"
+#include "flowProfiler.h"
 
 #ifdef MAC
-#define SINGLE_CHANNEL_TYPE CL_R
 #define GL_SHARING_EXTENSION "cl_APPLE_gl_sharing"
-#else
-#define SINGLE_CHANNEL_TYPE CL_INTENSITY
 #endif 
 
 
 bool writeImages=false;
+// write the filter results straight into the pyramid images.  Without image
+// writes the filters write a scratch buffer which is copied to the image.
+// opencl_init() turns this off when the device can not write the images.
+bool useImageWrites=true;
+float t_pyramids = 0.0f;
+// build the image pyramids with the fused 5x5 downsample instead of separate x and y passes
+bool useFusedDownfilter=true;
+// also compute the backward flow and check it against the forward flow
+bool useConsistencyCheck=false;
+float fbMaxError = 1.0f;
+float t_backward = 0.0f;
 
 static cl_mem cl_imagePacked, cl_imageFull, cl_imageOrig;
 static cl_command_queue command_queue;
@@ -72,6 +86,30 @@ static inline size_t DivUp(size_t dividend, size_t divisor)
 }
 
 
+// whether images of the given format can be created with flags on the device
+static bool imageFormatSupported( cl_context ctx, cl_mem_flags flags, cl_channel_order order, cl_channel_type type )
+{
+    cl_uint n = 0;
+    cl_int err = clGetSupportedImageFormats( ctx, flags, CL_MEM_OBJECT_IMAGE2D, 0, NULL, &n );
+    if( err != CL_SUCCESS || n == 0 ) return false;
+    std::vector<cl_image_format> formats( n );
+    err = clGetSupportedImageFormats( ctx, flags, CL_MEM_OBJECT_IMAGE2D, n, &formats[0], NULL );
+    if( err != CL_SUCCESS ) return false;
+    for( cl_uint i=0 ; i<n ; i++ ) {
+        if( formats[i].image_channel_order == order && formats[i].image_channel_data_type == type ) return true;
+    }
+    return false;
+}
+
+// whether the filters can write every format of pyramid image they fill
+static bool imageWritesSupported( cl_context ctx )
+{
+    return imageFormatSupported( ctx, CL_MEM_READ_WRITE, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8 ) &&
+           imageFormatSupported( ctx, CL_MEM_READ_WRITE, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16 ) &&
+           imageFormatSupported( ctx, CL_MEM_READ_WRITE, CL_RGBA, CL_SIGNED_INT32 ) &&
+           imageFormatSupported( ctx, CL_MEM_READ_WRITE, CL_RGBA, CL_FLOAT );
+}
+
 int opencl_init(int devId) {
 
     // Get OpenCL platform ID for NVIDIA if avaiable, otherwise default
@@ -134,7 +172,9 @@ int opencl_init(int devId) {
 		{
 			//Create a context for the devices
 			cl_context_properties props[] = { 
-#ifdef _WIN32
+#if defined(OCLFLOW_HEADLESS)
+				CL_CONTEXT_PLATFORM, (cl_context_properties)clSelectedPlatformID, 
+#elif defined(_WIN32)
 				CL_CONTEXT_PLATFORM, (cl_context_properties)clSelectedPlatformID, 
 				CL_GL_CONTEXT_KHR, (cl_context_properties)wglGetCurrentContext(), 
 				CL_WGL_HDC_KHR, (cl_context_properties)wglGetCurrentDC(), 
@@ -173,6 +213,13 @@ int opencl_init(int devId) {
     } else {    
         printf("CL_DEVICE_IMAGE_SUPPORT **Missing**\n");
     }   
+    if( img_support && !imageFormatSupported( context, CL_MEM_READ_ONLY, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8 ) ) {
+        printf("Single channel CL_UNSIGNED_INT8 images **Missing**\n");
+    }
+    if( useImageWrites && !(img_support && imageWritesSupported( context )) ) {
+        printf("Image writes not supported, using scratch buffer copies.\n");
+        useImageWrites = false;
+    }
 	size_t n;
 	ciErrNum = clGetDeviceInfo( cdDevice, CL_DEVICE_NAME, 1024, device_string, &n );
 
@@ -180,16 +227,22 @@ int opencl_init(int devId) {
     cl_device_type dtype;
     ciErrNum = clGetDeviceInfo(cdDevice, CL_DEVICE_TYPE, sizeof(cl_device_type),&dtype, &retsz);
     checkErr(ciErrNum, __LINE__,"clGetDeviceInfo");
+#ifdef OCLFLOW_HEADLESS
+    // without GL sharing any device with image support will do
+    printf("type is %s\n", (dtype & CL_DEVICE_TYPE_GPU) ? "GPU" : "not GPU" );
+#else
     assert( dtype == CL_DEVICE_TYPE_GPU );
     printf("type is GPU\n");
+#endif
 
 
   return 0;
 }
 
 
-// build a program from a file, uses global device, and given context
-cl_program buildProgramFromFile(cl_context clctx, const char *source_path) 
+// build a program from a file, uses global device, and given context.
+// options are added to the default build options.
+cl_program buildProgramFromFile(cl_context clctx, const char *source_path, const char *options = NULL) 
 {
   cl_int err;
   // Buffer to hold source for compilation 
@@ -206,7 +259,9 @@ cl_program buildProgramFromFile(cl_context clctx, const char *source_path)
 
   // Build the program (OpenCL JIT compilation)
   std::cerr<<"Calling clBuildProgram..."<<std::endl;
-  err = clBuildProgram(program, 0, NULL, "-cl-nv-verbose -cl-mad-enable -cl-fast-relaxed-math", NULL, NULL);
+  char build_options[1024];
+  sprintf(build_options, "-cl-nv-verbose -cl-mad-enable -cl-fast-relaxed-math %s", options != NULL ? options : "");
+  err = clBuildProgram(program, 0, NULL, build_options, NULL, NULL);
   std::cerr<<"OK"<<std::endl;
 
   cl_build_status build_status;
@@ -236,14 +291,6 @@ cl_program buildProgramFromFile(cl_context clctx, const char *source_path)
 // Functions to write pyramids to images or save them to floating point files
 // that can be read in octave for verification
 ////////////////////////////////////////////////////////////////////////////////
-template<cl_channel_order co, cl_channel_type dt>
-struct ocl_image {
-    cl_mem image_mem;
-    unsigned int w;
-    unsigned int h;
-    cl_image_format image_format;
-} ;
-
 struct ocl_buffer { 
     cl_mem mem;
     unsigned int w;
@@ -584,85 +631,130 @@ void query_img8( ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, cl_comman
 ////////////////////////////////////////////////////////////////////////////////
 // Pyramid handling functions
 ////////////////////////////////////////////////////////////////////////////////
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
+template<cl_channel_order channel_order, cl_channel_type data_type>
 class ocl_pyramid {
     public:
-        ocl_image<channel_order, data_type> imgLvl[lvls];
+        int lvls;
+        ocl_image<channel_order, data_type> *imgLvl;
         ocl_buffer scratchBuf;
         ocl_image<channel_order, data_type> scratchImg;
 
         ocl_pyramid(cl_context &, cl_command_queue &);
-        cl_int init(int w, int h, const char *name );
+        cl_int init(int w, int h, int levels, const char *name = NULL );
         cl_int fill(ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> , cl_kernel downfilter_x, cl_kernel downfilter_y);
-        cl_int pyrFill(ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8>, cl_kernel, cl_kernel, cl_int4, cl_int4);
-        cl_int convFill( ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8>, cl_kernel );
+        cl_int fill(ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> , cl_kernel downfilter_5x5);
+        cl_int fillBase(ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> );
+        cl_int pyrFill(ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8>, cl_kernel, cl_kernel, cl_int4, cl_int4);
+        cl_int convFill( ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8>, cl_kernel );
         cl_int G_Fill(
-            ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &,
-            ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &,
+            ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &,
+            ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &,
             cl_kernel  );
         cl_int flowFill(
-            ocl_pyramid<3, SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &I,
-            ocl_pyramid<3, SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &J,
-            ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix,
-            ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy,
-            ocl_pyramid<3, CL_RGBA,      CL_SIGNED_INT32> &G,
+            ocl_pyramid<SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &I,
+            ocl_pyramid<SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &J,
+            ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix,
+            ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy,
+            ocl_pyramid<CL_RGBA,      CL_SIGNED_INT32> &G,
             cl_kernel );
 
+        void release();
         void printInfo();
-        void printTimer(int i, bool b=false);
+        void printTimer(const char *op, int i, bool b=false);
+        cl_mem passOutput(cl_mem image);
+        cl_int passCopy(cl_mem image, unsigned int w, unsigned int h, int i);
 
         cl_context ctx;
         cl_command_queue cmdq;
         char pname[256];
+        // what the pyramid holds, names its commands in the profile
+        const char *stage;
         cl_event gpu_timer;
 };
 
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-ocl_pyramid<lvls,channel_order,data_type>::ocl_pyramid(cl_context &context_in, cl_command_queue &command_queue_in)
+template<cl_channel_order channel_order, cl_channel_type data_type>
+ocl_pyramid<channel_order,data_type>::ocl_pyramid(cl_context &context_in, cl_command_queue &command_queue_in)
 {
     ctx = context_in;
     cmdq = command_queue_in;
+    stage = "pyramid";
 }
 
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-void ocl_pyramid<lvls,channel_order,data_type>::printInfo( ){
+template<cl_channel_order channel_order, cl_channel_type data_type>
+void ocl_pyramid<channel_order,data_type>::printInfo( ){
 }
 
 
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-void ocl_pyramid<lvls,channel_order,data_type>::printTimer(int i, bool showT){
+template<cl_channel_order channel_order, cl_channel_type data_type>
+void ocl_pyramid<channel_order,data_type>::printTimer(const char *op, int i, bool showT){
         if( showT ) {
         clWaitForEvents(1, &gpu_timer );
-        printf("\t\t\t\t\t%s, L%d Kernel Time: %f [ms]\n", pname, i, elapsedTimeInSeconds(gpu_timer)*1000.0f );
+        printf("\t\t\t\t\t%s %s, L%d Kernel Time: %f [ms]\n", pname, op, i, elapsedTimeInSeconds(gpu_timer)*1000.0f );
         }
+        // hand the command over to the profiler, which keeps the event if it needs it
+        char name[256];
+        sprintf( name, "%s %s L%d", stage, op, i );
+        flowProfiler.record( name, gpu_timer );
+        clReleaseEvent( gpu_timer );
+}
+
+// the memory object a filter pass writes its result for image to
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_mem ocl_pyramid<channel_order,data_type>::passOutput(cl_mem image)
+{
+    return useImageWrites ? image : scratchBuf.mem;
+}
+
+// perform copy from buffer to clImage
+// when image writes are not available
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::passCopy(cl_mem image, unsigned int w, unsigned int h, int i)
+{
+    if( useImageWrites ) return CL_SUCCESS;
+    size_t origin[3] = {0,0,0};
+    size_t region[3] = {w, h, 1};
+    cl_int err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, image, 0, origin, region, 0, NULL, &gpu_timer );
+    // the first pass of a separable filter goes to scratchImg
+    if( err == CL_SUCCESS ) printTimer( image == scratchImg.image_mem ? "copy pass 1" : "copy", i );
+    return err;
+}
+
+// free the memory allocated by init
+template<cl_channel_order channel_order, cl_channel_type data_type>
+void ocl_pyramid<channel_order,data_type>::release()
+{
+    for( int i=0 ; i<lvls ; i++ ) {
+        clReleaseMemObject( imgLvl[i].image_mem );
+    }
+    delete [] imgLvl;
+    clReleaseMemObject( scratchImg.image_mem );
+    if( scratchBuf.mem != NULL ) clReleaseMemObject( scratchBuf.mem );
 }
 
 // initialize memory for the image pyramid
 // name is an optional pyramid "name" for saving images as
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-cl_int ocl_pyramid<lvls,channel_order,data_type>::init(int w, int h, const char *name = NULL )
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::init(int w, int h, int levels, const char *name )
 {
     cl_int err;
-    cl_mem_flags memflag;
-#ifdef MAC
-    memflag = CL_MEM_READ_ONLY;
-#else
-    memflag = CL_MEM_READ_WRITE;
-#endif
+    lvls = levels;
+    imgLvl = new ocl_image<channel_order, data_type>[lvls];
+    // only the filters writing the images directly need them writable
+    cl_mem_flags memflag = useImageWrites ? CL_MEM_READ_WRITE : CL_MEM_READ_ONLY;
 
     // store ubytes as RGBA packed
+    // odd sizes round up, so that every pixel of a level has its parent
+    // pixel (x/2, y/2) in the level above
     for( int i=0 ; i<lvls ; i++ ) {
-        imgLvl[i].w = w>>i;
-        imgLvl[i].h = h>>i;
+        imgLvl[i].w = (i == 0) ? w : (imgLvl[i-1].w + 1) / 2;
+        imgLvl[i].h = (i == 0) ? h : (imgLvl[i-1].h + 1) / 2;
         imgLvl[i].image_format.image_channel_data_type = data_type;
         imgLvl[i].image_format.image_channel_order = channel_order;
         imgLvl[i].image_mem = clCreateImage2D( ctx, memflag,
                 &imgLvl[i].image_format, imgLvl[i].w, imgLvl[i].h, 0, NULL, &err );
         if( err != CL_SUCCESS ) return err;
     }
-    // initialize a scratch buffer
-    // on Mac, it is a linear buffer used between texture passes
-    // on LInux it is a R/W texture, presumably faster
+    // initialize a scratch image for the first pass of the separable filters
     scratchImg.w = imgLvl[0].w;
     scratchImg.h = imgLvl[0].h;
     scratchImg.image_format.image_channel_data_type = data_type;
@@ -692,9 +784,13 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::init(int w, int h, const char
     scratchBuf.image_format.image_channel_order = channel_order;
 
     //printf("Scratch buffer is %d x %d x %ld \n", scratchBuf.w, scratchBuf.h, sz );
-    int size = scratchBuf.w * scratchBuf.h* sz;
-    scratchBuf.mem = clCreateBuffer( ctx, CL_MEM_READ_WRITE, size, NULL, &err );
-    checkErr(err, __LINE__, "creating Scratch Buffer");
+    // not needed when the filters can write the images
+    scratchBuf.mem = NULL;
+    if( !useImageWrites ) {
+        int size = scratchBuf.w * scratchBuf.h* sz;
+        scratchBuf.mem = clCreateBuffer( ctx, CL_MEM_READ_WRITE, size, NULL, &err );
+        checkErr(err, __LINE__, "creating Scratch Buffer");
+    }
 
     if( name != NULL ) {
         strcpy( pname, name);
@@ -705,27 +801,23 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::init(int w, int h, const char
 
 }
 
-// fill in the image data for the downfilter pyramid given a base image
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-cl_int ocl_pyramid<lvls,channel_order,data_type>::fill(
-	ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, 
-	cl_kernel downfilter_kernel_x, 
-	cl_kernel downfilter_kernel_y )
+// copy the base image into level 0 of the downfilter pyramid
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::fillBase(
+	ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img )
 {
-    static cl_int err = CL_SUCCESS;
-    static const size_t src_origin[3] = {0, 0, 0};
-    static const size_t dst_origin[3] = {0, 0, 0};
-    static const size_t region[3] = {img.w, img.h, 1};
-    static size_t global_work_size[2];
-    static size_t local_work_size[2];
-	static int i;
+    cl_int err = CL_SUCCESS;
+    const size_t src_origin[3] = {0, 0, 0};
+    const size_t dst_origin[3] = {0, 0, 0};
+    const size_t region[3] = {img.w, img.h, 1};
 
     // copy level 0 image (full size)
     err = clEnqueueCopyImage( cmdq, img.image_mem, imgLvl[0].image_mem,
-        src_origin, dst_origin, region, 0, NULL, NULL );
+        src_origin, dst_origin, region, 0, NULL, &gpu_timer );
     checkErr(err,__LINE__, "oclPyramid::fill::clEnqueuCopyImage");
+    printTimer( "copy", 0 );
 
-    static char fname[256];
+    char fname[256];
 	if( writeImages ) {
 		sprintf(fname, "%s-L%d.pgm", pname, 0 );
 		save_image( imgLvl[0], cmdq, fname );
@@ -733,6 +825,22 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::fill(
 		sprintf(fname, "%s-L%d.oct", pname, 0 );
 		 save_octave( imgLvl[0], cmdq, fname );
 	}
+    return err;
+}
+
+// fill in the image data for the downfilter pyramid given a base image
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::fill(
+	ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, 
+	cl_kernel downfilter_kernel_x, 
+	cl_kernel downfilter_kernel_y )
+{
+    static cl_int err = CL_SUCCESS;
+    static size_t global_work_size[2];
+    static size_t local_work_size[2];
+	static int i;
+
+    err = fillBase( img );
      
     for(  i=1 ; i<lvls ; i++ ) {
         local_work_size[0] = 32;
@@ -741,49 +849,40 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::fill(
         global_work_size[1] = local_work_size[1] * DivUp( imgLvl[i-1].h, local_work_size[1] ) ;
 
         int argCnt = 0;
+        cl_mem out = passOutput( scratchImg.image_mem );
         clSetKernelArg( downfilter_kernel_x, argCnt++, sizeof(cl_mem), &imgLvl[i-1].image_mem );
-        clSetKernelArg( downfilter_kernel_x, argCnt++, sizeof(cl_mem), &scratchBuf.mem );
+        clSetKernelArg( downfilter_kernel_x, argCnt++, sizeof(cl_mem), &out );
         clSetKernelArg( downfilter_kernel_x, argCnt++, sizeof(cl_int), &imgLvl[i-1].w );
         clSetKernelArg( downfilter_kernel_x, argCnt++, sizeof(cl_int), &imgLvl[i-1].h );
         //printf("%d %d\n", imgLvl[i-1].w, imgLvl[i-1].h );
         err = clEnqueueNDRangeKernel( cmdq, downfilter_kernel_x, 2, 0, 
-            global_work_size, local_work_size, 0, NULL, NULL);
+            global_work_size, local_work_size, 0, NULL, &gpu_timer);
         checkErr(err,__LINE__,  "downfilterx");
-        printTimer(i);
+        printTimer("downfilter_x", i);
 		
-        // perform copy from buffer to clImage
-		// when image writes are not available
-        {
-			size_t origin[3] = {0,0,0};
-			size_t region[3] = {imgLvl[i-1].w, imgLvl[i-1].h, 1};
-			err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, scratchImg.image_mem, 0, origin, region, 0, NULL, NULL );
-			checkErr(err,__LINE__,  "clCopyBufferToImage");
-        }
+        err = passCopy( scratchImg.image_mem, imgLvl[i-1].w, imgLvl[i-1].h, i );
+        checkErr(err,__LINE__,  "clCopyBufferToImage");
 
         global_work_size[0] = local_work_size[0] * DivUp( imgLvl[i].w, local_work_size[0] ) ;
         global_work_size[1] = local_work_size[1] * DivUp( imgLvl[i].h, local_work_size[1] ) ;
         argCnt = 0;
 
-        // send the imgLvl[i] texture holding teh first pass as input
-        // send the scratch buffer as output
+        // send the scratch texture holding the first pass as input
+        // send imgLvl[i] (or the scratch buffer) as output
+        out = passOutput( imgLvl[i].image_mem );
         clSetKernelArg( downfilter_kernel_y, argCnt++, sizeof(cl_mem), &scratchImg.image_mem );
-        clSetKernelArg( downfilter_kernel_y, argCnt++, sizeof(cl_mem), &scratchBuf.mem );
+        clSetKernelArg( downfilter_kernel_y, argCnt++, sizeof(cl_mem), &out );
         clSetKernelArg( downfilter_kernel_y, argCnt++, sizeof(cl_int), &imgLvl[i].w );
         clSetKernelArg( downfilter_kernel_y, argCnt++, sizeof(cl_int), &imgLvl[i].h );
+        clSetKernelArg( downfilter_kernel_y, argCnt++, sizeof(cl_int), &imgLvl[i-1].h );
 
         err = clEnqueueNDRangeKernel( cmdq, downfilter_kernel_y, 2, 0, 
-            global_work_size, local_work_size, 0, NULL, NULL);
+            global_work_size, local_work_size, 0, NULL, &gpu_timer);
         checkErr(err, __LINE__, "downfiltery");
-        printTimer(i);
-
-        // perform copy from buffer to clImage
-		// when image writes are not available
-        { ///XX all wrong indexing!
-			size_t origin[3] = {0,0,0};
-			size_t region[3] = {imgLvl[i].w, imgLvl[i].h, 1};
-			err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, imgLvl[i].image_mem, 0, origin, region, 0, NULL, NULL );
-			checkErr(err,__LINE__,  "clCopyBufferToImage");
-        }
+        printTimer("downfilter_y", i);
+
+        err = passCopy( imgLvl[i].image_mem, imgLvl[i].w, imgLvl[i].h, i );
+        checkErr(err,__LINE__,  "clCopyBufferToImage");
 
         char fname[256];
 		if(writeImages) {
@@ -799,10 +898,56 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::fill(
 	return err;
 }
 
+// fill in the image data for the downfilter pyramid given a base image, using
+// the fused downsample kernel: one pass per level, reading the level above
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::fill(
+	ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, 
+	cl_kernel downfilter_kernel )
+{
+    cl_int err = CL_SUCCESS;
+    size_t global_work_size[2];
+    size_t local_work_size[2];
+
+    err = fillBase( img );
+
+    for( int i=1 ; i<lvls ; i++ ) {
+        // must match DS_LOCAL_X x DS_LOCAL_Y in filters.cl
+        local_work_size[0] = 16;
+        local_work_size[1] = 8;
+        global_work_size[0] = local_work_size[0] * DivUp( imgLvl[i].w, local_work_size[0] ) ;
+        global_work_size[1] = local_work_size[1] * DivUp( imgLvl[i].h, local_work_size[1] ) ;
+
+        int argCnt = 0;
+        cl_mem out = passOutput( imgLvl[i].image_mem );
+        clSetKernelArg( downfilter_kernel, argCnt++, sizeof(cl_mem), &imgLvl[i-1].image_mem );
+        clSetKernelArg( downfilter_kernel, argCnt++, sizeof(cl_mem), &out );
+        clSetKernelArg( downfilter_kernel, argCnt++, sizeof(cl_int), &imgLvl[i].w );
+        clSetKernelArg( downfilter_kernel, argCnt++, sizeof(cl_int), &imgLvl[i].h );
+        err = clEnqueueNDRangeKernel( cmdq, downfilter_kernel, 2, 0, 
+            global_work_size, local_work_size, 0, NULL, &gpu_timer);
+        checkErr(err,__LINE__,  "downfilter5x5");
+        printTimer("downfilter_5x5", i);
+
+        err = passCopy( imgLvl[i].image_mem, imgLvl[i].w, imgLvl[i].h, i );
+        checkErr(err,__LINE__,  "clCopyBufferToImage");
+
+        char fname[256];
+		if(writeImages) {
+			sprintf(fname, "%s-L%d.pgm", pname, i );
+			save_image( imgLvl[i], cmdq, fname );
+
+			sprintf(fname, "%s-L%d.oct", pname, i );
+			save_octave( imgLvl[i], cmdq, fname );
+		}
+    }
+	return err;
+}
+
 // given a pyramid, create a pyramid that holds the scharr filtered version of each level
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-cl_int ocl_pyramid<lvls,channel_order,data_type>::pyrFill( 
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> pyr, 
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::pyrFill( 
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> pyr, 
     cl_kernel kernel_x, 
     cl_kernel kernel_y,
     cl_int4   Wx,
@@ -822,8 +967,9 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::pyrFill(
         global_work_size[0] = local_work_size[0] * DivUp( imgLvl[i].w, local_work_size[0] ) ;
         global_work_size[1] = local_work_size[1] * DivUp( imgLvl[i].h, local_work_size[1] ) ;
 
+        cl_mem out = passOutput( scratchImg.image_mem );
         clSetKernelArg( kernel_x, argCnt++, sizeof(cl_mem), &pyr.imgLvl[i].image_mem );
-        clSetKernelArg( kernel_x, argCnt++, sizeof(cl_mem), &scratchBuf.mem );
+        clSetKernelArg( kernel_x, argCnt++, sizeof(cl_mem), &out );
         clSetKernelArg( kernel_x, argCnt++, sizeof(cl_int), &pyr.imgLvl[i].w );
         clSetKernelArg( kernel_x, argCnt++, sizeof(cl_int), &pyr.imgLvl[i].h );
 		clSetKernelArg( kernel_x, argCnt++, sizeof(cl_int), &Wx.s[0] );
@@ -832,22 +978,16 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::pyrFill(
         err = clEnqueueNDRangeKernel( cmdq, kernel_x, 2, 0, 
             global_work_size, local_work_size, 0, NULL, &gpu_timer);
         checkErr(err, __LINE__, "enq");
-        printTimer(i);
+        printTimer("filter_3x1", i);
         //printf("Wx = %d %d %d %d\n", Wx[0], Wx[1], Wx[2], Wx[3] );
 
-        // perform copy from buffer to clImage
-		// when image writes are not available
-        {
-        size_t origin[3] = {0,0,0};
-        size_t region[3] = {pyr.imgLvl[i].w, pyr.imgLvl[i].h, 1};
-        err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, scratchImg.image_mem, 0, origin, region, 0, NULL, NULL );
+        err = passCopy( scratchImg.image_mem, pyr.imgLvl[i].w, pyr.imgLvl[i].h, i );
         checkErr(err, __LINE__, "clCopyBufferToImage");
-    
-        }
 
         argCnt=0;
+        out = passOutput( imgLvl[i].image_mem );
         clSetKernelArg( kernel_y, argCnt++, sizeof(cl_mem), &scratchImg.image_mem );
-        clSetKernelArg( kernel_y, argCnt++, sizeof(cl_mem), &scratchBuf.mem );
+        clSetKernelArg( kernel_y, argCnt++, sizeof(cl_mem), &out );
         clSetKernelArg( kernel_y, argCnt++, sizeof(cl_int), &pyr.imgLvl[i].w );
         clSetKernelArg( kernel_y, argCnt++, sizeof(cl_int), &pyr.imgLvl[i].h );
         clSetKernelArg( kernel_y, argCnt++, sizeof(cl_int), &Wy.s[0] );
@@ -857,16 +997,10 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::pyrFill(
             global_work_size, local_work_size, 0, NULL, &gpu_timer);
 
         checkErr(err, __LINE__, "enq");
-        printTimer(i);
-
-        // perform copy from buffer to clImage
-		// when image writes are not available
-        { 
-			size_t origin[3] = {0,0,0};
-			size_t region[3] = {pyr.imgLvl[i].w, pyr.imgLvl[i].h, 1};
-			err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, imgLvl[i].image_mem, 0, origin, region, 0, NULL, NULL );
-			checkErr(err,__LINE__,  "clCopyBufferToImage");
-        }
+        printTimer("filter_1x3", i);
+
+        err = passCopy( imgLvl[i].image_mem, pyr.imgLvl[i].w, pyr.imgLvl[i].h, i );
+        checkErr(err,__LINE__,  "clCopyBufferToImage");
 
 
         char fname[256];
@@ -881,9 +1015,9 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::pyrFill(
 }
 
 // given a pyramid, create a pyramid that holds greyscale image, make a floating point CL_RGBA for interpolation
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-cl_int ocl_pyramid<lvls,channel_order,data_type>::convFill( 
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> pyr, 
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::convFill( 
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> pyr, 
     cl_kernel convert_kernel )
 {
     cl_int err = CL_SUCCESS;
@@ -900,23 +1034,19 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::convFill(
         global_work_size[0] = local_work_size[0] * DivUp( imgLvl[i].w, local_work_size[0] ) ;
         global_work_size[1] = local_work_size[1] * DivUp( imgLvl[i].h, local_work_size[1] ) ;
 
+        cl_mem out = passOutput( imgLvl[i].image_mem );
         clSetKernelArg( convert_kernel, argCnt++, sizeof(cl_mem), &pyr.imgLvl[i].image_mem );
-        clSetKernelArg( convert_kernel, argCnt++, sizeof(cl_mem), &scratchBuf.mem );
+        clSetKernelArg( convert_kernel, argCnt++, sizeof(cl_mem), &out );
         clSetKernelArg( convert_kernel, argCnt++, sizeof(cl_int), &pyr.imgLvl[i].w );
         clSetKernelArg( convert_kernel, argCnt++, sizeof(cl_int), &pyr.imgLvl[i].h );
         err = clEnqueueNDRangeKernel( cmdq, convert_kernel, 2, 0, 
             global_work_size, local_work_size, 0, NULL, &gpu_timer);
         checkErr(err, __LINE__, "enq");
-        printTimer(i);
+        printTimer("convert", i);
         //printf("Wx = %d %d %d %d\n", Wx[0], Wx[1], Wx[2], Wx[3] );
 
-        // perform copy from buffer to clImage, use the     
-        { 
-        size_t origin[3] = {0,0,0};
-        size_t region[3] = {pyr.imgLvl[i].w, pyr.imgLvl[i].h, 1};
-        err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, imgLvl[i].image_mem, 0, origin, region, 0, NULL, NULL );
+        err = passCopy( imgLvl[i].image_mem, pyr.imgLvl[i].w, pyr.imgLvl[i].h, i );
         checkErr(err, __LINE__, "clCopyBufferToImage");
-        }
 
         //char fname[256];
         //sprintf(fname, "%s-L%d.oct", pname, i );
@@ -928,10 +1058,10 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::convFill(
 
 
 
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-cl_int ocl_pyramid<lvls,channel_order,data_type>::G_Fill( 
-                                                            ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix, 
-                                                            ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy, 
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::G_Fill( 
+                                                            ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix, 
+                                                            ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy, 
                                                             cl_kernel kernel_G )
 {
     cl_int err = CL_SUCCESS;
@@ -950,23 +1080,19 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::G_Fill(
         global_work_size[1] = local_work_size[1] * DivUp( imgLvl[i].h, local_work_size[1] ) ;
 
         clSetKernelArg( kernel_G, argCnt++, sizeof(cl_mem), &Ix.imgLvl[i].image_mem );
+        cl_mem out = passOutput( imgLvl[i].image_mem );
         clSetKernelArg( kernel_G, argCnt++, sizeof(cl_mem), &Iy.imgLvl[i].image_mem );
-        clSetKernelArg( kernel_G, argCnt++, sizeof(cl_mem), &scratchBuf.mem );
-        clSetKernelArg( kernel_G, argCnt++, sizeof(cl_mem), &Iy.imgLvl[i].w );
-        clSetKernelArg( kernel_G, argCnt++, sizeof(cl_mem), &Iy.imgLvl[i].h );
+        clSetKernelArg( kernel_G, argCnt++, sizeof(cl_mem), &out );
+        clSetKernelArg( kernel_G, argCnt++, sizeof(cl_int), &Iy.imgLvl[i].w );
+        clSetKernelArg( kernel_G, argCnt++, sizeof(cl_int), &Iy.imgLvl[i].h );
    
         err = clEnqueueNDRangeKernel( cmdq, kernel_G, 2, 0, 
             global_work_size, local_work_size, 0, NULL, &gpu_timer );
         checkErr(err, __LINE__, "enq");
-        printTimer(i);
+        printTimer("filter_G", i);
 
-        // perform copy from buffer to clImage, use the     
-        { 
-        size_t origin[3] = {0,0,0};
-        size_t region[3] = {imgLvl[i].w, imgLvl[i].h, 1};
-        err = clEnqueueCopyBufferToImage( cmdq, scratchBuf.mem, imgLvl[i].image_mem, 0, origin, region, 0, NULL, NULL );
+        err = passCopy( imgLvl[i].image_mem, imgLvl[i].w, imgLvl[i].h, i );
         checkErr(err, __LINE__, "clCopyBufferToImage");
-        }
 
 
 
@@ -979,13 +1105,13 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::G_Fill(
     return err;
 }
 
-template<int lvls, cl_channel_order channel_order, cl_channel_type data_type>
-cl_int ocl_pyramid<lvls,channel_order,data_type>::flowFill( 
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &I,
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &J,
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix,
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy,
-    ocl_pyramid<3, CL_RGBA,      CL_SIGNED_INT32> &G,
+template<cl_channel_order channel_order, cl_channel_type data_type>
+cl_int ocl_pyramid<channel_order,data_type>::flowFill( 
+    ocl_pyramid<SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &I,
+    ocl_pyramid<SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &J,
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix,
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy,
+    ocl_pyramid<CL_RGBA,      CL_SIGNED_INT32> &G,
     cl_kernel lkflow_kernel
 )
 {
@@ -1022,7 +1148,7 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::flowFill(
         err = clEnqueueNDRangeKernel( cmdq, lkflow_kernel, 2, 0, 
             global_work_size, local_work_size, 0, NULL, &gpu_timer );
         checkErr( err, __LINE__, "lkflowKernel", false);
-        printTimer(i);
+        printTimer("lkflow", i);
 
 
         
@@ -1034,25 +1160,25 @@ cl_int ocl_pyramid<lvls,channel_order,data_type>::flowFill(
     return err;
 }
 
-float calc_flow( 
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &I,
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &J,
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix,
-    ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy,
-    ocl_pyramid<3, CL_RGBA,      CL_SIGNED_INT32> &G,
-    ocl_pyramid<3, CL_RGBA,      CL_FLOAT> &J_float,
-    ocl_buffer flowLvl[3],
+// Enqueue the lkflow passes from the top level down.  timers gets one
+// profiling event per level, level 0 being the last one enqueued.
+void calc_flow( 
+    ocl_pyramid<SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &I,
+    ocl_pyramid<SINGLE_CHANNEL_TYPE,      CL_UNSIGNED_INT8> &J,
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Ix,
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> &Iy,
+    ocl_pyramid<CL_RGBA,      CL_SIGNED_INT32> &G,
+    ocl_pyramid<CL_RGBA,      CL_FLOAT> &J_float,
+    ocl_buffer *flowLvl,
+    int lvls,
     cl_kernel lkflow_kernel,
-    cl_command_queue cmdq
+    cl_command_queue cmdq,
+    cl_event *timers
 )
 {
-    int lvls = 3;
     cl_int err = CL_SUCCESS;
     size_t global_work_size[2];
     size_t local_work_size[2];
-    float t_flow = 0.0f;
-    
-    static cl_event flow_timer;
 
     // beginning at the top level work down the base (largest)
     for( int i=lvls-1; i>=0 ; i-- ) {
@@ -1074,24 +1200,23 @@ float calc_flow(
 
         if( use_guess  ) {  // send previous level guesses if available
             clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[i+1].mem );
-            clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[i+1].w );
+            clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &flowLvl[i+1].w );
+            clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &flowLvl[i+1].h );
         } else { // if no previous level just send irrelevant pointer
             clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[0].mem );
-            clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[0].w );
+            clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &flowLvl[0].w );
+            clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &flowLvl[0].h );
         }
 
         clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[i].mem );
-        clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[i].w );
-        clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_mem), &flowLvl[i].h );
+        clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &flowLvl[i].w );
+        clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &flowLvl[i].h );
         clSetKernelArg( lkflow_kernel, argCnt++, sizeof(cl_int), &use_guess );
 
         err = clEnqueueNDRangeKernel( cmdq, lkflow_kernel, 2, 0, 
-            global_work_size, local_work_size, 0, NULL, &flow_timer );
+            global_work_size, local_work_size, 0, NULL, &timers[i] );
         checkErr( err, __LINE__, "lkflowKernel");
         
-        clWaitForEvents(1, &flow_timer );
-		// printf("\t\t\t\t\tcalcflow, GPU L%d Kernel Time: %f [ms]\n", i, elapsedTimeInSeconds(gpu_timer)*1000.0f );
-        t_flow += (float)elapsedTimeInSeconds(flow_timer)*1000.0f; 
         char fname[256];
 		if(writeImages) {
 			sprintf( fname, "results/flow-L%d.oct", i );
@@ -1099,6 +1224,21 @@ float calc_flow(
 		}
 
     }
+}
+
+// Sum the kernel times of the events from calc_flow in ms, and release them.
+// The events must be complete.  stage names them in the profile.
+float flowTime( cl_event *timers, int lvls, const char *stage )
+{
+    float t_flow = 0.0f;
+    for( int i=0 ; i<lvls ; i++ ) {
+        char name[256];
+        sprintf( name, "%s L%d", stage, i );
+        flowProfiler.record( name, timers[i] );
+        t_flow += (float)elapsedTimeInSeconds(timers[i])*1000.0f;
+        clReleaseEvent( timers[i] );
+        timers[i] = NULL;
+    }
     return t_flow;
 }
 
@@ -1137,8 +1277,11 @@ void ocl_set_image( ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, cl_con
     if( image_grey_ub != NULL ) {
             size_t origin[3] = {0};
             size_t region[3] = {img.w, img.h, 1};
-            err = clEnqueueWriteImage( command_queue, img.image_mem, CL_TRUE, origin, region, img.w, 0, image_grey_ub, 0, NULL,  NULL);
+            cl_event timer;
+            err = clEnqueueWriteImage( command_queue, img.image_mem, CL_TRUE, origin, region, img.w, 0, image_grey_ub, 0, NULL,  &timer);
             checkErr(err, __LINE__, "ocl_load_image::clEnqueuWriteImage");
+            flowProfiler.record( "upload", timer );
+            clReleaseEvent( timer );
     }
     return;
 }
@@ -1180,22 +1323,45 @@ ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> ocl_load_image( cl_context cont
 
 cl_kernel downfilter_kernel_x;
 cl_kernel downfilter_kernel_y;
+cl_kernel downfilter_kernel_5x5;
 cl_kernel filter_3x1;
 cl_kernel filter_1x3;
 cl_kernel filter_G;
 cl_kernel lkflow_kernel;
 cl_kernel update_motion_kernel;
 cl_kernel convert_kernel;
-
-ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> *I;
-ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> *J ;
-ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> *Ix ;
-ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> *Iy ;
-ocl_pyramid<3, CL_RGBA, CL_SIGNED_INT32> *G; 
-ocl_pyramid<3, CL_RGBA, CL_FLOAT> *J_float; 
+cl_kernel min_eigen_kernel;
+cl_kernel select_features_kernel;
+cl_kernel lkflow_sparse_kernel;
+cl_kernel consistency_kernel;
+
+// All the pyramids built from one frame.  A frame is J for the flow to it and
+// then I for the flow from it, so its pyramids are built once when it arrives
+// and reused for the next pair.
+struct ocl_frame_pyramids {
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> *img;
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> *Ix;
+    ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16> *Iy;
+    ocl_pyramid<CL_RGBA, CL_SIGNED_INT32> *G;
+    ocl_pyramid<CL_RGBA, CL_FLOAT> *img_float;
+    bool built;
+};
+// one set per entry of images[]
+ocl_frame_pyramids framePyramids[MAX_FRAME_SLOTS];
 // load images
-ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> images[2];
-ocl_buffer flowLvl[3];
+ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> images[MAX_FRAME_SLOTS];
+// number of entries of images[] in use, 2 except in the pipeline
+static int numFrameSlots = 2;
+ocl_buffer *flowLvl = NULL;
+// the flow from images[next] back to images[curr], and the result of
+// checking it against flowLvl, when useConsistencyCheck is set
+ocl_buffer *backFlowLvl = NULL;
+static cl_mem fb_err_mem = NULL;
+static cl_mem fb_mask_mem = NULL;
+int numLevels = 0;
+float maxMotion = 28.0f;
+
+#ifndef OCLFLOW_HEADLESS
 cl_mem vbo_cl_mem;
 
 void acquireVBO() {
@@ -1229,72 +1395,225 @@ void updateFlowBuffer(cl_mem pos_mem, cl_mem v_mem, int w, int h)
             global_work_size, local_work_size, 0, NULL, &gpu_timer);
     releaseVBO();
     checkErr(err, __LINE__, "update_motion_kernel");
+    flowProfiler.record( "motion", gpu_timer );
+    clReleaseEvent( gpu_timer );
 }
+#endif
 
+int lkWindowRadius = 4;
+int lkIterations = 8;
+float lkGain = 4.0f;
 
-cl_context initOCLFlow(GLuint vbo, int devId)
+// the kernels built by initOCLFlowKernels(), to release them on a rebuild
+static cl_kernel *flowKernels[] = {
+    &downfilter_kernel_x, &downfilter_kernel_y, &downfilter_kernel_5x5,
+    &filter_3x1, &filter_1x3, &filter_G, &lkflow_kernel, &convert_kernel,
+    &min_eigen_kernel, &select_features_kernel, &lkflow_sparse_kernel,
+    &consistency_kernel
+};
+
+// build the programs and create the kernels used to build the pyramids and compute the flow
+static void initOCLFlowKernels()
 {
     cl_int err;
-    opencl_init(devId);
+
+    // the LK window and iterations are compiled in
+    char options[256];
+    sprintf(options, "-D FRAD=%d -D LK_ITERS=%d -D LK_GAIN=%ff", lkWindowRadius, lkIterations, lkGain);
 
     // load our filters, downfilter and scharr for building the pyramids
-    cl_program lkflow_program = buildProgramFromFile(context,"lkflow.cl");
-	cl_program motion_programs = buildProgramFromFile(context,"motion.cl");
-    cl_program filter_programs = buildProgramFromFile(context,"filters.cl");
+    cl_program lkflow_program = buildProgramFromFile(context,"lkflow.cl", options);
+    cl_program filter_programs = buildProgramFromFile(context,"filters.cl", options);
   
-    downfilter_kernel_x = clCreateKernel(filter_programs, "downfilter_x_g", &err);
+    // the _img versions of the filters write the images directly
+    downfilter_kernel_x = clCreateKernel(filter_programs, useImageWrites ? "downfilter_x_img" : "downfilter_x_g", &err);
     checkErr(err, __LINE__, "clCreateKernel (downfilter_x)");
-    downfilter_kernel_y = clCreateKernel(filter_programs, "downfilter_y_g", &err);
+    downfilter_kernel_y = clCreateKernel(filter_programs, useImageWrites ? "downfilter_y_img" : "downfilter_y_g", &err);
     checkErr(err, __LINE__, "clCreateKernel (downfilter_y)");
+    downfilter_kernel_5x5 = clCreateKernel(filter_programs, useImageWrites ? "downfilter_5x5_img" : "downfilter_5x5_g", &err);
+    checkErr(err, __LINE__, "clCreateKernel (downfilter_5x5)");
 
-    filter_3x1 = clCreateKernel(filter_programs, "filter_3x1_g", &err );
+    filter_3x1 = clCreateKernel(filter_programs, useImageWrites ? "filter_3x1_img" : "filter_3x1_g", &err );
     checkErr(err, __LINE__, "clCreateKrenel (filter3x1)");
-    filter_1x3 = clCreateKernel(filter_programs, "filter_1x3_g", &err );
+    filter_1x3 = clCreateKernel(filter_programs, useImageWrites ? "filter_1x3_img" : "filter_1x3_g", &err );
     checkErr(err, __LINE__, "clCreateKrenel (filter1x3)");
     
-    filter_G = clCreateKernel(filter_programs, "filter_G", &err );
+    filter_G = clCreateKernel(filter_programs, useImageWrites ? "filter_G_img" : "filter_G", &err );
     checkErr(err, __LINE__, "clCreateKrenel (G_filter)");
 
     lkflow_kernel = clCreateKernel( lkflow_program, "lkflow", &err );
     checkErr(err, __LINE__, "clCreateKernel (lkflow)");
-   
-    update_motion_kernel = clCreateKernel( motion_programs, "motion", &err );
-    checkErr(err, __LINE__, "clCreateKernel (motion)");
 
-    convert_kernel = clCreateKernel( filter_programs, "convertToRGBAFloat", &err );
+    convert_kernel = clCreateKernel( filter_programs, useImageWrites ? "convertToRGBAFloat_img" : "convertToRGBAFloat", &err );
     checkErr(err, __LINE__, "clCreateKernel (convert_kernel)");
 
-    images[1] = ocl_load_image( context, "data/minicooper/frame10.pgm", err );
-    images[0] = ocl_load_image( context, "data/minicooper/frame11.pgm", err );
+    // feature detection and sparse tracking
+    min_eigen_kernel = clCreateKernel( filter_programs, "min_eigen", &err );
+    checkErr(err, __LINE__, "clCreateKernel (min_eigen)");
+    select_features_kernel = clCreateKernel( filter_programs, "select_features", &err );
+    checkErr(err, __LINE__, "clCreateKernel (select_features)");
+    lkflow_sparse_kernel = clCreateKernel( lkflow_program, "lkflow_sparse", &err );
+    checkErr(err, __LINE__, "clCreateKernel (lkflow_sparse)");
 
-    // create pyramids
-    I  = new ocl_pyramid<3,SINGLE_CHANNEL_TYPE,CL_UNSIGNED_INT8>(context, command_queue);
-    J  = new ocl_pyramid<3,SINGLE_CHANNEL_TYPE,CL_UNSIGNED_INT8>(context, command_queue);
-    Ix = new ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16>(context, command_queue);
-    Iy = new ocl_pyramid<3, SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16>(context, command_queue);
-    G = new ocl_pyramid<3,CL_RGBA,CL_SIGNED_INT32>(context, command_queue);
-    J_float  = new ocl_pyramid<3,CL_RGBA,CL_FLOAT>(context, command_queue);
-
-    // initalize them
-    err = I->init( images[0].w, images[0].h, "results/I" );  checkErr(err, __LINE__, "Init I");
-    err = J->init( images[1].w, images[1].h, "results/J" );  checkErr(err, __LINE__, "Init J");
-    // initialize the Ix,Iy derivatives from the downsampled pyramids
-    err = Ix->init( images[0].w, images[0].h, "results/Ix");  checkErr(err, __LINE__, "init Ix");
-    err = Iy->init( images[0].w, images[0].h, "results/Iy");  checkErr(err, __LINE__, "init Iy");
-    // initialize G 
-    err = G->init( images[0].w, images[0].h, "results/G" ) ; checkErr(err, __LINE__, "init G");
-    err = J_float->init( images[0].w, images[0].h, "results/J_float" ) ; checkErr(err, __LINE__, "init J_float");
+    consistency_kernel = clCreateKernel( lkflow_program, "flow_consistency", &err );
+    checkErr(err, __LINE__, "clCreateKernel (flow_consistency)");
 
+    // the kernels keep the programs alive
+    clReleaseProgram( lkflow_program );
+    clReleaseProgram( filter_programs );
+}
+
+void setOCLFlowParameters(int windowRadius, int iterations, float gain)
+{
+    for( size_t i=0 ; i<sizeof(flowKernels)/sizeof(flowKernels[0]) ; i++ ) {
+        clReleaseKernel( *flowKernels[i] );
+    }
+    lkWindowRadius = windowRadius;
+    lkIterations = iterations;
+    lkGain = gain;
+    initOCLFlowKernels();
+}
+
+// Motion in pixels that the LK iterations recover at a single level, about
+// the window radius.  Every level added on top doubles what the levels below
+// can handle, so n levels track motions up to LEVEL_MOTION * (2^n - 1).
+#define LEVEL_MOTION 4
+// smallest size of the top level, below that the window covers most of it
+#define MIN_LEVEL_SIZE 16
+
+int choosePyramidLevels(int w, int h, float max_motion)
+{
+    int levels = 1;
+    while( LEVEL_MOTION * ((1 << levels) - 1) < max_motion ) levels++;
+
+    int maxLevels = 1;
+    while( (w+1)/2 >= MIN_LEVEL_SIZE && (h+1)/2 >= MIN_LEVEL_SIZE ) {
+        w = (w+1)/2;
+        h = (h+1)/2;
+        maxLevels++;
+    }
+    return levels < maxLevels ? levels : maxLevels;
+}
+
+// one flow buffer for each pyramid level
+static ocl_buffer *createFlowLevels()
+{
+    cl_int err;
     // simulate a CL_RG buffer in global memory, for lack of support for CL_RG
-    for( int i=0 ; i<3; i++ ) {
-        flowLvl[i].w = images[0].w>>i;
-        flowLvl[i].h = images[0].h>>i;
-        flowLvl[i].image_format.image_channel_data_type = CL_FLOAT;
-        flowLvl[i].image_format.image_channel_order = CL_RG;
-        int size = flowLvl[i].w * flowLvl[i].h* sizeof(cl_float2) ;
-        flowLvl[i].mem = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &err );
+    ocl_buffer *levels = new ocl_buffer[numLevels];
+    for( int i=0 ; i<numLevels; i++ ) {
+        levels[i].w = framePyramids[0].img->imgLvl[i].w;
+        levels[i].h = framePyramids[0].img->imgLvl[i].h;
+        levels[i].image_format.image_channel_data_type = CL_FLOAT;
+        levels[i].image_format.image_channel_order = CL_RG;
+        int size = levels[i].w * levels[i].h* sizeof(cl_float2) ;
+        levels[i].mem = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &err );
         checkErr(err, __LINE__, "creating flow level");
     }
+    return levels;
+}
+
+// create the pyramids and flow levels for images of the size of images[0]
+static void initOCLFlowPyramids()
+{
+    cl_int err;
+
+    if( numLevels <= 0 ) numLevels = choosePyramidLevels( images[0].w, images[0].h, maxMotion );
+    printf("Using %d pyramid levels\n", numLevels);
+
+    // create pyramids, one set for each image
+    for( int f=0 ; f<numFrameSlots ; f++ ) {
+        ocl_frame_pyramids &P = framePyramids[f];
+        char name[256];
+        P.img = new ocl_pyramid<SINGLE_CHANNEL_TYPE,CL_UNSIGNED_INT8>(context, command_queue);
+        P.Ix = new ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16>(context, command_queue);
+        P.Iy = new ocl_pyramid<SINGLE_CHANNEL_TYPE, CL_SIGNED_INT16>(context, command_queue);
+        P.G = new ocl_pyramid<CL_RGBA,CL_SIGNED_INT32>(context, command_queue);
+        P.img_float  = new ocl_pyramid<CL_RGBA,CL_FLOAT>(context, command_queue);
+        P.img->stage = "img";
+        P.Ix->stage = "Ix";
+        P.Iy->stage = "Iy";
+        P.G->stage = "G";
+        P.img_float->stage = "float";
+        P.built = false;
+
+        // initalize them
+        sprintf(name, "results/F%d", f);
+        err = P.img->init( images[f].w, images[f].h, numLevels, name );  checkErr(err, __LINE__, "Init image");
+        // initialize the Ix,Iy derivatives from the downsampled pyramids
+        sprintf(name, "results/F%d-Ix", f);
+        err = P.Ix->init( images[f].w, images[f].h, numLevels, name);  checkErr(err, __LINE__, "init Ix");
+        sprintf(name, "results/F%d-Iy", f);
+        err = P.Iy->init( images[f].w, images[f].h, numLevels, name);  checkErr(err, __LINE__, "init Iy");
+        // initialize G 
+        sprintf(name, "results/F%d-G", f);
+        err = P.G->init( images[f].w, images[f].h, numLevels, name ) ; checkErr(err, __LINE__, "init G");
+        sprintf(name, "results/F%d-float", f);
+        err = P.img_float->init( images[f].w, images[f].h, numLevels, name ) ; checkErr(err, __LINE__, "init float image");
+    }
+
+    flowLvl = createFlowLevels();
+    if( useConsistencyCheck ) {
+        backFlowLvl = createFlowLevels();
+        int pixels = flowLvl[0].w * flowLvl[0].h;
+        fb_err_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, pixels*sizeof(cl_float), NULL, &err );
+        checkErr(err, __LINE__, "creating forward-backward error");
+        fb_mask_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, pixels*sizeof(cl_uchar), NULL, &err );
+        checkErr(err, __LINE__, "creating forward-backward mask");
+    }
+}
+
+static void releaseFlowLevels( ocl_buffer *levels )
+{
+    for( int i=0 ; i<numLevels; i++ ) {
+        clReleaseMemObject( levels[i].mem );
+    }
+    delete [] levels;
+}
+
+// free everything initOCLFlowPyramids() allocated
+static void releaseOCLFlowPyramids()
+{
+    for( int f=0 ; f<numFrameSlots ; f++ ) {
+        ocl_frame_pyramids &P = framePyramids[f];
+        P.img->release();        delete P.img;
+        P.Ix->release();         delete P.Ix;
+        P.Iy->release();         delete P.Iy;
+        P.G->release();          delete P.G;
+        P.img_float->release();  delete P.img_float;
+    }
+
+    releaseFlowLevels( flowLvl );
+    flowLvl = NULL;
+    if( backFlowLvl != NULL ) {
+        releaseFlowLevels( backFlowLvl );
+        backFlowLvl = NULL;
+        clReleaseMemObject( fb_err_mem );
+        clReleaseMemObject( fb_mask_mem );
+    }
+}
+
+void resetOCLFlowFrames()
+{
+    for( int f=0 ; f<numFrameSlots ; f++ ) {
+        framePyramids[f].built = false;
+    }
+}
+
+#ifndef OCLFLOW_HEADLESS
+cl_context initOCLFlow(GLuint vbo, int devId)
+{
+    cl_int err;
+    opencl_init(devId);
+    initOCLFlowKernels();
+
+	cl_program motion_programs = buildProgramFromFile(context,"motion.cl");
+    update_motion_kernel = clCreateKernel( motion_programs, "motion", &err );
+    checkErr(err, __LINE__, "clCreateKernel (motion)");
+
+    images[1] = ocl_load_image( context, "data/minicooper/frame10.pgm", err );
+    images[0] = ocl_load_image( context, "data/minicooper/frame11.pgm", err );
+    initOCLFlowPyramids();
 
     // get a handle to the VBO that stores point start/end locations 
     vbo_cl_mem = clCreateFromGLBuffer( context, CL_MEM_READ_WRITE, vbo, &err );
@@ -1302,27 +1621,112 @@ cl_context initOCLFlow(GLuint vbo, int devId)
 
     return context;
 }
+#endif
+
+cl_context initOCLFlowHeadless(int devId, int w, int h)
+{
+    cl_int err;
+    opencl_init(devId);
+    initOCLFlowKernels();
+
+    images[0] = ocl_init_image( context, NULL, w, h, err );
+    images[1] = ocl_init_image( context, NULL, w, h, err );
+    initOCLFlowPyramids();
+
+    return context;
+}
 
-float computeOCLFlow(int curr, int next)
+// build all the pyramids for images[idx]: the image itself and its float
+// version for when it is J, the derivatives and G for when it is I
+static void buildFramePyramids(int idx)
 {
-	float t_flow = 0;
-    // todo: don't need to refill both images, only the new one. 
     cl_int err;
-    I->fill( images[curr], downfilter_kernel_x, downfilter_kernel_y );
-    J->fill( images[next], downfilter_kernel_x, downfilter_kernel_y );
+    ocl_frame_pyramids &P = framePyramids[idx];
+    if( useFusedDownfilter ) {
+        P.img->fill( images[idx], downfilter_kernel_5x5 );
+    } else {
+        P.img->fill( images[idx], downfilter_kernel_x, downfilter_kernel_y );
+    }
     cl_int4 dx_Wx = { -1, 0,  1, 0 };
     cl_int4 dx_Wy = { 3, 10,  3, 0};
 
-    err = Ix->pyrFill( *I, filter_3x1, filter_1x3, dx_Wx, dx_Wy ); checkErr( err, __LINE__,"pyrFill Ix");
+    err = P.Ix->pyrFill( *P.img, filter_3x1, filter_1x3, dx_Wx, dx_Wy ); checkErr( err, __LINE__,"pyrFill Ix");
     cl_int4 dy_Wx = { 3, 10, 3, 0};
     cl_int4 dy_Wy = { -1, 0, 1, 0}; 
-    err = Iy->pyrFill( *I, filter_3x1, filter_1x3, dy_Wx, dy_Wy ); checkErr( err, __LINE__,"pyrFill Iy");
+    err = P.Iy->pyrFill( *P.img, filter_3x1, filter_1x3, dy_Wx, dy_Wy ); checkErr( err, __LINE__,"pyrFill Iy");
 
-    err = G->G_Fill( *Ix, *Iy, filter_G ); checkErr( err, __LINE__, "G Fill");
-    J_float->convFill( *J, convert_kernel );
-    t_flow = calc_flow( *I, *J, *Ix, *Iy, *G, *J_float, flowLvl, lkflow_kernel, command_queue );
+    err = P.G->G_Fill( *P.Ix, *P.Iy, filter_G ); checkErr( err, __LINE__, "G Fill");
+    err = P.img_float->convFill( *P.img, convert_kernel ); checkErr( err, __LINE__, "convFill");
+    P.built = true;
+}
 
-    updateFlowBuffer(vbo_cl_mem, flowLvl[0].mem, flowLvl[0].w, flowLvl[0].h) ;
+// images[next] is the new frame.  images[curr] was the new frame of the
+// previous call so its pyramids are already built, except on the first call.
+static void buildPairPyramids(int curr, int next)
+{
+    shrDeltaT(2);
+    if( !framePyramids[curr].built ) buildFramePyramids( curr );
+    buildFramePyramids( next );
+    clFinish( command_queue );
+    t_pyramids = (float)shrDeltaT(2)*1000.0f;
+}
+
+// compare flowLvl[0] with backFlowLvl[0], returns the kernel time in ms
+static float checkFlowConsistency()
+{
+    cl_int err;
+    size_t global_work_size[2];
+    size_t local_work_size[2];
+    cl_event timer;
+    int w = flowLvl[0].w;
+    int h = flowLvl[0].h;
+
+    local_work_size[0] = 32;
+    local_work_size[1] = 4;
+    global_work_size[0] = local_work_size[0] * DivUp( w, local_work_size[0] ) ;
+    global_work_size[1] = local_work_size[1] * DivUp( h, local_work_size[1] ) ;
+
+    int argCnt = 0;
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_mem), &flowLvl[0].mem );
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_mem), &backFlowLvl[0].mem );
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_mem), &fb_err_mem );
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_mem), &fb_mask_mem );
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_int), &w );
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_int), &h );
+    clSetKernelArg( consistency_kernel, argCnt++, sizeof(cl_float), &fbMaxError );
+    err = clEnqueueNDRangeKernel( command_queue, consistency_kernel, 2, 0,
+        global_work_size, local_work_size, 0, NULL, &timer );
+    checkErr(err, __LINE__, "flow_consistency");
+
+    clWaitForEvents( 1, &timer );
+    float t = (float)elapsedTimeInSeconds( timer )*1000.0f;
+    flowProfiler.record( "flow_consistency", timer );
+    clReleaseEvent( timer );
+    return t;
+}
+
+float computeOCLFlowStages(int curr, int next)
+{
+	float t_flow = 0;
+    buildPairPyramids( curr, next );
+
+    ocl_frame_pyramids &I = framePyramids[curr];
+    ocl_frame_pyramids &J = framePyramids[next];
+    std::vector<cl_event> timers( numLevels );
+    calc_flow( *I.img, *J.img, *I.Ix, *I.Iy, *I.G, *J.img_float, flowLvl, numLevels, lkflow_kernel, command_queue, &timers[0] );
+    clWaitForEvents( 1, &timers[0] );
+    t_flow = flowTime( &timers[0], numLevels, "lkflow" );
+
+    if( useConsistencyCheck ) {
+        // the pyramids of both frames are complete, so the backward flow only
+        // costs the lkflow passes with I and J swapped
+        calc_flow( *J.img, *I.img, *J.Ix, *J.Iy, *J.G, *I.img_float, backFlowLvl, numLevels, lkflow_kernel, command_queue, &timers[0] );
+        clWaitForEvents( 1, &timers[0] );
+        t_backward = flowTime( &timers[0], numLevels, "lkflow backward" );
+        t_backward += checkFlowConsistency();
+    }
+    flowProfiler.frameDone();
+    flowProfiler.collect( false );
 
     // qeury some data for expected results minicooper data set
     // query_float2_buffer( flowLvl[1], command_queue, 100, 100 );
@@ -1335,3 +1739,458 @@ float computeOCLFlow(int curr, int next)
     return t_flow;
 }
 
+void readOCLFlow(cl_float2 *flow)
+{
+    cl_event timer;
+    cl_int err = clEnqueueReadBuffer( command_queue, flowLvl[0].mem, CL_TRUE,
+        0, flowLvl[0].w*flowLvl[0].h*sizeof(cl_float2), flow, 0, NULL, &timer );
+    checkErr( err, __LINE__, "readOCLFlow: clEnqueueReadBuffer" );
+    flowProfiler.record( "read flow", timer );
+    clReleaseEvent( timer );
+}
+
+void readOCLFlowConsistency(cl_float *fbError, cl_uchar *mask)
+{
+    cl_int err;
+    int pixels = flowLvl[0].w * flowLvl[0].h;
+    if( fbError != NULL ) {
+        err = clEnqueueReadBuffer( command_queue, fb_err_mem, CL_TRUE, 0, pixels*sizeof(cl_float), fbError, 0, NULL, NULL );
+        checkErr( err, __LINE__, "readOCLFlowConsistency: error" );
+    }
+    if( mask != NULL ) {
+        err = clEnqueueReadBuffer( command_queue, fb_mask_mem, CL_TRUE, 0, pixels*sizeof(cl_uchar), mask, 0, NULL, NULL );
+        checkErr( err, __LINE__, "readOCLFlowConsistency: mask" );
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sparse feature tracking
+////////////////////////////////////////////////////////////////////////////////
+
+// Points whose G has a smaller eigenvalue than this are not detected and are
+// lost while tracking.  G sums the squares of derivatives 32x the gradient
+// over the 9x9 window, so 1000 is a gradient of only about 0.1 grey levels per
+// pixel across the window.
+float kltMinEigen = 1000.0f;
+
+// detected corners need their window to fit inside the image, and the
+// derivatives under it to be real ones: the Scharr filters reach this far and
+// leave the border they can not reach at 0.  The window is lkWindowRadius.
+#define GRADIENT_RADIUS 1
+
+static cl_mem eig_mem = NULL;
+static cl_mem corners_mem = NULL;
+static cl_mem corner_count_mem = NULL;
+static int maxCorners = 0;
+
+static cl_mem points_mem = NULL;
+static cl_mem point_flow_mem = NULL;
+static cl_mem point_status_mem = NULL;
+static cl_mem point_err_mem = NULL;
+static int pointCapacity = 0;
+
+static bool strongerCorner( const cl_float4 &a, const cl_float4 &b )
+{
+    return a.s[2] > b.s[2];
+}
+
+int detectOCLFeatures(int idx, cl_float2 *points, int maxPoints, float quality, float minDistance)
+{
+    cl_int err;
+    size_t global_work_size[2];
+    size_t local_work_size[2];
+
+    if( !framePyramids[idx].built ) buildFramePyramids( idx );
+    ocl_image<CL_RGBA, CL_SIGNED_INT32> &G = framePyramids[idx].G->imgLvl[0];
+    int w = G.w;
+    int h = G.h;
+
+    if( eig_mem == NULL ) {
+        // with ties broken in scan order there is at most one 3x3 maximum in
+        // each 2x2 block
+        maxCorners = (int)(DivUp( w, 2 ) * DivUp( h, 2 ));
+        eig_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, w*h*sizeof(cl_float), NULL, &err );
+        checkErr(err, __LINE__, "creating eigenvalue buffer");
+        corners_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, maxCorners*sizeof(cl_float4), NULL, &err );
+        checkErr(err, __LINE__, "creating corner buffer");
+        corner_count_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, sizeof(cl_int), NULL, &err );
+        checkErr(err, __LINE__, "creating corner count");
+    }
+
+    local_work_size[0] = 32;
+    local_work_size[1] = 4;
+    global_work_size[0] = local_work_size[0] * DivUp( w, local_work_size[0] ) ;
+    global_work_size[1] = local_work_size[1] * DivUp( h, local_work_size[1] ) ;
+
+    int argCnt = 0;
+    clSetKernelArg( min_eigen_kernel, argCnt++, sizeof(cl_mem), &G.image_mem );
+    clSetKernelArg( min_eigen_kernel, argCnt++, sizeof(cl_mem), &eig_mem );
+    clSetKernelArg( min_eigen_kernel, argCnt++, sizeof(cl_int), &w );
+    clSetKernelArg( min_eigen_kernel, argCnt++, sizeof(cl_int), &h );
+    cl_event timer;
+    err = clEnqueueNDRangeKernel( command_queue, min_eigen_kernel, 2, 0,
+        global_work_size, local_work_size, 0, NULL, &timer );
+    checkErr(err, __LINE__, "min_eigen");
+    flowProfiler.record( "min_eigen", timer );
+    clReleaseEvent( timer );
+
+    cl_int count = 0;
+    err = clEnqueueWriteBuffer( command_queue, corner_count_mem, CL_TRUE, 0, sizeof(cl_int), &count, 0, NULL, NULL );
+    checkErr(err, __LINE__, "clear corner count");
+
+    int border = lkWindowRadius + GRADIENT_RADIUS;
+    argCnt = 0;
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_mem), &eig_mem );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_int), &w );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_int), &h );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_int), &border );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_float), &kltMinEigen );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_mem), &corners_mem );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_mem), &corner_count_mem );
+    clSetKernelArg( select_features_kernel, argCnt++, sizeof(cl_int), &maxCorners );
+    err = clEnqueueNDRangeKernel( command_queue, select_features_kernel, 2, 0,
+        global_work_size, local_work_size, 0, NULL, &timer );
+    checkErr(err, __LINE__, "select_features");
+    flowProfiler.record( "select_features", timer );
+    clReleaseEvent( timer );
+
+    err = clEnqueueReadBuffer( command_queue, corner_count_mem, CL_TRUE, 0, sizeof(cl_int), &count, 0, NULL, NULL );
+    checkErr(err, __LINE__, "read corner count");
+    if( count > maxCorners ) count = maxCorners;
+    if( count == 0 ) return 0;
+
+    std::vector<cl_float4> corners( count );
+    err = clEnqueueReadBuffer( command_queue, corners_mem, CL_TRUE, 0, count*sizeof(cl_float4), &corners[0], 0, NULL, NULL );
+    checkErr(err, __LINE__, "read corners");
+
+    // take the strongest corners first, skipping those closer than
+    // minDistance to one already taken.  The taken corners are binned in a
+    // grid of minDistance cells so only the 3x3 cells around need checking.
+    std::sort( corners.begin(), corners.end(), strongerCorner );
+    float minEig = quality * corners[0].s[2];
+    float cell = minDistance > 1.0f ? minDistance : 1.0f;
+    int gridW = (int)(w / cell) + 1;
+    int gridH = (int)(h / cell) + 1;
+    std::vector< std::vector<cl_float2> > grid( gridW * gridH );
+
+    int found = 0;
+    for( int c=0 ; c<count && found<maxPoints ; c++ ) {
+        if( corners[c].s[2] < minEig ) break;
+        int gx = (int)(corners[c].s[0] / cell);
+        int gy = (int)(corners[c].s[1] / cell);
+
+        bool tooClose = false;
+        for( int y=std::max(gy-1, 0) ; y<=std::min(gy+1, gridH-1) && !tooClose ; y++ ) {
+            for( int x=std::max(gx-1, 0) ; x<=std::min(gx+1, gridW-1) && !tooClose ; x++ ) {
+                std::vector<cl_float2> &taken = grid[ y*gridW + x ];
+                for( size_t t=0 ; t<taken.size() ; t++ ) {
+                    float dx = taken[t].s[0] - corners[c].s[0];
+                    float dy = taken[t].s[1] - corners[c].s[1];
+                    if( dx*dx + dy*dy < minDistance*minDistance ) {
+                        tooClose = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if( tooClose ) continue;
+
+        cl_float2 pt;
+        pt.s[0] = corners[c].s[0];
+        pt.s[1] = corners[c].s[1];
+        grid[ gy*gridW + gx ].push_back( pt );
+        points[found++] = pt;
+    }
+    return found;
+}
+
+float trackOCLFeatures(int curr, int next, const cl_float2 *points, int count,
+                       cl_float2 *nextPoints, cl_uchar *status, cl_float *error)
+{
+    cl_int err;
+    size_t global_work_size[1];
+    size_t local_work_size[1];
+    float t_track = 0.0f;
+
+    buildPairPyramids( curr, next );
+    if( count <= 0 ) return 0.0f;
+
+    if( count > pointCapacity ) {
+        if( points_mem != NULL ) {
+            clReleaseMemObject( points_mem );
+            clReleaseMemObject( point_flow_mem );
+            clReleaseMemObject( point_status_mem );
+            clReleaseMemObject( point_err_mem );
+        }
+        pointCapacity = count;
+        points_mem = clCreateBuffer( context, CL_MEM_READ_ONLY, count*sizeof(cl_float2), NULL, &err );
+        checkErr(err, __LINE__, "creating point buffer");
+        point_flow_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, count*sizeof(cl_float2), NULL, &err );
+        checkErr(err, __LINE__, "creating point flow buffer");
+        point_status_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, count*sizeof(cl_uchar), NULL, &err );
+        checkErr(err, __LINE__, "creating point status buffer");
+        point_err_mem = clCreateBuffer( context, CL_MEM_READ_WRITE, count*sizeof(cl_float), NULL, &err );
+        checkErr(err, __LINE__, "creating point error buffer");
+    }
+
+    // the reads at the end are blocking, so points stays valid until the write is done
+    err = clEnqueueWriteBuffer( command_queue, points_mem, CL_FALSE, 0, count*sizeof(cl_float2), points, 0, NULL, NULL );
+    checkErr(err, __LINE__, "write points");
+
+    ocl_frame_pyramids &I = framePyramids[curr];
+    ocl_frame_pyramids &J = framePyramids[next];
+    std::vector<cl_event> timers( numLevels );
+
+    local_work_size[0] = 64;
+    global_work_size[0] = local_work_size[0] * DivUp( count, local_work_size[0] );
+
+    // beginning at the top level work down the base (largest)
+    for( int i=numLevels-1; i>=0 ; i-- ) {
+        int argCnt = 0;
+        int use_guess = ( i < numLevels-1 ) ? 1 : 0;
+
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &I.img->imgLvl[i].image_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &I.Ix->imgLvl[i].image_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &I.Iy->imgLvl[i].image_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &I.G->imgLvl[i].image_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &J.img_float->imgLvl[i].image_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &points_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &point_flow_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &point_status_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_mem), &point_err_mem );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_int), &count );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_int), &i );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_int), &I.img->imgLvl[i].w );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_int), &I.img->imgLvl[i].h );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_int), &use_guess );
+        clSetKernelArg( lkflow_sparse_kernel, argCnt++, sizeof(cl_float), &kltMinEigen );
+
+        err = clEnqueueNDRangeKernel( command_queue, lkflow_sparse_kernel, 1, 0,
+            global_work_size, local_work_size, 0, NULL, &timers[i] );
+        checkErr( err, __LINE__, "lkflow_sparse");
+    }
+
+    err = clEnqueueReadBuffer( command_queue, point_flow_mem, CL_TRUE, 0, count*sizeof(cl_float2), nextPoints, 0, NULL, NULL );
+    checkErr(err, __LINE__, "read point flow");
+    err = clEnqueueReadBuffer( command_queue, point_status_mem, CL_TRUE, 0, count*sizeof(cl_uchar), status, 0, NULL, NULL );
+    checkErr(err, __LINE__, "read point status");
+    if( error != NULL ) {
+        err = clEnqueueReadBuffer( command_queue, point_err_mem, CL_TRUE, 0, count*sizeof(cl_float), error, 0, NULL, NULL );
+        checkErr(err, __LINE__, "read point error");
+    }
+
+    for( int p=0 ; p<count ; p++ ) {
+        nextPoints[p].s[0] += points[p].s[0];
+        nextPoints[p].s[1] += points[p].s[1];
+    }
+    t_track = flowTime( &timers[0], numLevels, "klt" );
+    flowProfiler.frameDone();
+    flowProfiler.collect( false );
+    return t_track;
+}
+
+void resizeOCLFlow(int w, int h, int levels)
+{
+    cl_int err;
+    releaseOCLFlowPyramids();
+    for( int f=0 ; f<numFrameSlots ; f++ ) {
+        clReleaseMemObject( images[f].image_mem );
+        images[f] = ocl_init_image( context, NULL, w, h, err );
+    }
+    numLevels = levels;
+    initOCLFlowPyramids();
+
+    // the corner detection buffers are sized for the frame, allocate them again when needed
+    if( eig_mem != NULL ) {
+        clReleaseMemObject( eig_mem );
+        clReleaseMemObject( corners_mem );
+        clReleaseMemObject( corner_count_mem );
+        eig_mem = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipelined flow
+////////////////////////////////////////////////////////////////////////////////
+
+// Frame k goes through three stages, each on its own queue:
+//   upload:   pinned staging k%2 -> images[k%3]            (upload_queue)
+//   compute:  pyramids of frame k, flow k-1 -> k into
+//             pipeOut[k%2]                                 (command_queue)
+//   download: pipeOut[k%2] -> pinned result k%2            (download_queue)
+// The stages are chained with events, so while frame k computes frame k+1
+// can upload and the flow of frame k-1 can download.  Three image slots are
+// needed since the compute of frame k reads frames k-1 and k while frame k+1
+// uploads.
+static cl_command_queue upload_queue;
+static cl_command_queue download_queue;
+
+static cl_mem pinnedIn[2];
+static unsigned char *pinnedInPtr[2];
+static cl_mem pinnedOut[2];
+static cl_float2 *pinnedOutPtr[2];
+static ocl_buffer pipeOut[2];
+
+static cl_event uploadDone[2];              // per staging buffer, k%2
+static cl_event computeDone[MAX_FRAME_SLOTS]; // per image slot, k%3
+static cl_event downloadDone[2];            // per result, k%2
+static std::vector<cl_event> pipeTimers[2]; // lkflow events per result, k%2
+
+static int pipeFrames = 0;     // frames submitted so far
+static int pipePending = -1;   // frame whose flow has been enqueued but not returned
+
+// drop our reference to an event before reusing its slot
+static void releaseEvent( cl_event &event )
+{
+    if( event != NULL ) {
+        clReleaseEvent( event );
+        event = NULL;
+    }
+}
+
+cl_context initOCLFlowPipeline(int devId, int w, int h)
+{
+    cl_int err;
+    opencl_init(devId);
+    initOCLFlowKernels();
+
+    numFrameSlots = MAX_FRAME_SLOTS;
+    for( int f=0 ; f<numFrameSlots ; f++ ) {
+        images[f] = ocl_init_image( context, NULL, w, h, err );
+    }
+    initOCLFlowPyramids();
+
+    upload_queue = clCreateCommandQueue(context, cdDevice, CL_QUEUE_PROFILING_ENABLE, &err);
+    checkErr(err, __LINE__, "clCreateCommandQueue (upload)");
+    download_queue = clCreateCommandQueue(context, cdDevice, CL_QUEUE_PROFILING_ENABLE, &err);
+    checkErr(err, __LINE__, "clCreateCommandQueue (download)");
+
+    // the staging buffers are allocated by the runtime in page locked memory
+    // and stay mapped, so the transfers from and to them are plain DMAs
+    for( int i=0 ; i<2 ; i++ ) {
+        pinnedIn[i] = clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, w*h, NULL, &err );
+        checkErr(err, __LINE__, "creating pinned input");
+        pinnedInPtr[i] = (unsigned char *)clEnqueueMapBuffer( upload_queue, pinnedIn[i], CL_TRUE, CL_MAP_WRITE,
+            0, w*h, 0, NULL, NULL, &err );
+        checkErr(err, __LINE__, "mapping pinned input");
+
+        pinnedOut[i] = clCreateBuffer( context, CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, w*h*sizeof(cl_float2), NULL, &err );
+        checkErr(err, __LINE__, "creating pinned output");
+        pinnedOutPtr[i] = (cl_float2 *)clEnqueueMapBuffer( download_queue, pinnedOut[i], CL_TRUE, CL_MAP_READ,
+            0, w*h*sizeof(cl_float2), 0, NULL, NULL, &err );
+        checkErr(err, __LINE__, "mapping pinned output");
+
+        pipeTimers[i].resize( numLevels );
+    }
+
+    // the flow of consecutive frames goes to alternate buffers so one can be
+    // downloaded while the other is written
+    pipeOut[0] = flowLvl[0];
+    pipeOut[1] = flowLvl[0];
+    pipeOut[1].mem = clCreateBuffer( context, CL_MEM_READ_WRITE, w*h*sizeof(cl_float2), NULL, &err );
+    checkErr(err, __LINE__, "creating flow output");
+
+    return context;
+}
+
+unsigned char *nextOCLFlowFrame()
+{
+    // the staging buffer is free once its last upload is done
+    cl_event &upload = uploadDone[pipeFrames % 2];
+    if( upload != NULL ) clWaitForEvents( 1, &upload );
+    return pinnedInPtr[pipeFrames % 2];
+}
+
+// the flow to frame k, whose download must be complete
+static const cl_float2 *pipelineResult( int k, float *t_flow )
+{
+    float t = flowTime( &pipeTimers[k % 2][0], numLevels, "lkflow" );
+    if( t_flow != NULL ) *t_flow = t;
+    flowProfiler.frameDone();
+    flowProfiler.collect( false );
+    return pinnedOutPtr[k % 2];
+}
+
+const cl_float2 *submitOCLFlowFrame(float *t_flow)
+{
+    cl_int err;
+    int k = pipeFrames++;
+    int slot = k % MAX_FRAME_SLOTS;
+    unsigned int w = images[slot].w;
+    unsigned int h = images[slot].h;
+    cl_event wait[2];
+    cl_uint numWait;
+
+    // upload, once the compute that last read the image slot (of frame k-2,
+    // which read frame k-3) is done
+    cl_event &lastRead = computeDone[(k + 1) % MAX_FRAME_SLOTS];
+    numWait = 0;
+    if( lastRead != NULL ) wait[numWait++] = lastRead;
+    size_t origin[3] = {0};
+    size_t region[3] = {w, h, 1};
+    releaseEvent( uploadDone[k % 2] );
+    err = clEnqueueWriteImage( upload_queue, images[slot].image_mem, CL_FALSE, origin, region, w, 0,
+        pinnedInPtr[k % 2], numWait, numWait ? wait : NULL, &uploadDone[k % 2] );
+    checkErr(err, __LINE__, "pipeline upload");
+    flowProfiler.record( "upload", uploadDone[k % 2] );
+    clFlush( upload_queue );
+
+    const cl_float2 *result = NULL;
+    if( k > 0 ) {
+        // compute, once this frame is uploaded and the flow of frame k-2 has
+        // been downloaded out of the output buffer
+        numWait = 0;
+        wait[numWait++] = uploadDone[k % 2];
+        if( downloadDone[k % 2] != NULL ) wait[numWait++] = downloadDone[k % 2];
+        err = clEnqueueWaitForEvents( command_queue, numWait, wait );
+        checkErr(err, __LINE__, "pipeline compute wait");
+
+        int prev = (k - 1) % MAX_FRAME_SLOTS;
+        if( !framePyramids[prev].built ) buildFramePyramids( prev );
+        buildFramePyramids( slot );
+
+        ocl_frame_pyramids &I = framePyramids[prev];
+        ocl_frame_pyramids &J = framePyramids[slot];
+        flowLvl[0] = pipeOut[k % 2];
+        calc_flow( *I.img, *J.img, *I.Ix, *I.Iy, *I.G, *J.img_float, flowLvl, numLevels,
+            lkflow_kernel, command_queue, &pipeTimers[k % 2][0] );
+        releaseEvent( computeDone[slot] );
+        err = clEnqueueMarker( command_queue, &computeDone[slot] );
+        checkErr(err, __LINE__, "pipeline compute marker");
+        clFlush( command_queue );
+
+        // download, once computed
+        releaseEvent( downloadDone[k % 2] );
+        err = clEnqueueReadBuffer( download_queue, pipeOut[k % 2].mem, CL_FALSE, 0, w*h*sizeof(cl_float2),
+            pinnedOutPtr[k % 2], 1, &computeDone[slot], &downloadDone[k % 2] );
+        checkErr(err, __LINE__, "pipeline download");
+        flowProfiler.record( "read flow", downloadDone[k % 2] );
+        clFlush( download_queue );
+
+        // hand back the flow of the previous frame while this one is in flight
+        if( pipePending >= 0 ) {
+            clWaitForEvents( 1, &downloadDone[pipePending % 2] );
+            result = pipelineResult( pipePending, t_flow );
+        }
+        pipePending = k;
+    }
+    return result;
+}
+
+const cl_float2 *drainOCLFlowPipeline(float *t_flow)
+{
+    if( pipePending < 0 ) return NULL;
+    int k = pipePending;
+    pipePending = -1;
+    clWaitForEvents( 1, &downloadDone[k % 2] );
+    return pipelineResult( k, t_flow );
+}
+
+#ifndef OCLFLOW_HEADLESS
+float computeOCLFlow(int curr, int next)
+{
+    float t_flow = computeOCLFlowStages( curr, next );
+    updateFlowBuffer(vbo_cl_mem, flowLvl[0].mem, flowLvl[0].w, flowLvl[0].h) ;
+    return t_flow;
+}
+#endif
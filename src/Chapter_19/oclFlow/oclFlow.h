@@ -0,0 +1,160 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+//
+// Header information for communicating with the flow object in oclFlow.cpp.
+// It is shared by the GL viewer (flowGL.cpp) and the headless drivers, which
+// are built with OCLFLOW_HEADLESS defined and never touch GL.
+//
+#ifndef OCLFLOW_H
+#define OCLFLOW_H
+
+#include <CL/cl.h>
+
+#ifdef MAC
+#define SINGLE_CHANNEL_TYPE CL_R
+#else
+#define SINGLE_CHANNEL_TYPE CL_INTENSITY
+#endif 
+
+template<cl_channel_order co, cl_channel_type dt>
+struct ocl_image {
+    cl_mem image_mem;
+    unsigned int w;
+    unsigned int h;
+    cl_image_format image_format;
+} ;
+
+// frames held on the device: two for the flow between a pair, one more for
+// the pipeline to upload into while that pair computes
+#define MAX_FRAME_SLOTS 3
+
+extern ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> images[MAX_FRAME_SLOTS];
+extern char device_string[1024];
+
+// Whether the filters write the pyramid images directly rather than going
+// through a scratch buffer copy.  Must be set before the flow is initialized.
+extern bool useImageWrites;
+
+// Whether the image pyramids are built with the fused 5x5 downsample kernel
+// rather than separate x and y passes
+extern bool useFusedDownfilter;
+
+// Whether computeOCLFlowStages() also computes the flow from images[next]
+// back to images[curr] and checks the two against each other.  Must be set
+// before the flow is initialized.
+extern bool useConsistencyCheck;
+// Largest forward-backward error in pixels for a flow vector to be consistent
+extern float fbMaxError;
+
+// Number of pyramid levels, 0 picks it from the frame size and maxMotion with
+// choosePyramidLevels().  Must be set before the flow is initialized.
+extern int numLevels;
+extern float maxMotion;
+
+// Enough levels to track motions of up to max_motion pixels, but no more than
+// fit in a w x h image
+int choosePyramidLevels(int w, int h, float max_motion);
+
+// LK window radius, iterations per pyramid level and gain.  They are compiled
+// into the kernels, set them before the flow is initialized or change them
+// with setOCLFlowParameters().
+extern int lkWindowRadius;
+extern int lkIterations;
+extern float lkGain;
+
+// Rebuild the kernels with a different window radius, iterations and gain
+void setOCLFlowParameters(int windowRadius, int iterations, float gain);
+
+// Reallocate the images and pyramids for w x h frames and levels pyramid
+// levels (0 picks them from maxMotion).  Not for the pipeline.
+void resizeOCLFlow(int w, int h, int levels);
+
+// Start a new sequence: the pyramids of both frames are built by the next
+// computeOCLFlowStages() instead of reusing those of images[curr]
+void resetOCLFlowFrames();
+
+// Time taken to build the pyramids in the last computeOCLFlowStages() call, in ms
+extern float t_pyramids;
+// Time spent in the backward lkflow and the consistency check kernels in the
+// last computeOCLFlowStages() call, in ms
+extern float t_backward;
+
+void ocl_set_image( ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> img, cl_context context, unsigned char *image_grey_ub, cl_int &err );
+ocl_image<SINGLE_CHANNEL_TYPE, CL_UNSIGNED_INT8> ocl_init_image( cl_context context, unsigned char *image_grey_ub, int w, int h, cl_int &err );
+
+#ifndef OCLFLOW_HEADLESS
+// Create a GL sharing context on device devId and set up the pyramids for the
+// reference minicooper frames.  The flow computed by computeOCLFlow() is written
+// as line end points into vbo.
+cl_context initOCLFlow(GLuint vbo, int devId);
+float computeOCLFlow(int curr, int next);
+#endif
+
+// Create a plain context on device devId (no GL sharing) and set up the
+// pyramids for w x h frames.  images[0] and images[1] are left empty and are
+// filled in with ocl_set_image().
+cl_context initOCLFlowHeadless(int devId, int w, int h);
+
+// Compute the flow from images[curr] to images[next] into the full resolution
+// flow level.  images[next] must hold the new frame: only its pyramids are
+// built, those of images[curr] are reused from the previous call (where it was
+// images[next]).  Returns the time spent in the lkflow kernels in ms.
+float computeOCLFlowStages(int curr, int next);
+
+// Read the full resolution flow back to the host, flow must hold w*h entries
+void readOCLFlow(cl_float2 *flow);
+
+// Read back the consistency check of the last flow, with useConsistencyCheck
+// set.  fbError gets the forward-backward error of each pixel in pixels and
+// mask 255 where it is at most fbMaxError and 0 where it is not, or where the
+// flow leaves the image.  Either may be NULL, both hold w*h entries.
+void readOCLFlowConsistency(cl_float *fbError, cl_uchar *mask);
+
+// Pipelined flow over a stream of w x h frames.  Each frame is uploaded, has
+// its flow from the previous frame computed and is read back on separate
+// queues chained with events, so the upload of one frame, the flow of the
+// one before and the read back of the one before that overlap.  Creates a
+// plain context on device devId with three image slots.
+cl_context initOCLFlowPipeline(int devId, int w, int h);
+
+// Pinned host memory (w*h bytes) to write the next frame into before
+// submitting it, waits if it is still being uploaded
+unsigned char *nextOCLFlowFrame();
+
+// Start the frame written to nextOCLFlowFrame() through the pipeline.  Returns
+// the flow to the frame submitted before it (w*h vectors, valid until the next
+// call), or NULL while the pipeline fills.  t_flow (may be NULL) gets the
+// time spent in the lkflow kernels for that flow in ms.
+const cl_float2 *submitOCLFlowFrame(float *t_flow);
+
+// After the last frame, returns the flow still in the pipeline, then NULL
+const cl_float2 *drainOCLFlowPipeline(float *t_flow);
+
+// Smallest eigenvalue of G for a point to be detected or kept while tracking
+extern float kltMinEigen;
+
+// Find up to maxPoints Shi-Tomasi corners in images[idx], strongest first.
+// Corners are kept if their response is at least quality times the strongest
+// one and they are at least minDistance pixels from any stronger corner kept.
+// Builds the pyramids of images[idx] if they have not been built yet.
+// Returns the number of points written.
+int detectOCLFeatures(int idx, cl_float2 *points, int maxPoints, float quality, float minDistance);
+
+// Track count points from images[curr] to images[next] through the pyramids,
+// building them as computeOCLFlowStages() does.  Writes each point's new
+// position to nextPoints and whether it was tracked (1) or lost (0) to
+// status.  error (may be NULL) gets the mean absolute difference between the
+// windows, and is only meaningful for tracked points.  Returns the time spent
+// in the tracking kernels in ms.
+float trackOCLFeatures(int curr, int next, const cl_float2 *points, int count,
+                       cl_float2 *nextPoints, cl_uchar *status, cl_float *error);
+
+#endif // OCLFLOW_H